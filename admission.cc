@@ -0,0 +1,373 @@
+/* admission.cc -- screening connection attempts before enet sees them.
+   Copyright (C) 2011 Memeo, Inc. */
+
+#include <cstring>
+#include <cstdlib>
+#include <cstdio>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include "admission.h"
+
+namespace enet
+{
+
+// Sources tracked for rate limiting at once, in sets of kBucketWays. A
+// source can only go in its own set, so finding or placing it looks at no
+// more than kBucketWays buckets; a new source takes an idle one, and if
+// none in its set are idle it is refused until one is.
+static const size_t kMaxTrackedSources = 65536;
+static const size_t kBucketWays = 4;
+
+// Cookies change every kCookieEpoch seconds; the previous one is still
+// accepted, so a challenge stays good for between one and two epochs.
+static const time_t kCookieEpoch = 30;
+
+// The challenge datagram: these four bytes, then the cookie in network
+// byte order. 0xFFFF where enet expects a peer ID marks it as compressed
+// and out of band, so a host that doesn't know about cookies drops it.
+static const enet_uint8 kChallengeMagic[4] = { 0xFF, 0xFF, 'C', 'K' };
+static const size_t kChallengeLength = 8;
+
+Admission::Admission()
+    : rate(0), burst(0), cookies(false)
+{
+    pthread_mutex_init(&lock, NULL);
+    TrieNode root = { { -1, -1 }, kNoRule };
+    trie.push_back(root);
+    ::memset(&stats, 0, sizeof(AdmissionStats));
+    FILE *random = fopen("/dev/urandom", "rb");
+    if (random == NULL || fread(secret, sizeof(secret), 1, random) != 1)
+    {
+        secret[0] = (enet_uint32) time(NULL);
+        secret[1] = (enet_uint32) getpid();
+        secret[2] = (enet_uint32) (size_t) this;
+        secret[3] = (enet_uint32) clock();
+    }
+    if (random != NULL)
+        fclose(random);
+}
+
+Admission::~Admission()
+{
+    pthread_mutex_destroy(&lock);
+}
+
+void Admission::SetRateLimit(double perSecond, double burst_)
+{
+    pthread_mutex_lock(&lock);
+    rate = perSecond;
+    burst = burst_ < 1 ? 1 : burst_;
+    Bucket empty = { 0, false, 0, 0 };
+    buckets.assign(perSecond > 0 ? kMaxTrackedSources : 0, empty);
+    pthread_mutex_unlock(&lock);
+}
+
+void Admission::SetCookies(bool enabled)
+{
+    pthread_mutex_lock(&lock);
+    cookies = enabled;
+    pthread_mutex_unlock(&lock);
+}
+
+bool Admission::AddRule(const char *cidr, bool allow)
+{
+    char address[32];
+    int bits = 32;
+    const char *slash = ::strchr(cidr, '/');
+    size_t length = slash != NULL ? (size_t) (slash - cidr) : ::strlen(cidr);
+    if (length >= sizeof(address))
+        return false;
+    ::memcpy(address, cidr, length);
+    address[length] = '\0';
+    if (slash != NULL)
+    {
+        char *end;
+        bits = (int) ::strtol(slash + 1, &end, 10);
+        if (slash[1] == '\0' || *end != '\0' || bits < 0 || bits > 32)
+            return false;
+    }
+    struct in_addr in;
+    if (!inet_aton(address, &in))
+        return false;
+    enet_uint32 prefix = ntohl(in.s_addr);
+    
+    pthread_mutex_lock(&lock);
+    int node = 0;
+    for (int i = 0; i < bits; i++)
+    {
+        int bit = (prefix >> (31 - i)) & 1;
+        if (trie[node].children[bit] < 0)
+        {
+            TrieNode child = { { -1, -1 }, kNoRule };
+            trie.push_back(child);
+            trie[node].children[bit] = (int) trie.size() - 1;
+        }
+        node = trie[node].children[bit];
+    }
+    trie[node].verdict = allow ? kAllow : kDeny;
+    pthread_mutex_unlock(&lock);
+    return true;
+}
+
+void Admission::ClearRules()
+{
+    pthread_mutex_lock(&lock);
+    trie.resize(1);
+    trie[0].children[0] = trie[0].children[1] = -1;
+    trie[0].verdict = kNoRule;
+    pthread_mutex_unlock(&lock);
+}
+
+void Admission::GetStats(AdmissionStats *out)
+{
+    pthread_mutex_lock(&lock);
+    *out = stats;
+    pthread_mutex_unlock(&lock);
+}
+
+// Longest matching prefix; host is in network byte order.
+Admission::Verdict Admission::Lookup(enet_uint32 host)
+{
+    enet_uint32 address = ntohl(host);
+    Verdict verdict = trie[0].verdict;
+    int node = 0;
+    for (int i = 0; i < 32; i++)
+    {
+        node = trie[node].children[(address >> (31 - i)) & 1];
+        if (node < 0)
+            break;
+        if (trie[node].verdict != kNoRule)
+            verdict = trie[node].verdict;
+    }
+    return verdict;
+}
+
+// Keyed with the secret, so a flood can't be aimed at one set.
+size_t Admission::BucketSet(enet_uint32 host)
+{
+    enet_uint32 h = (host ^ secret[0]) * 2654435761U;
+    h ^= h >> 16;
+    h *= secret[1] | 1;
+    h ^= h >> 16;
+    return (h % (kMaxTrackedSources / kBucketWays)) * kBucketWays;
+}
+
+bool Admission::TakeToken(enet_uint32 host, enet_uint32 now)
+{
+    if (rate <= 0)
+        return true;
+    Bucket *set = &buckets[BucketSet(host)];
+    Bucket *bucket = NULL;
+    Bucket *idle = NULL;
+    for (size_t i = 0; i < kBucketWays && bucket == NULL; i++)
+    {
+        if (set[i].used && set[i].host == host)
+            bucket = &set[i];
+        // Sources whose buckets have refilled are indistinguishable from
+        // new ones, so they can make way.
+        else if (idle == NULL && (!set[i].used
+            || set[i].tokens + ENET_TIME_DIFFERENCE(now, set[i].updated) * rate / 1000 >= burst))
+            idle = &set[i];
+    }
+    if (bucket == NULL)
+    {
+        if (idle == NULL)
+            return false;
+        bucket = idle;
+        bucket->host = host;
+        bucket->used = true;
+        bucket->tokens = burst;
+        bucket->updated = now;
+    }
+    bucket->tokens += ENET_TIME_DIFFERENCE(now, bucket->updated) * rate / 1000;
+    if (bucket->tokens > burst)
+        bucket->tokens = burst;
+    bucket->updated = now;
+    if (bucket->tokens < 1)
+        return false;
+    bucket->tokens -= 1;
+    return true;
+}
+
+#define ROTL(x, b) (((x) << (b)) | ((x) >> (64 - (b))))
+#define SIPROUND                                                \
+    do {                                                        \
+        v0 += v1; v1 = ROTL(v1, 13); v1 ^= v0; v0 = ROTL(v0, 32); \
+        v2 += v3; v3 = ROTL(v3, 16); v3 ^= v2;                  \
+        v0 += v3; v3 = ROTL(v3, 21); v3 ^= v0;                  \
+        v2 += v1; v1 = ROTL(v1, 17); v1 ^= v2; v2 = ROTL(v2, 32); \
+    } while (0)
+
+// SipHash-2-4 of (host, port, epoch) under the secret, folded to 32 bits.
+enet_uint32 Admission::Cookie(const ENetAddress& address, enet_uint32 epoch)
+{
+    uint64_t k0 = ((uint64_t) secret[1] << 32) | secret[0];
+    uint64_t k1 = ((uint64_t) secret[3] << 32) | secret[2];
+    uint64_t v0 = k0 ^ 0x736f6d6570736575ULL;
+    uint64_t v1 = k1 ^ 0x646f72616e646f6dULL;
+    uint64_t v2 = k0 ^ 0x6c7967656e657261ULL;
+    uint64_t v3 = k1 ^ 0x7465646279746573ULL;
+    uint64_t words[3] = {
+        ((uint64_t) address.port << 32) | address.host,
+        epoch,
+        (uint64_t) 16 << 56
+    };
+    for (int i = 0; i < 3; i++)
+    {
+        v3 ^= words[i];
+        SIPROUND;
+        SIPROUND;
+        v0 ^= words[i];
+    }
+    v2 ^= 0xFF;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+    uint64_t hash = v0 ^ v1 ^ v2 ^ v3;
+    enet_uint32 cookie = (enet_uint32) (hash ^ (hash >> 32));
+    // 0 is what clients that don't know about cookies usually send.
+    return cookie == 0 ? 1 : cookie;
+}
+
+// Pulls the data field out of the CONNECT command in the datagram host has
+// just received.
+bool Admission::ReadConnectData(ENetHost *host, enet_uint32 *data)
+{
+    const enet_uint8 *commands = host->receivedData;
+    size_t length = host->receivedDataLength;
+    enet_uint16 flags;
+    ::memcpy(&flags, commands, sizeof(enet_uint16));
+    flags = ENET_NET_TO_HOST_16(flags);
+    size_t headerSize = (flags & ENET_PROTOCOL_HEADER_FLAG_SENT_TIME) ? sizeof(ENetProtocolHeader) : 2;
+    if (host->checksum != NULL)
+        headerSize += sizeof(enet_uint32);
+    if (length < headerSize)
+        return false;
+    commands += headerSize;
+    length -= headerSize;
+    
+    enet_uint8 buffer[ENET_PROTOCOL_MAXIMUM_MTU];
+    if (flags & ENET_PROTOCOL_HEADER_FLAG_COMPRESSED)
+    {
+        if (host->compressor.context == NULL || host->compressor.decompress == NULL)
+            return false;
+        length = host->compressor.decompress(host->compressor.context, commands, length,
+            buffer, sizeof(buffer));
+        commands = buffer;
+    }
+    ENetProtocolConnect connect;
+    if (length < sizeof(ENetProtocolConnect))
+        return false;
+    ::memcpy(&connect, commands, sizeof(ENetProtocolConnect));
+    if ((connect.header.command & ENET_PROTOCOL_COMMAND_MASK) != ENET_PROTOCOL_COMMAND_CONNECT)
+        return false;
+    *data = ENET_NET_TO_HOST_32(connect.data);
+    return true;
+}
+
+// A server has challenged one of our connects: put the cookie in the
+// CONNECT command still waiting for an answer and have it resent now.
+void Admission::AnswerChallenge(ENetHost *host)
+{
+    enet_uint32 cookie;
+    ::memcpy(&cookie, host->receivedData + sizeof(kChallengeMagic), sizeof(enet_uint32));
+    for (ENetPeer *peer = host->peers; peer < &host->peers[host->peerCount]; ++peer)
+    {
+        if (peer->state != ENET_PEER_STATE_CONNECTING
+            || peer->address.host != host->receivedAddress.host
+            || peer->address.port != host->receivedAddress.port)
+            continue;
+        ENetList *lists[2] = { &peer->outgoingReliableCommands, &peer->sentReliableCommands };
+        for (int i = 0; i < 2; i++)
+        {
+            for (ENetListNode *node = enet_list_begin(lists[i]); node != enet_list_end(lists[i]);
+                 node = enet_list_next(node))
+            {
+                ENetOutgoingCommand *command = (ENetOutgoingCommand *) node;
+                if ((command->command.header.command & ENET_PROTOCOL_COMMAND_MASK) != ENET_PROTOCOL_COMMAND_CONNECT)
+                    continue;
+                // Already in network byte order.
+                command->command.connect.data = cookie;
+                if (i == 1)
+                {
+                    // Counts as timed out at the next service, which resends it.
+                    command->roundTripTimeout = 0;
+                    peer->nextTimeout = command->sentTime;
+                }
+            }
+        }
+    }
+}
+
+int Admission::Intercept(ENetHost *host, ENetEvent *event)
+{
+    const enet_uint8 *data = host->receivedData;
+    size_t length = host->receivedDataLength;
+    if (length == kChallengeLength && ::memcmp(data, kChallengeMagic, sizeof(kChallengeMagic)) == 0)
+    {
+        pthread_mutex_lock(&lock);
+        bool answer = cookies;
+        pthread_mutex_unlock(&lock);
+        if (!answer)
+            return 0;
+        AnswerChallenge(host);
+        return 1;
+    }
+    if (length < 2)
+        return 0;
+    enet_uint16 peerID;
+    ::memcpy(&peerID, data, sizeof(enet_uint16));
+    peerID = ENET_NET_TO_HOST_16(peerID);
+    // Only connects are sent before the sender has a peer ID.
+    if ((peerID & ~(ENET_PROTOCOL_HEADER_FLAG_MASK | ENET_PROTOCOL_HEADER_SESSION_MASK)) != ENET_PROTOCOL_MAXIMUM_PEER_ID)
+        return 0;
+    
+    int result = 1;
+    bool challenge = false;
+    enet_uint32 cookie = 0;
+    pthread_mutex_lock(&lock);
+    Verdict verdict = Lookup(host->receivedAddress.host);
+    if (verdict == kDeny)
+        stats.denied++;
+    else if (verdict == kAllow)
+        result = 0;
+    else if (!TakeToken(host->receivedAddress.host, enet_time_get()))
+        stats.rateLimited++;
+    else if (cookies)
+    {
+        enet_uint32 epoch = (enet_uint32) (time(NULL) / kCookieEpoch);
+        enet_uint32 presented;
+        cookie = Cookie(host->receivedAddress, epoch);
+        if (ReadConnectData(host, &presented)
+            && (presented == cookie || presented == Cookie(host->receivedAddress, epoch - 1)))
+            result = 0;
+        else
+        {
+            challenge = true;
+            stats.challenged++;
+        }
+    }
+    else
+        result = 0;
+    if (result == 0)
+        stats.admitted++;
+    pthread_mutex_unlock(&lock);
+    
+    if (challenge)
+    {
+        enet_uint8 reply[kChallengeLength];
+        ::memcpy(reply, kChallengeMagic, sizeof(kChallengeMagic));
+        cookie = htonl(cookie);
+        ::memcpy(reply + sizeof(kChallengeMagic), &cookie, sizeof(enet_uint32));
+        ENetBuffer buffer;
+        buffer.data = reply;
+        buffer.dataLength = sizeof(reply);
+        enet_socket_send(host->socket, &host->receivedAddress, &buffer, 1);
+    }
+    return result;
+}
+
+}
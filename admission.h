@@ -0,0 +1,90 @@
+/* admission.h -- screening connection attempts before enet sees them.
+   Copyright (C) 2011 Memeo, Inc. */
+
+#ifndef ENET_JS_ADMISSION_H
+#define ENET_JS_ADMISSION_H
+
+#include <enet/enet.h>
+#include <vector>
+#include <pthread.h>
+#include "intercept.h"
+
+namespace enet
+{
+
+struct AdmissionStats
+{
+    double admitted;    // connect attempts passed on to enet
+    double denied;      // dropped by a deny rule
+    double rateLimited; // dropped for exceeding the connect rate
+    double challenged;  // answered with a cookie challenge
+};
+
+// Screens CONNECT datagrams for a host, in this order:
+//
+//  - allow/deny rules by CIDR prefix, longest match winning; allowed
+//    sources skip the remaining checks.
+//  - a token bucket per source IP (and, as a backstop against spoofed
+//    floods, a fixed table of them, so each connect costs a bounded
+//    amount of work however many sources there are).
+//  - optionally, a stateless cookie: a connect whose data isn't the
+//    cookie for its source address gets a small challenge datagram back
+//    instead of a peer slot. A host with cookies on also answers the
+//    challenges it receives, patching the cookie into its pending connect
+//    and resending it, so both ends need cookies enabled.
+//
+// Everything else goes straight through. Settings may be changed from any
+// thread.
+class Admission : public Interceptor
+{
+public:
+    Admission();
+    ~Admission();
+    
+    int Intercept(ENetHost *host, ENetEvent *event);
+    
+    // perSecond of 0 turns rate limiting off.
+    void SetRateLimit(double perSecond, double burst);
+    void SetCookies(bool enabled);
+    // Returns false if cidr ("a.b.c.d/n" or "a.b.c.d") doesn't parse.
+    bool AddRule(const char *cidr, bool allow);
+    void ClearRules();
+    void GetStats(AdmissionStats *stats);
+    
+private:
+    enum Verdict { kNoRule, kAllow, kDeny };
+    
+    struct TrieNode
+    {
+        int children[2];
+        Verdict verdict;
+    };
+    
+    struct Bucket
+    {
+        enet_uint32 host;
+        bool used;
+        double tokens;
+        enet_uint32 updated;
+    };
+    
+    Verdict Lookup(enet_uint32 host);
+    size_t BucketSet(enet_uint32 host);
+    bool TakeToken(enet_uint32 host, enet_uint32 now);
+    enet_uint32 Cookie(const ENetAddress& address, enet_uint32 epoch);
+    bool ReadConnectData(ENetHost *host, enet_uint32 *data);
+    void AnswerChallenge(ENetHost *host);
+    
+    pthread_mutex_t lock;
+    std::vector<TrieNode> trie;
+    std::vector<Bucket> buckets;
+    double rate;
+    double burst;
+    bool cookies;
+    enet_uint32 secret[4];
+    AdmissionStats stats;
+};
+
+}
+
+#endif
@@ -0,0 +1,57 @@
+/* checksum.cc -- compares enet_crc32 with enet.js's CRC32C checksum.
+   Copyright (C) 2011 Memeo, Inc. */
+
+// Checksums datagram-sized buffers with each function and prints
+// megabytes per second as JSON. Build and run with `make bench-checksum'.
+
+#include <cstdio>
+#include <cstdlib>
+#include <sys/time.h>
+#include <enet/enet.h>
+#include "../checksum.h"
+
+static double Now()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static double Measure(ENetChecksumCallback checksum, ENetBuffer *buffers, size_t count,
+    size_t size, enet_uint32 *sink)
+{
+    size_t iterations = (256 * 1024 * 1024) / size;
+    double start = Now();
+    for (size_t i = 0; i < iterations; i++)
+        *sink ^= checksum(&buffers[i % count], 1);
+    return iterations * (double) size / (Now() - start) / (1024 * 1024);
+}
+
+int main(int argc, char **argv)
+{
+    enet::Crc32cInit();
+    const size_t sizes[] = { 64, 512, 1400, 4096 };
+    const size_t count = 64;
+    enet_uint32 sink = 0;
+    printf("{\n  \"hardware\": %s,\n  \"results\": [\n", enet::Crc32cHardware() ? "true" : "false");
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+    {
+        ENetBuffer buffers[count];
+        for (size_t i = 0; i < count; i++)
+        {
+            enet_uint8 *data = (enet_uint8 *) malloc(sizes[s]);
+            for (size_t j = 0; j < sizes[s]; j++)
+                data[j] = (enet_uint8) rand();
+            buffers[i].data = data;
+            buffers[i].dataLength = sizes[s];
+        }
+        double crc32 = Measure(enet_crc32, buffers, count, sizes[s], &sink);
+        double crc32c = Measure(enet::Crc32c, buffers, count, sizes[s], &sink);
+        printf("    { \"size\": %lu, \"enet_crc32MBps\": %.1f, \"crc32cMBps\": %.1f }%s\n",
+            (unsigned long) sizes[s], crc32, crc32c, s + 1 < sizeof(sizes) / sizeof(sizes[0]) ? "," : "");
+        for (size_t i = 0; i < count; i++)
+            free(buffers[i].data);
+    }
+    printf("  ],\n  \"sink\": %u\n}\n", sink);
+    return 0;
+}
@@ -0,0 +1,212 @@
+/* loopback.js -- throughput and latency of enet.js over 127.0.0.1.
+   Copyright (C) 2011 Memeo, Inc. */
+
+// Runs a client and a server Host in this process and has the server echo
+// every message back. Each case (packet flags x payload size) keeps WINDOW
+// messages in flight for a fixed time and reports throughput, round-trip
+// percentiles, native allocations and GC time per message. Results are
+// written to stdout as JSON.
+//
+//     node bench/loopback.js [seconds per case] [sizes, e.g. 8,1024] [link]
+//
+// link simulates network conditions in each direction, e.g.
+// loss=0.02,latency=50,jitter=5 for 2% loss and a 100ms round trip; see
+// Host.simulateLink for the keys.
+
+var enet = require('../node_modules/enet');
+var timing = require('../build/default/enetbench');
+
+var SECONDS = Number(process.argv[2] || 2);
+var SIZES = process.argv[3] ? process.argv[3].split(',').map(Number)
+    : [8, 64, 512, 1024, 4096, 16384, 65536];
+var FLAGS = [
+    { name: 'reliable', flags: enet.Packet.FLAG_RELIABLE },
+    { name: 'unreliable', flags: 0 },
+    { name: 'unsequenced', flags: enet.Packet.FLAG_UNSEQUENCED }
+];
+var LINK = parseLink(process.argv[4]);
+var WINDOW = 64;
+// An unreliable message that hasn't come back after this long is counted as
+// lost and its slot in the window is reused.
+var LOST_AFTER = 500000;
+var BASE_PORT = 17091;
+
+function percentile(sorted, p)
+{
+    if (sorted.length == 0)
+        return null;
+    var i = Math.min(sorted.length - 1, Math.floor(sorted.length * p));
+    return sorted[i];
+}
+
+function parseLink(spec)
+{
+    if (!spec)
+        return null;
+    var link = {};
+    spec.split(',').forEach(function(pair) {
+        var kv = pair.split('=');
+        link[kv[0]] = kv[0] == 'jitterDistribution' ? kv[1] : Number(kv[1]);
+    });
+    return link;
+}
+
+function allocations()
+{
+    var stats = enet.poolStats();
+    return stats.hits + stats.misses;
+}
+
+function runCase(port, kind, size, done)
+{
+    var server = new enet.Host(new enet.Address('127.0.0.1', port), 1);
+    var client = new enet.Host(new enet.Address('127.0.0.1', 0), 1);
+    if (LINK)
+    {
+        server.simulateLink(LINK);
+        client.simulateLink(LINK);
+    }
+    var payload = new Buffer(size);
+    for (var i = 0; i < size; i++)
+        payload[i] = i & 0xff;
+
+    // Send times by sequence number, for messages still in flight.
+    var inflight = {};
+    var outstanding = 0;
+    var seq = 0;
+    var rtts = [];
+    var messages = 0;
+    var lost = 0;
+    var peer = null;
+    var started = 0, allocStart = 0, gcStart = null;
+
+    function sendOne()
+    {
+        setSeq(payload, seq);
+        inflight[seq] = timing.now();
+        seq = (seq + 1) >>> 0;
+        outstanding++;
+        peer.sendBuffer(0, payload, kind.flags);
+    }
+
+    function fill()
+    {
+        while (outstanding < WINDOW)
+            sendOne();
+        client.flush();
+    }
+
+    server.on('message', function(p, packet, channel) {
+        // Send the received packet straight back, without copying it.
+        p.send(channel, packet);
+    });
+
+    client.on('connect', function(p) {
+        peer = p;
+        started = timing.now();
+        allocStart = allocations();
+        gcStart = timing.gcStats();
+        fill();
+    }).on('message', function(p, packet) {
+        var now = timing.now();
+        var data = packet.data();
+        var n = getSeq(data);
+        if (inflight[n] !== undefined)
+        {
+            rtts.push(now - inflight[n]);
+            delete inflight[n];
+            outstanding--;
+            messages++;
+        }
+        if (now - started < SECONDS * 1000000)
+            fill();
+    });
+
+    var sweep = setInterval(function() {
+        var now = timing.now();
+        for (var n in inflight)
+        {
+            if (now - inflight[n] > LOST_AFTER)
+            {
+                delete inflight[n];
+                outstanding--;
+                lost++;
+            }
+        }
+        if (peer == null)
+            return;
+        if (now - started < SECONDS * 1000000)
+        {
+            fill();
+            return;
+        }
+        clearInterval(sweep);
+        var elapsed = (now - started) / 1000000;
+        var allocs = allocations() - allocStart;
+        var gc = timing.gcStats();
+        client.stop_watcher();
+        server.stop_watcher();
+        rtts.sort(function(a, b) { return a - b; });
+        done({
+            flags: kind.name,
+            size: size,
+            seconds: elapsed,
+            messages: messages,
+            lost: lost,
+            messagesPerSec: messages / elapsed,
+            bytesPerSec: messages * size / elapsed,
+            rttMicros: {
+                p50: percentile(rtts, 0.5),
+                p99: percentile(rtts, 0.99),
+                p999: percentile(rtts, 0.999)
+            },
+            nativeAllocsPerMessage: messages ? allocs / messages : null,
+            gcCount: gc.count - gcStart.count,
+            gcMicrosPerMessage: messages ? (gc.micros - gcStart.micros) / messages : null,
+            link: LINK ? { client: client.linkStats(), server: server.linkStats() } : null
+        });
+    }, 50);
+
+    server.start_watcher();
+    client.start_watcher();
+    client.connect(new enet.Address('127.0.0.1', port), 1, 0);
+}
+
+// Buffer#writeUInt32LE only arrived in node 0.5.
+function setSeq(buffer, n)
+{
+    buffer[0] = n & 0xff;
+    buffer[1] = (n >>> 8) & 0xff;
+    buffer[2] = (n >>> 16) & 0xff;
+    buffer[3] = (n >>> 24) & 0xff;
+}
+
+function getSeq(buffer)
+{
+    return (buffer[0] | (buffer[1] << 8) | (buffer[2] << 16) | (buffer[3] << 24)) >>> 0;
+}
+
+var cases = [];
+FLAGS.forEach(function(kind) {
+    SIZES.forEach(function(size) {
+        cases.push({ kind: kind, size: Math.max(size, 4) });
+    });
+});
+
+var results = [];
+(function next(i) {
+    if (i == cases.length)
+    {
+        process.stdout.write(JSON.stringify({
+            node: process.version,
+            window: WINDOW,
+            link: LINK,
+            results: results
+        }, null, 2) + '\n');
+        process.exit(0);
+    }
+    runCase(BASE_PORT + i, cases[i].kind, cases[i].size, function(result) {
+        results.push(result);
+        next(i + 1);
+    });
+})(0);
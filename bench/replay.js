@@ -0,0 +1,66 @@
+/* replay.js -- servicing a recorded trace through enet.js.
+   Copyright (C) 2011 Memeo, Inc. */
+
+// Plays the incoming traffic of a trace made with Host.startCapture() into
+// a fresh host bound to 127.0.0.1, and reports how long enet and the JS
+// event path took to take it in, as JSON on stdout. The host is created
+// with the peer count and channel limit given, which should match the one
+// the trace was recorded on for connections to be accepted the same way.
+//
+//     node bench/replay.js trace [speed] [peers] [channels] [threaded]
+//
+// speed 0 (the default) plays the trace as fast as possible.
+
+var enet = require('../node_modules/enet');
+var timing = require('../build/default/enetbench');
+
+var PATH = process.argv[2];
+var SPEED = Number(process.argv[3] || 0);
+var PEERS = Number(process.argv[4] || 32);
+var CHANNELS = Number(process.argv[5] || 1);
+var THREADED = process.argv[6] == 'threaded';
+// How long to keep servicing after the last datagram is sent.
+var DRAIN = 500;
+
+if (!PATH)
+{
+    console.error('usage: node bench/replay.js trace [speed] [peers] [channels] [threaded]');
+    process.exit(1);
+}
+
+var host = new enet.Host(new enet.Address('127.0.0.1', 0), PEERS, CHANNELS);
+var counts = { connect: 0, disconnect: 0, message: 0, bytes: 0 };
+host.on('connect', function() {
+    counts.connect++;
+}).on('disconnect', function() {
+    counts.disconnect++;
+}).on('message', function(peer, packet) {
+    counts.message++;
+    counts.bytes += packet.data().length;
+});
+
+var gcStart = timing.gcStats();
+var started = timing.now();
+var sentAt = 0;
+host.start_watcher(THREADED);
+host.replay(PATH, { speed: SPEED }, function(err, stats) {
+    sentAt = timing.now();
+    setTimeout(function() {
+        var gc = timing.gcStats();
+        host.stop_watcher();
+        var elapsed = (sentAt - started) / 1000000;
+        process.stdout.write(JSON.stringify({
+            node: process.version,
+            trace: PATH,
+            speed: SPEED,
+            threaded: THREADED,
+            datagrams: stats.sent,
+            seconds: elapsed,
+            datagramsPerSec: stats.sent / elapsed,
+            events: counts,
+            gcCount: gc.count - gcStart.count,
+            gcMicros: gc.micros - gcStart.micros
+        }, null, 2) + '\n');
+        process.exit(0);
+    }, DRAIN);
+});
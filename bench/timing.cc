@@ -0,0 +1,66 @@
+/* timing.cc -- clock and GC accounting for the enet.js benchmarks.
+   Copyright (C) 2011 Memeo, Inc. */
+
+#include <v8.h>
+#include <node.h>
+#include <sys/time.h>
+
+namespace enetbench
+{
+
+static double gcStart;
+static double gcTime;
+static double gcCount;
+
+static double NowMicros()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1000000.0 + tv.tv_usec;
+}
+
+static void OnGCPrologue(v8::GCType type, v8::GCCallbackFlags flags)
+{
+    gcStart = NowMicros();
+}
+
+static void OnGCEpilogue(v8::GCType type, v8::GCCallbackFlags flags)
+{
+    gcTime += NowMicros() - gcStart;
+    gcCount++;
+}
+
+// now() -- wall clock in microseconds; Date.now() is too coarse for
+// loopback round trips.
+static v8::Handle<v8::Value> Now(const v8::Arguments& args)
+{
+    v8::HandleScope scope;
+    return scope.Close(v8::Number::New(NowMicros()));
+}
+
+// gcStats() -- collections and total microseconds spent in them since the
+// module was loaded.
+static v8::Handle<v8::Value> GCStats(const v8::Arguments& args)
+{
+    v8::HandleScope scope;
+    v8::Local<v8::Object> result = v8::Object::New();
+    result->Set(v8::String::NewSymbol("count"), v8::Number::New(gcCount));
+    result->Set(v8::String::NewSymbol("micros"), v8::Number::New(gcTime));
+    return scope.Close(result);
+}
+
+}
+
+extern "C"
+{
+    static void init(v8::Handle<v8::Object> target)
+    {
+        v8::HandleScope scope;
+        v8::V8::AddGCPrologueCallback(enetbench::OnGCPrologue);
+        v8::V8::AddGCEpilogueCallback(enetbench::OnGCEpilogue);
+        NODE_SET_METHOD(target, "now", enetbench::Now);
+        NODE_SET_METHOD(target, "gcStats", enetbench::GCStats);
+    }
+    
+    NODE_MODULE(enetbench, init);
+}
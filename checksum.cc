@@ -0,0 +1,123 @@
+/* checksum.cc -- CRC32C datagram checksums for enet hosts.
+   Copyright (C) 2011 Memeo, Inc. */
+
+#include <cstring>
+#include "checksum.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#define HAVE_CRC32_INSTRUCTION 1
+#endif
+
+namespace enet
+{
+
+static const enet_uint32 kPolynomial = 0x82F63B78; // reflected 0x1EDC6F41
+
+static enet_uint32 table[8][256];
+static bool hardware;
+static bool initialized;
+
+void Crc32cInit()
+{
+    if (initialized)
+        return;
+    for (int i = 0; i < 256; i++)
+    {
+        enet_uint32 crc = i;
+        for (int bit = 0; bit < 8; bit++)
+            crc = (crc >> 1) ^ (kPolynomial & (0 - (crc & 1)));
+        table[0][i] = crc;
+    }
+    for (int i = 0; i < 256; i++)
+    {
+        for (int k = 1; k < 8; k++)
+            table[k][i] = (table[k - 1][i] >> 8) ^ table[0][table[k - 1][i] & 0xFF];
+    }
+#ifdef HAVE_CRC32_INSTRUCTION
+    unsigned int eax, ebx, ecx, edx;
+    if (__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+        hardware = (ecx & bit_SSE4_2) != 0;
+#endif
+    initialized = true;
+}
+
+bool Crc32cHardware()
+{
+    return hardware;
+}
+
+// Works on the inverted crc, as the CRC32C definition does internally.
+static enet_uint32 SoftwareUpdate(enet_uint32 crc, const enet_uint8 *p, size_t length)
+{
+    for (; length > 0 && ((size_t) p & 7) != 0; length--)
+        crc = (crc >> 8) ^ table[0][(crc ^ *p++) & 0xFF];
+    for (; length >= 8; length -= 8, p += 8)
+    {
+        enet_uint32 lo, hi;
+        ::memcpy(&lo, p, 4);
+        ::memcpy(&hi, p + 4, 4);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        lo = __builtin_bswap32(lo);
+        hi = __builtin_bswap32(hi);
+#endif
+        lo ^= crc;
+        crc = table[7][lo & 0xFF] ^ table[6][(lo >> 8) & 0xFF]
+            ^ table[5][(lo >> 16) & 0xFF] ^ table[4][lo >> 24]
+            ^ table[3][hi & 0xFF] ^ table[2][(hi >> 8) & 0xFF]
+            ^ table[1][(hi >> 16) & 0xFF] ^ table[0][hi >> 24];
+    }
+    for (; length > 0; length--)
+        crc = (crc >> 8) ^ table[0][(crc ^ *p++) & 0xFF];
+    return crc;
+}
+
+#ifdef HAVE_CRC32_INSTRUCTION
+// The instruction is emitted directly so this builds without -msse4.2; it
+// only runs when cpuid says it's there.
+static enet_uint32 HardwareUpdate(enet_uint32 crc, const enet_uint8 *p, size_t length)
+{
+    for (; length > 0 && ((size_t) p & 7) != 0; length--)
+        __asm__("crc32b %1, %0" : "+r" (crc) : "rm" (*p++));
+#ifdef __x86_64__
+    unsigned long long crc64 = crc;
+    for (; length >= 8; length -= 8, p += 8)
+    {
+        unsigned long long v;
+        ::memcpy(&v, p, 8);
+        __asm__("crc32q %1, %0" : "+r" (crc64) : "rm" (v));
+    }
+    crc = (enet_uint32) crc64;
+#endif
+    for (; length >= 4; length -= 4, p += 4)
+    {
+        enet_uint32 v;
+        ::memcpy(&v, p, 4);
+        __asm__("crc32l %1, %0" : "+r" (crc) : "rm" (v));
+    }
+    for (; length > 0; length--)
+        __asm__("crc32b %1, %0" : "+r" (crc) : "rm" (*p++));
+    return crc;
+}
+#endif
+
+enet_uint32 Crc32cUpdate(enet_uint32 crc, const enet_uint8 *data, size_t length)
+{
+    crc = ~crc;
+#ifdef HAVE_CRC32_INSTRUCTION
+    if (hardware)
+        return ~HardwareUpdate(crc, data, length);
+#endif
+    return ~SoftwareUpdate(crc, data, length);
+}
+
+enet_uint32 Crc32c(const ENetBuffer *buffers, size_t bufferCount)
+{
+    enet_uint32 crc = 0;
+    for (size_t i = 0; i < bufferCount; i++)
+        crc = Crc32cUpdate(crc, (const enet_uint8 *) buffers[i].data, buffers[i].dataLength);
+    // Same byte order as enet_crc32 puts in the header.
+    return ENET_HOST_TO_NET_32(crc);
+}
+
+}
@@ -0,0 +1,27 @@
+/* checksum.h -- CRC32C datagram checksums for enet hosts.
+   Copyright (C) 2011 Memeo, Inc. */
+
+#ifndef ENET_JS_CHECKSUM_H
+#define ENET_JS_CHECKSUM_H
+
+#include <enet/enet.h>
+
+namespace enet
+{
+
+// CRC32C (Castagnoli) over a list of buffers, in the form enet expects of
+// host->checksum. Uses the SSE4.2 crc32 instruction when the CPU has it and
+// slicing-by-8 tables otherwise; both give the same result. Call
+// Crc32cInit() once, before the first use from any thread.
+void Crc32cInit();
+enet_uint32 Crc32c(const ENetBuffer *buffers, size_t bufferCount);
+
+// Plain CRC32C of one block, continuing from crc (0 to start).
+enet_uint32 Crc32cUpdate(enet_uint32 crc, const enet_uint8 *data, size_t length);
+
+// True if Crc32c is using the SSE4.2 instruction.
+bool Crc32cHardware();
+
+}
+
+#endif
@@ -0,0 +1,278 @@
+/* compress.cc -- packet compressors for enet hosts.
+   Copyright (C) 2011 Memeo, Inc. */
+
+#include <cstring>
+#include "compress.h"
+
+namespace enet
+{
+
+struct Compressor
+{
+    CompressionKind kind;
+    CompressorStats *stats;
+    void *rangeCoder;
+    // enet hands us a datagram as a list of buffers; LZ4 wants it in one
+    // piece. Datagrams never exceed the maximum MTU.
+    enet_uint8 scratch[ENET_PROTOCOL_MAXIMUM_MTU];
+};
+
+// LZ4 block format (see lz4_Block_format in the LZ4 sources): a series of
+// sequences, each a token (literal length << 4 | match length - 4), the
+// literals, and a little-endian 16-bit match offset. Lengths of 15 or more
+// continue in following bytes of 255s. The last sequence is literals only,
+// and a match may not start within 12 bytes of the end or end within 5.
+
+static const size_t kMinMatch = 4;
+static const size_t kLastLiterals = 5;
+static const size_t kMatchStartLimit = 12;
+static const int kHashBits = 12;
+
+static inline enet_uint32 Read32(const enet_uint8 *p)
+{
+    enet_uint32 v;
+    ::memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline size_t Hash(enet_uint32 v)
+{
+    return (v * 2654435761U) >> (32 - kHashBits);
+}
+
+// Bytes needed after the token for a length field holding `length'.
+static inline size_t LengthBytes(size_t length)
+{
+    return length >= 15 ? (length - 15) / 255 + 1 : 0;
+}
+
+static inline enet_uint8 *WriteLength(enet_uint8 *op, size_t length)
+{
+    for (; length >= 255; length -= 255)
+        *op++ = 255;
+    *op++ = (enet_uint8) length;
+    return op;
+}
+
+// Returns the compressed size, or 0 if it wouldn't fit in outLimit.
+static size_t Lz4Compress(const enet_uint8 *in, size_t inLength, enet_uint8 *out, size_t outLimit)
+{
+    const enet_uint8 *ip = in, *anchor = in, *iend = in + inLength;
+    enet_uint8 *op = out, *oend = out + outLimit;
+    
+    if (inLength > kMatchStartLimit)
+    {
+        const enet_uint8 *matchStartLimit = iend - kMatchStartLimit;
+        const enet_uint8 *matchEndLimit = iend - kLastLiterals;
+        enet_uint32 table[1 << kHashBits];
+        ::memset(table, 0, sizeof(table));
+        
+        while (ip < matchStartLimit)
+        {
+            enet_uint32 sequence = Read32(ip);
+            size_t h = Hash(sequence);
+            const enet_uint8 *ref = in + table[h];
+            table[h] = (enet_uint32) (ip - in);
+            if (ref >= ip || ip - ref > 0xFFFF || Read32(ref) != sequence)
+            {
+                ip++;
+                continue;
+            }
+            
+            size_t offset = ip - ref;
+            const enet_uint8 *matchEnd = ip + kMinMatch;
+            ref += kMinMatch;
+            while (matchEnd < matchEndLimit && *matchEnd == *ref)
+            {
+                matchEnd++;
+                ref++;
+            }
+            
+            size_t literals = ip - anchor;
+            size_t matchLength = matchEnd - ip - kMinMatch;
+            if ((size_t) (oend - op) < 1 + LengthBytes(literals) + literals + 2 + LengthBytes(matchLength))
+                return 0;
+            enet_uint8 *token = op++;
+            if (literals >= 15)
+            {
+                *token = 15 << 4;
+                op = WriteLength(op, literals - 15);
+            }
+            else
+                *token = (enet_uint8) (literals << 4);
+            ::memcpy(op, anchor, literals);
+            op += literals;
+            *op++ = (enet_uint8) (offset & 0xFF);
+            *op++ = (enet_uint8) (offset >> 8);
+            if (matchLength >= 15)
+            {
+                *token |= 15;
+                op = WriteLength(op, matchLength - 15);
+            }
+            else
+                *token |= (enet_uint8) matchLength;
+            ip = anchor = matchEnd;
+        }
+    }
+    
+    size_t literals = iend - anchor;
+    if ((size_t) (oend - op) < 1 + LengthBytes(literals) + literals)
+        return 0;
+    if (literals >= 15)
+    {
+        *op++ = 15 << 4;
+        op = WriteLength(op, literals - 15);
+    }
+    else
+        *op++ = (enet_uint8) (literals << 4);
+    ::memcpy(op, anchor, literals);
+    op += literals;
+    return op - out;
+}
+
+// Returns the decompressed size, or 0 if the input is malformed or the
+// output would exceed outLimit.
+static size_t Lz4Decompress(const enet_uint8 *in, size_t inLength, enet_uint8 *out, size_t outLimit)
+{
+    const enet_uint8 *ip = in, *iend = in + inLength;
+    enet_uint8 *op = out, *oend = out + outLimit;
+    
+    while (ip < iend)
+    {
+        enet_uint8 token = *ip++;
+        size_t length = token >> 4;
+        if (length == 15)
+        {
+            enet_uint8 b;
+            do
+            {
+                if (ip >= iend)
+                    return 0;
+                b = *ip++;
+                length += b;
+            }
+            while (b == 255);
+        }
+        if (length > (size_t) (iend - ip) || length > (size_t) (oend - op))
+            return 0;
+        ::memcpy(op, ip, length);
+        op += length;
+        ip += length;
+        if (ip == iend)
+            break;
+        
+        if (iend - ip < 2)
+            return 0;
+        size_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > (size_t) (op - out))
+            return 0;
+        length = token & 15;
+        if (length == 15)
+        {
+            enet_uint8 b;
+            do
+            {
+                if (ip >= iend)
+                    return 0;
+                b = *ip++;
+                length += b;
+            }
+            while (b == 255);
+        }
+        length += kMinMatch;
+        if (length > (size_t) (oend - op))
+            return 0;
+        // Byte at a time: the match may overlap what it's producing.
+        const enet_uint8 *match = op - offset;
+        while (length--)
+            *op++ = *match++;
+    }
+    return op - out;
+}
+
+static size_t Compress(void *context, const ENetBuffer *inBuffers, size_t inBufferCount,
+    size_t inLimit, enet_uint8 *outData, size_t outLimit)
+{
+    Compressor *c = (Compressor *) context;
+    size_t result;
+    if (c->kind == COMPRESSION_RANGE)
+    {
+        result = enet_range_coder_compress(c->rangeCoder, inBuffers, inBufferCount,
+            inLimit, outData, outLimit);
+    }
+    else
+    {
+        size_t length = 0;
+        for (size_t i = 0; i < inBufferCount && length < inLimit; i++)
+        {
+            size_t n = inBuffers[i].dataLength;
+            if (n > inLimit - length)
+                n = inLimit - length;
+            if (n > sizeof(c->scratch) - length)
+                return 0;
+            ::memcpy(c->scratch + length, inBuffers[i].data, n);
+            length += n;
+        }
+        result = Lz4Compress(c->scratch, length, outData, outLimit);
+    }
+    c->stats->outgoingRaw += inLimit;
+    // enet sends the datagram uncompressed if we didn't make it smaller.
+    c->stats->outgoingCompressed += (result > 0 && result < inLimit) ? result : inLimit;
+    return result;
+}
+
+static size_t Decompress(void *context, const enet_uint8 *inData, size_t inLimit,
+    enet_uint8 *outData, size_t outLimit)
+{
+    Compressor *c = (Compressor *) context;
+    size_t result;
+    if (c->kind == COMPRESSION_RANGE)
+        result = enet_range_coder_decompress(c->rangeCoder, inData, inLimit, outData, outLimit);
+    else
+        result = Lz4Decompress(inData, inLimit, outData, outLimit);
+    c->stats->incomingCompressed += inLimit;
+    c->stats->incomingRaw += result;
+    return result;
+}
+
+static void Destroy(void *context)
+{
+    Compressor *c = (Compressor *) context;
+    if (c->rangeCoder != NULL)
+        enet_range_coder_destroy(c->rangeCoder);
+    enet_free(c);
+}
+
+bool SetCompressor(ENetHost *host, CompressionKind kind, CompressorStats *stats)
+{
+    if (kind == COMPRESSION_NONE)
+    {
+        enet_host_compress(host, NULL);
+        return true;
+    }
+    Compressor *c = (Compressor *) enet_malloc(sizeof(Compressor));
+    if (c == NULL)
+        return false;
+    c->kind = kind;
+    c->stats = stats;
+    c->rangeCoder = NULL;
+    if (kind == COMPRESSION_RANGE)
+    {
+        c->rangeCoder = enet_range_coder_create();
+        if (c->rangeCoder == NULL)
+        {
+            enet_free(c);
+            return false;
+        }
+    }
+    ENetCompressor compressor;
+    compressor.context = c;
+    compressor.compress = Compress;
+    compressor.decompress = Decompress;
+    compressor.destroy = Destroy;
+    enet_host_compress(host, &compressor);
+    return true;
+}
+
+}
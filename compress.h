@@ -0,0 +1,38 @@
+/* compress.h -- packet compressors for enet hosts.
+   Copyright (C) 2011 Memeo, Inc. */
+
+#ifndef ENET_JS_COMPRESS_H
+#define ENET_JS_COMPRESS_H
+
+#include <enet/enet.h>
+
+namespace enet
+{
+
+enum CompressionKind
+{
+    COMPRESSION_NONE,
+    COMPRESSION_RANGE,  // enet's own adaptive range coder
+    COMPRESSION_LZ4     // LZ4 block format; fast, best on repetitive data
+};
+
+// Byte counts seen by a host's compressor. Outgoing datagrams that don't
+// shrink are sent as they are and count the same on both sides.
+struct CompressorStats
+{
+    double outgoingRaw;         // datagram payload before compression
+    double outgoingCompressed;  // what was actually sent
+    double incomingCompressed;  // compressed payload received
+    double incomingRaw;         // the same after decompression
+};
+
+// Installs a compressor of the given kind on host (or removes it, for
+// COMPRESSION_NONE), counting into *stats, which must outlive the host's
+// use of it. Must be called on whichever thread services the host. Both
+// ends of a connection need the same kind. Returns false if the compressor
+// could not be created.
+bool SetCompressor(ENetHost *host, CompressionKind kind, CompressorStats *stats);
+
+}
+
+#endif
@@ -0,0 +1,232 @@
+/* dns.cc -- cached name resolution for enet addresses.
+   Copyright (C) 2011 Memeo, Inc. */
+
+#include <cstring>
+#include <cstdlib>
+#include <map>
+#include <pthread.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "dns.h"
+
+namespace enet
+{
+
+// Past this many entries, expired ones are swept out before adding more.
+static const size_t kMaxEntries = 4096;
+
+struct ForwardEntry
+{
+    enet_uint32 host;
+    bool found;
+    double expires;
+};
+
+struct ReverseEntry
+{
+    std::string name;
+    bool found;
+    double expires;
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static std::map<std::string, ForwardEntry> forward;
+static std::map<enet_uint32, ReverseEntry> reverse;
+static double positiveTtl = 60;
+static double negativeTtl = 5;
+
+static double Now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+template <typename Map>
+static void Sweep(Map& map, double now)
+{
+    if (map.size() < kMaxEntries)
+        return;
+    for (typename Map::iterator it = map.begin(); it != map.end(); )
+    {
+        if (it->second.expires <= now)
+            map.erase(it++);
+        else
+            ++it;
+    }
+    // Still full of live entries: start over rather than grow without bound.
+    if (map.size() >= kMaxEntries)
+        map.clear();
+}
+
+bool ResolveHost(const char *name, enet_uint32 *host)
+{
+    struct in_addr in;
+    if (inet_aton(name, &in))
+    {
+        *host = in.s_addr;
+        return true;
+    }
+    
+    double now = Now();
+    pthread_mutex_lock(&lock);
+    std::map<std::string, ForwardEntry>::iterator it = forward.find(name);
+    if (it != forward.end() && it->second.expires > now)
+    {
+        bool found = it->second.found;
+        *host = it->second.host;
+        pthread_mutex_unlock(&lock);
+        return found;
+    }
+    pthread_mutex_unlock(&lock);
+    
+    struct addrinfo hints, *result = NULL;
+    ::memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_DGRAM;
+    ForwardEntry entry;
+    entry.host = 0;
+    entry.found = getaddrinfo(name, NULL, &hints, &result) == 0 && result != NULL;
+    if (entry.found)
+        entry.host = ((struct sockaddr_in *) result->ai_addr)->sin_addr.s_addr;
+    if (result != NULL)
+        freeaddrinfo(result);
+    
+    pthread_mutex_lock(&lock);
+    double ttl = entry.found ? positiveTtl : negativeTtl;
+    entry.expires = Now() + ttl;
+    if (ttl > 0)
+    {
+        Sweep(forward, now);
+        forward[name] = entry;
+    }
+    pthread_mutex_unlock(&lock);
+    *host = entry.host;
+    return entry.found;
+}
+
+bool ResolveName(enet_uint32 host, std::string *name)
+{
+    double now = Now();
+    pthread_mutex_lock(&lock);
+    std::map<enet_uint32, ReverseEntry>::iterator it = reverse.find(host);
+    if (it != reverse.end() && it->second.expires > now)
+    {
+        bool found = it->second.found;
+        *name = it->second.name;
+        pthread_mutex_unlock(&lock);
+        return found;
+    }
+    pthread_mutex_unlock(&lock);
+    
+    struct sockaddr_in sin;
+    ::memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = host;
+    char buffer[NI_MAXHOST];
+    ReverseEntry entry;
+    entry.found = getnameinfo((struct sockaddr *) &sin, sizeof(sin), buffer, sizeof(buffer),
+        NULL, 0, NI_NAMEREQD) == 0;
+    if (entry.found)
+        entry.name = buffer;
+    
+    pthread_mutex_lock(&lock);
+    double ttl = entry.found ? positiveTtl : negativeTtl;
+    entry.expires = Now() + ttl;
+    if (ttl > 0)
+    {
+        Sweep(reverse, now);
+        reverse[host] = entry;
+    }
+    pthread_mutex_unlock(&lock);
+    *name = entry.name;
+    return entry.found;
+}
+
+bool ParseAddress(const char *text, ENetAddress *address, const char **error)
+{
+    std::string host;
+    const char *port = NULL;
+    if (text[0] == '[')
+    {
+        const char *close = ::strchr(text, ']');
+        if (close == NULL)
+        {
+            *error = "missing ']' in address";
+            return false;
+        }
+        host.assign(text + 1, close - text - 1);
+        if (close[1] == ':')
+            port = close + 2;
+        else if (close[1] != '\0')
+        {
+            *error = "unexpected text after ']' in address";
+            return false;
+        }
+    }
+    else
+    {
+        // More than one colon means a bare IPv6 literal, with no port.
+        const char *colon = ::strchr(text, ':');
+        if (colon != NULL && ::strchr(colon + 1, ':') == NULL)
+        {
+            host.assign(text, colon - text);
+            port = colon + 1;
+        }
+        else
+            host = text;
+    }
+    
+    if (port != NULL)
+    {
+        char *end;
+        long value = ::strtol(port, &end, 10);
+        if (*port == '\0' || *end != '\0' || value < 0 || value > 0xFFFF)
+        {
+            *error = "invalid port in address";
+            return false;
+        }
+        address->port = (enet_uint16) value;
+    }
+    
+    if (host.find(':') != std::string::npos)
+    {
+        struct in6_addr in6;
+        if (inet_pton(AF_INET6, host.c_str(), &in6) != 1)
+        {
+            *error = "invalid IPv6 address";
+            return false;
+        }
+        if (IN6_IS_ADDR_V4MAPPED(&in6))
+            ::memcpy(&address->host, &in6.s6_addr[12], 4);
+        else if (IN6_IS_ADDR_UNSPECIFIED(&in6))
+            address->host = ENET_HOST_ANY;
+        else
+        {
+            *error = "enet only supports IPv4; use an IPv4-mapped address (::ffff:a.b.c.d)";
+            return false;
+        }
+        return true;
+    }
+    if (!ResolveHost(host.c_str(), &address->host))
+    {
+        *error = "could not resolve host";
+        return false;
+    }
+    return true;
+}
+
+void SetResolveCacheTtl(double positive, double negative)
+{
+    pthread_mutex_lock(&lock);
+    positiveTtl = positive;
+    negativeTtl = negative;
+    forward.clear();
+    reverse.clear();
+    pthread_mutex_unlock(&lock);
+}
+
+}
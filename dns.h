@@ -0,0 +1,37 @@
+/* dns.h -- cached name resolution for enet addresses.
+   Copyright (C) 2011 Memeo, Inc. */
+
+#ifndef ENET_JS_DNS_H
+#define ENET_JS_DNS_H
+
+#include <enet/enet.h>
+#include <string>
+
+namespace enet
+{
+
+// Looks up an IPv4 address for name, setting *host in network byte order
+// like ENetAddress.host. Dotted quads are parsed without a lookup. Answers,
+// including failures, are cached; see SetResolveCacheTtl. Blocks on a
+// cache miss, so call it from a worker thread where that matters. Safe to
+// call from several threads.
+bool ResolveHost(const char *name, enet_uint32 *host);
+
+// Reverse lookup of host (network byte order), cached the same way.
+bool ResolveName(enet_uint32 host, std::string *name);
+
+// Parses "host", "host:port", "[host]" or "[host]:port" into *address,
+// resolving names with ResolveHost; address->port is left alone when no
+// port is given. IPv6 literals are accepted with or without brackets, but
+// enet only speaks IPv4, so they must be IPv4-mapped (::ffff:a.b.c.d) or
+// unspecified (::, meaning any address). On failure *error says why.
+bool ParseAddress(const char *text, ENetAddress *address, const char **error);
+
+// How long answers stay cached, in seconds. The system resolver doesn't
+// tell us record TTLs, so these stand in for them. Defaults are 60 seconds
+// for answers and 5 for failures; 0 turns caching off.
+void SetResolveCacheTtl(double positive, double negative);
+
+}
+
+#endif
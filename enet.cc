@@ -7,6 +7,22 @@
 #include <node_events.h>
 #include <enet/enet.h>
 #include <cstring>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <map>
+#include <string>
+#include <vector>
+#include "pool.h"
+#include "compress.h"
+#include "checksum.h"
+#include "dns.h"
+#include "admission.h"
+#include "raw.h"
+#include "link.h"
+#include "trace.h"
+#include "stream.h"
+#include "packets.h"
+#include "service.h"
 
 #ifdef DEBUG
 #define debug(fmt, args...) fprintf(stderr, fmt, ##args)
@@ -25,30 +41,172 @@ namespace enet
 class Host;
 class Peer;
 
+static v8::Persistent<v8::Function> bufferConstructor;
+
+// Turns a SlowBuffer into a regular JS Buffer, the same way Buffer.js does.
+static v8::Local<v8::Object> MakeFastBuffer(node::Buffer *slowBuf, size_t length)
+{
+    if (bufferConstructor.IsEmpty())
+    {
+        v8::Local<v8::Object> globalObj = v8::Context::GetCurrent()->Global();
+        bufferConstructor = v8::Persistent<v8::Function>::New(
+            v8::Local<v8::Function>::Cast(globalObj->Get(v8::String::New("Buffer"))));
+    }
+    v8::Handle<v8::Value> constructorArgs[3] = { slowBuf->handle_, v8::Integer::New(length), v8::Integer::New(0) };
+    return bufferConstructor->NewInstance(3, constructorArgs);
+}
+
+// Exposes a block of native uint32 counters to JS as an indexable object;
+// the memory must outlive the object.
+static v8::Persistent<v8::Object> NewExternalArray(enet_uint32 *data, int length)
+{
+    v8::Persistent<v8::Object> o = v8::Persistent<v8::Object>::New(v8::Object::New());
+    o->SetIndexedPropertiesToExternalArrayData(data, v8::kExternalUnsignedIntArray, length);
+    return o;
+}
+
+// Hosts whose ENet calls have been moved to a service thread, so that Peers
+// know to post their commands there instead of calling ENet directly.
+static std::map<ENetHost *, ServiceThread *> serviceThreads;
+
+static ServiceThread *ThreadFor(ENetHost *host)
+{
+    if (serviceThreads.empty())
+        return NULL;
+    std::map<ENetHost *, ServiceThread *>::iterator it = serviceThreads.find(host);
+    return it == serviceThreads.end() ? NULL : it->second;
+}
+
+// Hosts recording a trace, so that sends can be added to it.
+static std::map<ENetHost *, TraceWriter *> captures;
+
+// Records a packet queued for address (NULL for a broadcast), if its host
+// is capturing.
+static void CaptureSend(ENetHost *host, const ENetAddress *address, enet_uint8 channel, const ENetPacket *packet)
+{
+    if (captures.empty() || packet == NULL)
+        return;
+    std::map<ENetHost *, TraceWriter *>::iterator it = captures.find(host);
+    if (it == captures.end())
+        return;
+    it->second->Append(address != NULL ? kTraceOutgoing : kTraceBroadcast, packet->flags,
+        channel, address, packet->data, packet->dataLength);
+}
+
+// Hosts with a send scheduler, used while they aren't threaded; a
+// threaded host's scheduler belongs to its service thread.
+static std::map<ENetHost *, Scheduler *> schedulers;
+
+// enet_peer_send and enet_host_broadcast, through the host's scheduler if
+// it has one.
+static int QueueSend(ENetPeer *peer, enet_uint8 channel, ENetPacket *packet)
+{
+    if (!schedulers.empty())
+    {
+        std::map<ENetHost *, Scheduler *>::iterator it = schedulers.find(peer->host);
+        if (it != schedulers.end())
+            return it->second->Enqueue(peer, channel, packet);
+    }
+    return enet_peer_send(peer, channel, packet);
+}
+
+static void QueueBroadcast(ENetHost *host, enet_uint8 channel, ENetPacket *packet)
+{
+    if (!schedulers.empty())
+    {
+        std::map<ENetHost *, Scheduler *>::iterator it = schedulers.find(host);
+        if (it != schedulers.end())
+        {
+            it->second->Broadcast(host, channel, packet);
+            return;
+        }
+    }
+    enet_host_broadcast(host, channel, packet);
+}
+
+static v8::Handle<v8::Value> ThrowQueueFull()
+{
+    return v8::ThrowException(v8::Exception::Error(v8::String::New("service thread command queue is full")));
+}
+
+// Reads the messages for sendMany()/broadcastMany() starting at args[first]:
+// either an array of Buffers, or one Buffer followed by an array of offsets
+// where each message runs up to the next offset (the last to the end).
+// Returns the index of the next argument, or -1 if the arguments are bad.
+static int CollectMessages(const v8::Arguments& args, int first, std::vector<ENetBuffer>& messages)
+{
+    if (args.Length() <= first)
+        return -1;
+    if (args[first]->IsArray())
+    {
+        v8::Local<v8::Array> list = v8::Local<v8::Array>::Cast(args[first]);
+        for (uint32_t i = 0; i < list->Length(); i++)
+        {
+            v8::Local<v8::Value> item = list->Get(i);
+            if (!item->IsObject())
+                return -1;
+            ENetBuffer message;
+            message.data = node::Buffer::Data(item->ToObject());
+            message.dataLength = node::Buffer::Length(item->ToObject());
+            messages.push_back(message);
+        }
+        return first + 1;
+    }
+    if (args[first]->IsObject() && args.Length() > first + 1 && args[first + 1]->IsArray())
+    {
+        char *data = node::Buffer::Data(args[first]->ToObject());
+        size_t length = node::Buffer::Length(args[first]->ToObject());
+        v8::Local<v8::Array> offsets = v8::Local<v8::Array>::Cast(args[first + 1]);
+        for (uint32_t i = 0; i < offsets->Length(); i++)
+        {
+            size_t start = offsets->Get(i)->Uint32Value();
+            size_t end = i + 1 < offsets->Length() ? offsets->Get(i + 1)->Uint32Value() : length;
+            if (start > end || end > length)
+                return -1;
+            ENetBuffer message;
+            message.data = data + start;
+            message.dataLength = end - start;
+            messages.push_back(message);
+        }
+        return first + 2;
+    }
+    return -1;
+}
+
 class Packet : public node::ObjectWrap
 {
 private:
     friend class Host;
     friend class Peer;
+    // The wrapper holds one reference on its packet. So do Events, Buffers
+    // over received data, and enet while the packet is queued or in flight;
+    // whoever drops the last one destroys it. NULL once the packet has been
+    // handed to a service thread (see Detach).
     ENetPacket *packet;
-    bool isSent;
+    // True when the packet came from ENet (a receive); data() then returns
+    // Buffers over it rather than copies.
+    bool adopted;
     
 public:
     Packet(const void *data, const size_t dataLength, enet_uint32 flags)
-        : isSent(false)
+        : adopted(false)
     {
-        packet = enet_packet_create(data, dataLength, flags);
+        packet = CreatePacket(data, dataLength, flags);
+        if (packet != NULL)
+            RetainPacket(packet);
         debug(stderr, "%p Packet(%p, %d, %x) -- %p\n", this, data, dataLength, flags, packet);
     }
     
     Packet(enet_uint32 flags)
-        : isSent(false)
+        : adopted(false)
     {
-        packet = enet_packet_create(NULL, 0, flags);
+        packet = CreatePacket(NULL, 0, flags);
+        if (packet != NULL)
+            RetainPacket(packet);
         debug(stderr, "%p Packet(%x) -- %p\n", this, flags, packet);
     }
     
-    Packet() : packet(0), isSent(false)
+    Packet() : packet(0), adopted(false)
     {
         debug(stderr, "%p Packet() -- %p\n", this, packet);
     }
@@ -56,10 +214,109 @@ public:
     ~Packet()
     {
         debug(stderr, "%p ~Packet() -- %p\n", this, packet);
-        if (packet && !isSent)
+        if (packet != NULL)
+            ReleasePacket(packet);
+    }
+    
+    // enet_packet_create, for every packet the binding makes.
+    static ENetPacket *CreatePacket(const void *data, size_t dataLength, enet_uint32 flags)
+    {
+        ENetPacket *p = enet_packet_create(data, dataLength, flags);
+        TrackPacket(p);
+        return p;
+    }
+    
+    // Only ever called on the main thread, or on a packet no other thread
+    // can reach.
+    static void RetainPacket(ENetPacket *p)
+    {
+        if (p->referenceCount++ == 0)
+            TrackPacket(p);
+    }
+    
+    static void ReleasePacket(ENetPacket *p)
+    {
+        if (--p->referenceCount == 0)
         {
-            enet_packet_destroy(packet);
+            enet_packet_destroy(p);
+        }
+    }
+    
+    static void FreePacketData(char *data, void *hint)
+    {
+        ReleasePacket((ENetPacket *) hint);
+    }
+    
+    // Buffers whose memory is being sent in place (FLAG_NO_ALLOCATE), kept
+    // alive until ENet frees the packet pointing at them.
+    static std::map<ENetPacket *, v8::Persistent<v8::Object> > pinnedBuffers;
+    
+    static ENetPacket *CreatePinned(v8::Handle<v8::Object> buffer, enet_uint32 flags)
+    {
+        ENetPacket *p = enet_packet_create(node::Buffer::Data(buffer),
+            node::Buffer::Length(buffer), flags | ENET_PACKET_FLAG_NO_ALLOCATE);
+        if (p == NULL)
+            return NULL;
+        p->freeCallback = UnpinBuffer;
+        pinnedBuffers[p] = v8::Persistent<v8::Object>::New(buffer);
+        TrackPacket(p);
+        return p;
+    }
+    
+    static void UnpinBuffer(ENetPacket *p)
+    {
+        std::map<ENetPacket *, v8::Persistent<v8::Object> >::iterator it = pinnedBuffers.find(p);
+        if (it != pinnedBuffers.end())
+        {
+            it->second.Dispose();
+            pinnedBuffers.erase(it);
+        }
+    }
+    
+    // Called before changing the packet; if anything else still holds it
+    // (enet, an Event, Buffers from data()), switch this wrapper over to a
+    // private copy.
+    void Unshare()
+    {
+        if (packet->referenceCount > 1)
+        {
+            ENetPacket *copy = CreatePacket(packet->data, packet->dataLength, packet->flags);
+            RetainPacket(copy);
+            ReleasePacket(packet);
+            packet = copy;
+            adopted = false;
+        }
+    }
+    
+    // A service thread's enet can't share the reference count with this
+    // thread, so sends there hand over a packet nothing else holds, with no
+    // references on it. That is this wrapper's own packet when it is the
+    // only holder, which leaves the wrapper empty, or else a copy. If the
+    // send fails, Reattach gives it back.
+    ENetPacket *Detach()
+    {
+        if (packet->referenceCount > 1)
+            return CreatePacket(packet->data, packet->dataLength, packet->flags);
+        ENetPacket *p = packet;
+        p->referenceCount = 0;
+        packet = NULL;
+        return p;
+    }
+    
+    void Reattach(ENetPacket *p)
+    {
+        if (packet != NULL)
+        {
+            enet_packet_destroy(p);
+            return;
         }
+        packet = p;
+        RetainPacket(p);
+    }
+    
+    static v8::Handle<v8::Value> ThrowSent()
+    {
+        return v8::ThrowException(v8::Exception::Error(v8::String::New("packet has been sent and is now invalid")));
     }
     
     static v8::Persistent<v8::FunctionTemplate> s_ct;
@@ -113,7 +370,7 @@ public:
             }
         }
         if (args.Length() == 0)
-            packet = new Packet();
+            packet = new Packet(flags);
         if (packet != NULL)
         {
             packet->Wrap(args.This());
@@ -121,11 +378,15 @@ public:
         return args.This();
     }
     
+    // Wraps a packet handed to us by ENet without copying it.
     static v8::Handle<v8::Value> WrapPacket(ENetPacket *p)
     {
+        Packet *packet = new Packet();
         v8::Local<v8::Object> o = s_ct->InstanceTemplate()->NewInstance();
-        Packet *packet = node::ObjectWrap::Unwrap<Packet>(o);
-        packet->packet = enet_packet_create(p->data, p->dataLength, p->flags);
+        packet->Wrap(o);
+        packet->packet = p;
+        packet->adopted = true;
+        RetainPacket(p);
         return o;
     }
     
@@ -133,28 +394,34 @@ public:
     {
         v8::HandleScope scope;
         Packet *packet = node::ObjectWrap::Unwrap<Packet>(args.This());
-        if (packet->isSent)
+        if (packet->packet == NULL)
+            return ThrowSent();
+        if (packet->adopted)
         {
-            return v8::ThrowException(v8::Exception::Error(v8::String::New("packet has been sent and is now invalid")));
+            return scope.Close(SliceReceived(packet->packet, 0));
         }
         node::Buffer *slowBuf = node::Buffer::New(packet->packet->dataLength);
         ::memcpy((void *) node::Buffer::Data(slowBuf), packet->packet->data,
             packet->packet->dataLength);
-        v8::Local<v8::Object> globalObj = v8::Context::GetCurrent()->Global();
-        v8::Local<v8::Function> bufferConstructor = v8::Local<v8::Function>::Cast(globalObj->Get(v8::String::New("Buffer")));
-        v8::Handle<v8::Value> constructorArgs[3] = { slowBuf->handle_, v8::Integer::New(packet->packet->dataLength), v8::Integer::New(0) };
-        v8::Local<v8::Object> actualBuffer = bufferConstructor->NewInstance(3, constructorArgs);
-        return scope.Close(actualBuffer);
+        return scope.Close(MakeFastBuffer(slowBuf, packet->packet->dataLength));
+    }
+    
+    // A Buffer over a received packet's payload from offset on, without
+    // copying; the Buffer keeps the packet alive until it is collected.
+    static v8::Local<v8::Object> SliceReceived(ENetPacket *p, size_t offset)
+    {
+        RetainPacket(p);
+        node::Buffer *slowBuf = node::Buffer::New((char *) p->data + offset,
+            p->dataLength - offset, FreePacketData, p);
+        return MakeFastBuffer(slowBuf, p->dataLength - offset);
     }
     
     static v8::Handle<v8::Value> Flags(const v8::Arguments& args)
     {
         v8::HandleScope scope;
         Packet *packet = node::ObjectWrap::Unwrap<Packet>(args.This());
-        if (packet->isSent)
-        {
-            return v8::ThrowException(v8::Exception::Error(v8::String::New("packet has been sent and is now invalid")));
-        }
+        if (packet->packet == NULL)
+            return ThrowSent();
         return scope.Close(v8::Uint32::New(packet->packet->flags));
     }
     
@@ -162,10 +429,9 @@ public:
     {
         v8::HandleScope scope;
         Packet *packet = node::ObjectWrap::Unwrap<Packet>(args.This());
-        if (packet->isSent)
-        {
-            return v8::ThrowException(v8::Exception::Error(v8::String::New("packet has been sent and is now invalid")));
-        }
+        if (packet->packet == NULL)
+            return ThrowSent();
+        packet->Unshare();
         if (args.Length() > 0)
         {
             if (args[0]->IsObject())
@@ -194,10 +460,9 @@ public:
     {
         v8::HandleScope scope;
         Packet *packet = node::ObjectWrap::Unwrap<Packet>(args.This());
-        if (packet->isSent)
-        {
-            return v8::ThrowException(v8::Exception::Error(v8::String::New("packet has been sent and is now invalid")));
-        }
+        if (packet->packet == NULL)
+            return ThrowSent();
+        packet->Unshare();
         if (args.Length() > 0)
         {
             if (args[0]->IsInt32())
@@ -218,6 +483,7 @@ class Address: public node::ObjectWrap
 {
 private:
     friend class Host;
+    friend class ShardedHost;
     ENetAddress address;
     
 public:
@@ -232,22 +498,23 @@ public:
         address.port = port;
     }
     
+    // The string constructors take "host", "host:port", "[host]:port" or
+    // an IPv6 literal (see ParseAddress), and throw a description of the
+    // problem if it can't be parsed or resolved.
     Address(const char *addrstr)
     {
-        char *s = ::strdup(addrstr);
-        char *chr = ::strrchr(s, ':');
-        if (chr != NULL)
-        {
-            *chr = '\0';
-            address.port = atoi(chr + 1);
-        }
-        enet_address_set_host(&address, (const char *) s);
-        ::free(s);
+        const char *error;
+        ::memset(&address, 0, sizeof(ENetAddress));
+        if (!ParseAddress(addrstr, &address, &error))
+            throw error;
     }
     
     Address(const char *addrstr, enet_uint16 port)
     {
-        enet_address_set_host(&address, addrstr);
+        const char *error;
+        ::memset(&address, 0, sizeof(ENetAddress));
+        if (!ParseAddress(addrstr, &address, &error))
+            throw error;
         address.port = port;        
     }
     
@@ -277,62 +544,77 @@ public:
         // address -- the IP address in dotted-decimal format
         NODE_SET_PROTOTYPE_METHOD(s_ct, "address", GetAddress);
         NODE_SET_PROTOTYPE_METHOD(s_ct, "setAddress", SetHostname); // uses the same function internally.
+        // key -- host and port as one number, for use as a map key
+        NODE_SET_PROTOTYPE_METHOD(s_ct, "key", Key);
+        // lookupHostname -- reverse lookup on the thread pool
+        NODE_SET_PROTOTYPE_METHOD(s_ct, "lookupHostname", LookupHostname);
         MY_NODE_DEFINE_CONSTANT(s_ct, "HOST_ANY", ENET_HOST_ANY);
         MY_NODE_DEFINE_CONSTANT(s_ct, "HOST_BROADCAST", ENET_HOST_BROADCAST);
         MY_NODE_DEFINE_CONSTANT(s_ct, "PORT_ANY", ENET_PORT_ANY);
-        target->Set(v8::String::NewSymbol("Address"), s_ct->GetFunction());
+        v8::Local<v8::Function> constructor = s_ct->GetFunction();
+        // Address.resolve(name, port, cb) -- forward lookup on the thread pool
+        NODE_SET_METHOD(constructor, "resolve", Resolve);
+        NODE_SET_METHOD(constructor, "setCacheTtl", SetCacheTtl);
+        target->Set(v8::String::NewSymbol("Address"), constructor);
     }
     
     static v8::Handle<v8::Value> New(const v8::Arguments& args)
     {
         v8::HandleScope scope;
         Address *addr = NULL;
-        if (args.Length() == 1)
-        {
-            if (args[0]->IsString())
-            {
-                v8::String::AsciiValue val(args[0]);
-                addr = new Address(*val);
-            }
-            else if (args[0]->IsUint32())
-            {
-                addr = new Address(args[0]->Uint32Value(), ENET_PORT_ANY);
-            }
-            else if (args[0]->IsInt32())
-            {
-                addr = new Address((uint32_t) args[0]->Int32Value(), ENET_PORT_ANY);
-            }
-        }
-        else if (args.Length() == 2)
+        try
         {
-            if (args[0]->IsString())
+            if (args.Length() == 1)
             {
-                v8::String::AsciiValue val(args[0]);
-                if (args[1]->IsUint32())
+                if (args[0]->IsString())
+                {
+                    v8::String::AsciiValue val(args[0]);
+                    addr = new Address(*val);
+                }
+                else if (args[0]->IsUint32())
                 {
-                    addr = new Address(*val, (enet_uint16) args[1]->Uint32Value());
+                    addr = new Address(args[0]->Uint32Value(), ENET_PORT_ANY);
                 }
-                else if (args[1]->IsInt32())
+                else if (args[0]->IsInt32())
                 {
-                    addr = new Address(*val, (enet_uint16) args[1]->Int32Value());
+                    addr = new Address((uint32_t) args[0]->Int32Value(), ENET_PORT_ANY);
                 }
             }
-            else if (args[0]->IsUint32())
+            else if (args.Length() == 2)
             {
-                uint32_t val = args[0]->Uint32Value();
-                if (args[1]->IsUint32())
+                if (args[0]->IsString())
                 {
-                    addr = new Address(val, (enet_uint16) args[1]->Uint32Value());
+                    v8::String::AsciiValue val(args[0]);
+                    if (args[1]->IsUint32())
+                    {
+                        addr = new Address(*val, (enet_uint16) args[1]->Uint32Value());
+                    }
+                    else if (args[1]->IsInt32())
+                    {
+                        addr = new Address(*val, (enet_uint16) args[1]->Int32Value());
+                    }
                 }
-                else if (args[1]->IsInt32())
+                else if (args[0]->IsUint32())
                 {
-                    addr = new Address(val, (enet_uint16) args[1]->Int32Value());
-                }                
+                    uint32_t val = args[0]->Uint32Value();
+                    if (args[1]->IsUint32())
+                    {
+                        addr = new Address(val, (enet_uint16) args[1]->Uint32Value());
+                    }
+                    else if (args[1]->IsInt32())
+                    {
+                        addr = new Address(val, (enet_uint16) args[1]->Int32Value());
+                    }                
+                }
+            }
+            else
+            {
+                addr = new Address();
             }
         }
-        else
+        catch (const char *error)
         {
-            addr = new Address();
+            return v8::ThrowException(v8::Exception::Error(v8::String::New(error)));
         }
         if (addr != NULL)
         {
@@ -348,11 +630,166 @@ public:
     static v8::Handle<v8::Value> WrapAddress(ENetAddress address)
     {
         v8::Handle<v8::Object> o = s_ct->InstanceTemplate()->NewInstance();
-        Address *a = node::ObjectWrap::Unwrap<Address>(o);
-        a->address = address;
+        Address *a = new Address(address);
+        a->Wrap(o);
         return o;        
     }
     
+    // A forward lookup running on the thread pool. resolve() calls for a
+    // name that is already being looked up join the existing request.
+    struct ResolveRequest
+    {
+        std::string name;
+        enet_uint32 host;
+        bool found;
+        const char *error;
+        std::vector<std::pair<v8::Persistent<v8::Function>, enet_uint16> > callbacks;
+    };
+    static std::map<std::string, ResolveRequest *> pendingResolves;
+    
+    static void DoResolve(eio_req *req)
+    {
+        ResolveRequest *r = (ResolveRequest *) req->data;
+        ENetAddress address;
+        ::memset(&address, 0, sizeof(ENetAddress));
+        r->found = ParseAddress(r->name.c_str(), &address, &r->error);
+        r->host = address.host;
+    }
+    
+    static int AfterResolve(eio_req *req)
+    {
+        v8::HandleScope scope;
+        ResolveRequest *r = (ResolveRequest *) req->data;
+        ev_unref(EV_DEFAULT_UC);
+        pendingResolves.erase(r->name);
+        for (size_t i = 0; i < r->callbacks.size(); i++)
+        {
+            v8::Handle<v8::Value> argv[2];
+            if (r->found)
+            {
+                ENetAddress address;
+                address.host = r->host;
+                address.port = r->callbacks[i].second;
+                argv[0] = v8::Null();
+                argv[1] = WrapAddress(address);
+            }
+            else
+            {
+                std::string message = std::string(r->error) + ": " + r->name;
+                argv[0] = v8::Exception::Error(v8::String::New(message.c_str()));
+                argv[1] = v8::Null();
+            }
+            v8::TryCatch try_catch;
+            r->callbacks[i].first->Call(v8::Context::GetCurrent()->Global(), 2, argv);
+            r->callbacks[i].first.Dispose();
+            if (try_catch.HasCaught())
+                node::FatalException(try_catch);
+        }
+        delete r;
+        return 0;
+    }
+    
+    // resolve(name, port, callback) -- looks name up without blocking and
+    // calls callback(err, address). Answers are cached (see setCacheTtl),
+    // and lookups of a name already in progress are shared.
+    static v8::Handle<v8::Value> Resolve(const v8::Arguments& args)
+    {
+        v8::HandleScope scope;
+        if (args.Length() < 3 || !args[0]->IsString() || !args[2]->IsFunction())
+            return v8::ThrowException(v8::Exception::Error(v8::String::New("resolve requires a name, a port and a callback")));
+        v8::String::Utf8Value utf8(args[0]);
+        std::string name(*utf8);
+        enet_uint16 port = (enet_uint16) args[1]->Uint32Value();
+        v8::Persistent<v8::Function> callback = v8::Persistent<v8::Function>::New(
+            v8::Local<v8::Function>::Cast(args[2]));
+        std::map<std::string, ResolveRequest *>::iterator it = pendingResolves.find(name);
+        if (it != pendingResolves.end())
+        {
+            it->second->callbacks.push_back(std::make_pair(callback, port));
+            return v8::Undefined();
+        }
+        ResolveRequest *r = new ResolveRequest();
+        r->name = name;
+        r->host = 0;
+        r->found = false;
+        r->error = NULL;
+        r->callbacks.push_back(std::make_pair(callback, port));
+        pendingResolves[name] = r;
+        eio_custom(DoResolve, EIO_PRI_DEFAULT, AfterResolve, r);
+        ev_ref(EV_DEFAULT_UC);
+        return v8::Undefined();
+    }
+    
+    // setCacheTtl(seconds[, failureSeconds]) -- how long resolve(),
+    // lookupHostname() and the string constructors cache answers. Clears
+    // the cache.
+    static v8::Handle<v8::Value> SetCacheTtl(const v8::Arguments& args)
+    {
+        v8::HandleScope scope;
+        if (args.Length() < 1 || !args[0]->IsNumber())
+            return v8::ThrowException(v8::Exception::Error(v8::String::New("setCacheTtl requires a number of seconds")));
+        double positive = args[0]->NumberValue();
+        double negative = args.Length() > 1 ? args[1]->NumberValue() : positive / 12;
+        SetResolveCacheTtl(positive, negative);
+        return v8::Undefined();
+    }
+    
+    struct ReverseRequest
+    {
+        enet_uint32 host;
+        std::string name;
+        bool found;
+        v8::Persistent<v8::Function> callback;
+    };
+    
+    static void DoReverse(eio_req *req)
+    {
+        ReverseRequest *r = (ReverseRequest *) req->data;
+        r->found = ResolveName(r->host, &r->name);
+    }
+    
+    static int AfterReverse(eio_req *req)
+    {
+        v8::HandleScope scope;
+        ReverseRequest *r = (ReverseRequest *) req->data;
+        ev_unref(EV_DEFAULT_UC);
+        v8::Handle<v8::Value> argv[2];
+        if (r->found)
+        {
+            argv[0] = v8::Null();
+            argv[1] = v8::String::New(r->name.c_str());
+        }
+        else
+        {
+            argv[0] = v8::Exception::Error(v8::String::New("no hostname for address"));
+            argv[1] = v8::Null();
+        }
+        v8::TryCatch try_catch;
+        r->callback->Call(v8::Context::GetCurrent()->Global(), 2, argv);
+        r->callback.Dispose();
+        delete r;
+        if (try_catch.HasCaught())
+            node::FatalException(try_catch);
+        return 0;
+    }
+    
+    // lookupHostname(callback) -- like hostname(), but without blocking:
+    // calls callback(err, name).
+    static v8::Handle<v8::Value> LookupHostname(const v8::Arguments& args)
+    {
+        v8::HandleScope scope;
+        Address *address = node::ObjectWrap::Unwrap<Address>(args.This());
+        if (args.Length() < 1 || !args[0]->IsFunction())
+            return v8::ThrowException(v8::Exception::Error(v8::String::New("lookupHostname requires a callback")));
+        ReverseRequest *r = new ReverseRequest();
+        r->host = address->address.host;
+        r->found = false;
+        r->callback = v8::Persistent<v8::Function>::New(v8::Local<v8::Function>::Cast(args[0]));
+        eio_custom(DoReverse, EIO_PRI_DEFAULT, AfterReverse, r);
+        ev_ref(EV_DEFAULT_UC);
+        return v8::Undefined();
+    }
+    
     static v8::Handle<v8::Value> Host(const v8::Arguments& args)
     {
         v8::HandleScope scope;
@@ -367,15 +804,23 @@ public:
         return scope.Close(v8::Int32::New(address->address.port));
     }
     
+    // host * 65536 + port: unique per address and exact as a double.
+    static v8::Handle<v8::Value> Key(const v8::Arguments& args)
+    {
+        v8::HandleScope scope;
+        Address *address = node::ObjectWrap::Unwrap<Address>(args.This());
+        return scope.Close(v8::Number::New((double) address->address.host * 65536 + address->address.port));
+    }
+    
     static v8::Handle<v8::Value> Hostname(const v8::Arguments& args)
     {
         v8::HandleScope scope;
-        char buffer[256];
+        std::string name;
         Address *address = node::ObjectWrap::Unwrap<Address>(args.This());
-        if (enet_address_get_host(&(address->address), buffer, 256) == 0)
-            return scope.Close(v8::String::New(buffer));
-        v8::Handle<v8::Value> ret;
-        return scope.Close(ret);
+        if (ResolveName(address->address.host, &name))
+            return scope.Close(v8::String::New(name.c_str()));
+        // Like enet_address_get_host, fall back to the dotted quad.
+        return GetAddress(args);
     }
     
     static v8::Handle<v8::Value> GetAddress(const v8::Arguments& args)
@@ -398,7 +843,7 @@ public:
         {
             address->address.host = args[0]->Uint32Value();
         }
-        scope.Close(ret);
+        return scope.Close(ret);
     }
 
     static v8::Handle<v8::Value> SetPort(const v8::Arguments& args)
@@ -410,7 +855,7 @@ public:
         {
             address->address.port = (enet_uint16) args[0]->Int32Value();
         }
-        scope.Close(ret);
+        return scope.Close(ret);
     }
     
     static v8::Handle<v8::Value> SetHostname(const v8::Arguments& args)
@@ -422,10 +867,75 @@ public:
         if (args[0]->IsString())
         {
             v8::String::Utf8Value utf8(args[0]);
-            if (enet_address_set_host(&(address->address), *utf8) == 0)
-                success = true;
+            const char *error;
+            success = ParseAddress(*utf8, &address->address, &error);
         }
-        scope.Close(v8::Boolean::New(success));
+        return scope.Close(v8::Boolean::New(success));
+    }
+};
+
+// StreamWindow -- JS handle on a SendWindow, for the write streams in
+// enet.js. Peer.sendStream() sends through it.
+class StreamWindow : public node::ObjectWrap
+{
+private:
+    friend class Peer;
+    SendWindow *window;
+    // Where wakeAt() wakes; set by each sendStream().
+    EventSink *wake;
+
+public:
+    StreamWindow() : window(new SendWindow()), wake(NULL)
+    {
+    }
+    
+    ~StreamWindow()
+    {
+        window->Unref();
+    }
+    
+    static v8::Persistent<v8::FunctionTemplate> s_ct;
+    
+    static void Init(v8::Handle<v8::Object> target)
+    {
+        v8::HandleScope scope;
+        v8::Local<v8::FunctionTemplate> t = v8::FunctionTemplate::New(New);
+        s_ct = v8::Persistent<v8::FunctionTemplate>::New(t);
+        s_ct->InstanceTemplate()->SetInternalFieldCount(1);
+        s_ct->SetClassName(v8::String::NewSymbol("StreamWindow"));
+        NODE_SET_PROTOTYPE_METHOD(s_ct, "outstanding", Outstanding);
+        NODE_SET_PROTOTYPE_METHOD(s_ct, "wakeAt", WakeAt);
+        target->Set(v8::String::NewSymbol("StreamWindow"), s_ct->GetFunction());
+    }
+    
+    static v8::Handle<v8::Value> New(const v8::Arguments& args)
+    {
+        v8::HandleScope scope;
+        StreamWindow *window = new StreamWindow();
+        window->Wrap(args.This());
+        return scope.Close(args.This());
+    }
+    
+    // outstanding() -- bytes sent through this window that enet still holds.
+    static v8::Handle<v8::Value> Outstanding(const v8::Arguments& args)
+    {
+        v8::HandleScope scope;
+        StreamWindow *window = node::ObjectWrap::Unwrap<StreamWindow>(args.This());
+        return scope.Close(v8::Number::New((double) window->window->Outstanding()));
+    }
+    
+    // wakeAt(bytes) -- makes sure the host is serviced once outstanding()
+    // falls to bytes, which on a threaded host means waking JS from the
+    // service thread. Returns false if it is there already.
+    static v8::Handle<v8::Value> WakeAt(const v8::Arguments& args)
+    {
+        v8::HandleScope scope;
+        StreamWindow *window = node::ObjectWrap::Unwrap<StreamWindow>(args.This());
+        double bytes = args.Length() > 0 ? args[0]->NumberValue() : 0;
+        if (!(bytes >= 0))
+            bytes = 0;
+        bool armed = window->window->WakeAt((size_t) bytes, window->wake);
+        return scope.Close(v8::Boolean::New(armed));
     }
 };
 
@@ -433,11 +943,61 @@ class Peer : public node::ObjectWrap
 {
 private:
      ENetPeer *peer;
+     // Kept so address() still works once the slot has been released.
+     ENetAddress address;
+     // Identifies the connection to a service thread, which drops commands
+     // for a slot that has since been reused.
+     enet_uint32 connectID;
+     // Reset or dropped from JS on a threaded host. The wrapper stays in
+     // its slot until the slot's next connection, so that events the
+     // service thread had already queued for this one can be recognized
+     // and dropped.
+     bool retired;
 
 public:
-    Peer(ENetPeer *peer) : peer(peer) { }
+    Peer(ENetPeer *peer) : peer(peer), connectID(0), retired(false)
+    {
+        if (peer != NULL)
+        {
+            address = peer->address;
+            connectID = peer->connectID;
+        }
+        else
+        {
+            ::memset(&address, 0, sizeof(ENetAddress));
+        }
+    }
+    
+    // For a threaded host, whose slots belong to the service thread: the
+    // connection is identified by what came with its event.
+    Peer(ENetPeer *peer, enet_uint32 connectID, const ENetAddress& address)
+        : peer(peer), address(address), connectID(connectID), retired(false)
+    {
+    }
+    
+    // Posts a command for this peer to the service thread running its host.
+    bool PostCommand(ServiceThread *thread, ServiceCommand::Type type, enet_uint8 channel,
+        enet_uint32 data, ENetPacket *packet)
+    {
+        ServiceCommand command;
+        ::memset(&command, 0, sizeof(ServiceCommand));
+        command.type = type;
+        command.peerID = peer->incomingPeerID;
+        command.connectID = connectID;
+        command.channelID = channel;
+        command.data = data;
+        command.packet = packet;
+        if (!thread->Post(command))
+            return false;
+        thread->Wake();
+        return true;
+    }
     
-    ~Peer() { }
+    ~Peer()
+    {
+        if (peer != NULL && peer->data == this)
+            peer->data = NULL;
+    }
     
     static v8::Persistent<v8::FunctionTemplate> s_ct;
     
@@ -449,6 +1009,10 @@ public:
         s_ct->InstanceTemplate()->SetInternalFieldCount(1);
         s_ct->SetClassName(v8::String::NewSymbol("Peer"));
         NODE_SET_PROTOTYPE_METHOD(s_ct, "send", Send);
+        NODE_SET_PROTOTYPE_METHOD(s_ct, "sendBuffer", SendBuffer);
+        NODE_SET_PROTOTYPE_METHOD(s_ct, "sendString", SendString);
+        NODE_SET_PROTOTYPE_METHOD(s_ct, "sendMany", SendMany);
+        NODE_SET_PROTOTYPE_METHOD(s_ct, "sendStream", SendStream);
         NODE_SET_PROTOTYPE_METHOD(s_ct, "receive", Receive);
         NODE_SET_PROTOTYPE_METHOD(s_ct, "reset", Reset);
         NODE_SET_PROTOTYPE_METHOD(s_ct, "ping", Ping);
@@ -456,6 +1020,22 @@ public:
         NODE_SET_PROTOTYPE_METHOD(s_ct, "disconnect", Disconnect);
         NODE_SET_PROTOTYPE_METHOD(s_ct, "disconnectLater", DisconnectLater);
         NODE_SET_PROTOTYPE_METHOD(s_ct, "address", GetAddress);
+        NODE_SET_PROTOTYPE_METHOD(s_ct, "stats", Stats);
+        MY_NODE_DEFINE_CONSTANT(s_ct, "STAT_STATE", kStatState);
+        MY_NODE_DEFINE_CONSTANT(s_ct, "STAT_ROUND_TRIP_TIME", kStatRoundTripTime);
+        MY_NODE_DEFINE_CONSTANT(s_ct, "STAT_ROUND_TRIP_TIME_VARIANCE", kStatRoundTripTimeVariance);
+        MY_NODE_DEFINE_CONSTANT(s_ct, "STAT_PACKET_LOSS", kStatPacketLoss);
+        MY_NODE_DEFINE_CONSTANT(s_ct, "STAT_PACKET_LOSS_VARIANCE", kStatPacketLossVariance);
+        MY_NODE_DEFINE_CONSTANT(s_ct, "STAT_PACKETS_SENT", kStatPacketsSent);
+        MY_NODE_DEFINE_CONSTANT(s_ct, "STAT_PACKETS_LOST", kStatPacketsLost);
+        MY_NODE_DEFINE_CONSTANT(s_ct, "STAT_INCOMING_DATA_TOTAL", kStatIncomingDataTotal);
+        MY_NODE_DEFINE_CONSTANT(s_ct, "STAT_OUTGOING_DATA_TOTAL", kStatOutgoingDataTotal);
+        MY_NODE_DEFINE_CONSTANT(s_ct, "STAT_RELIABLE_DATA_IN_TRANSIT", kStatReliableDataInTransit);
+        MY_NODE_DEFINE_CONSTANT(s_ct, "STAT_OUTGOING_RELIABLE_COMMANDS", kStatOutgoingReliableCommands);
+        MY_NODE_DEFINE_CONSTANT(s_ct, "STAT_SENT_RELIABLE_COMMANDS", kStatSentReliableCommands);
+        MY_NODE_DEFINE_CONSTANT(s_ct, "STAT_OUTGOING_UNRELIABLE_COMMANDS", kStatOutgoingUnreliableCommands);
+        MY_NODE_DEFINE_CONSTANT(s_ct, "STAT_MTU", kStatMTU);
+        MY_NODE_DEFINE_CONSTANT(s_ct, "STAT_COUNT", kStatCount);
         target->Set(v8::String::NewSymbol("Peer"), s_ct->GetFunction());
     }
     
@@ -467,36 +1047,336 @@ public:
         return scope.Close(args.This());
     }
     
+    // Each ENetPeer slot has one wrapper, kept in ENetPeer::data and held
+    // alive until the connection goes away, so every event for a connection
+    // sees the same JS object.
     static v8::Handle<v8::Value> WrapPeer(ENetPeer *p)
     {
-        Peer *peer = new Peer(p);
+        if (p->data != NULL)
+        {
+            if (!((Peer *) p->data)->retired)
+                return ((Peer *) p->data)->handle_;
+            // Left over from a threaded host that has since been stopped.
+            Invalidate(p);
+        }
+        return Attach(p, new Peer(p));
+    }
+    
+    // WrapPeer for a threaded host, which can't read the slot: whatever
+    // wrapper the slot has for another connection is detached first.
+    static v8::Handle<v8::Value> WrapPeer(ENetPeer *p, enet_uint32 connectID, const ENetAddress& address)
+    {
+        Peer *current = (Peer *) p->data;
+        if (current != NULL)
+        {
+            if (current->connectID == connectID && !current->retired)
+                return current->handle_;
+            Invalidate(p);
+        }
+        return Attach(p, new Peer(p, connectID, address));
+    }
+    
+    // Where the peer is now. enet follows a peer to a new address on the
+    // thread that services the host; on a threaded host the slot isn't
+    // ours to read, and the address the wrapper was claimed with stands in.
+    const ENetAddress *CurrentAddress(ServiceThread *thread) const
+    {
+        return thread != NULL ? &address : &peer->address;
+    }
+    
+    static v8::Handle<v8::Value> Attach(ENetPeer *p, Peer *peer)
+    {
         v8::Local<v8::Object> o = s_ct->InstanceTemplate()->NewInstance();
         peer->Wrap(o);
+        peer->Ref();
+        p->data = peer;
         return o;
     }
     
+    // Called for each event from a service thread, before anything looks
+    // at the slot's wrapper: makes sure the wrapper is the one for the
+    // event's connection. Returns false if the event is for a connection
+    // JS is already done with, and should be dropped.
+    static bool Claim(ENetPeer *p, ENetEventType type, enet_uint32 connectID, const ENetAddress& address)
+    {
+        Peer *current = (Peer *) p->data;
+        if (current != NULL && (current->connectID == connectID ? current->retired
+            : type != ENET_EVENT_TYPE_CONNECT))
+        {
+            // Events come in order, so one for another connection without
+            // its connect event first must be from an older one.
+            return false;
+        }
+        v8::HandleScope scope;
+        WrapPeer(p, connectID, address);
+        return true;
+    }
+    
+    // Detaches the wrapper from its slot after a disconnect or reset; ENet may
+    // hand the slot to a different connection afterwards.
+    static void Invalidate(ENetPeer *p)
+    {
+        Peer *peer = (Peer *) p->data;
+        if (peer == NULL)
+            return;
+        p->data = NULL;
+        peer->peer = NULL;
+        peer->Unref();
+    }
+    
+    // Invalidate, for a reset or disconnectNow() posted to a service
+    // thread: the wrapper stops working but keeps the slot (see retired).
+    static void Retire(ENetPeer *p)
+    {
+        Peer *peer = (Peer *) p->data;
+        if (peer == NULL)
+            return;
+        peer->peer = NULL;
+        peer->retired = true;
+    }
+    
+    static v8::Handle<v8::Value> ThrowDisconnected()
+    {
+        return v8::ThrowException(v8::Exception::Error(v8::String::New("peer is no longer connected")));
+    }
+    
     static v8::Handle<v8::Value> Send(const v8::Arguments& args)
     {
         v8::HandleScope scope;
         Peer *peer = node::ObjectWrap::Unwrap<Peer>(args.This());
+        if (peer->peer == NULL)
+            return ThrowDisconnected();
         if (args.Length() != 2 || !args[0]->IsInt32() || !args[1]->IsObject())
         {
             return v8::ThrowException(v8::Exception::Error(v8::String::New("send requires two arguments, channel number, packet")));
         }
         enet_uint8 channel = (enet_uint8) args[0]->Int32Value();
         Packet *packet = node::ObjectWrap::Unwrap<Packet>(args[1]->ToObject());
-        if (enet_peer_send(peer->peer, channel, packet->packet) < 0)
+        if (packet->packet == NULL)
+            return Packet::ThrowSent();
+        ServiceThread *thread = ThreadFor(peer->peer->host);
+        if (thread != NULL)
         {
-            return v8::ThrowException(v8::Exception::Error(v8::String::New("enet.Peer.send error")));
+            ENetPacket *p = packet->Detach();
+            if (p == NULL)
+                return v8::ThrowException(v8::Exception::Error(v8::String::New("could not allocate packet")));
+            CaptureSend(peer->peer->host, peer->CurrentAddress(thread), channel, p);
+            if (!peer->PostCommand(thread, ServiceCommand::SEND, channel, 0, p))
+            {
+                packet->Reattach(p);
+                return ThrowQueueFull();
+            }
+            return v8::Undefined();
+        }
+        // enet takes its own reference; the Packet stays usable.
+        CaptureSend(peer->peer->host, peer->CurrentAddress(thread), channel, packet->packet);
+        if (QueueSend(peer->peer, channel, packet->packet) < 0)
+        {
+            return v8::ThrowException(v8::Exception::Error(v8::String::New("enet.Peer.send error")));
+        }
+        return v8::Undefined();
+    }
+    
+    // Queues a packet we created ourselves, destroying it if ENet refuses it.
+    static v8::Handle<v8::Value> SendPacket(Peer *peer, enet_uint8 channel, ENetPacket *packet)
+    {
+        if (packet == NULL)
+        {
+            return v8::ThrowException(v8::Exception::Error(v8::String::New("could not allocate packet")));
+        }
+        ServiceThread *thread = ThreadFor(peer->peer->host);
+        CaptureSend(peer->peer->host, peer->CurrentAddress(thread), channel, packet);
+        if (thread != NULL)
+        {
+            if (!peer->PostCommand(thread, ServiceCommand::SEND, channel, 0, packet))
+            {
+                enet_packet_destroy(packet);
+                return ThrowQueueFull();
+            }
+            return v8::Undefined();
+        }
+        if (QueueSend(peer->peer, channel, packet) < 0)
+        {
+            enet_packet_destroy(packet);
+            return v8::ThrowException(v8::Exception::Error(v8::String::New("enet.Peer.send error")));
         }
-        packet->isSent = true;
         return v8::Undefined();
     }
     
+    // sendBuffer(channel, buffer[, flags]) -- sends a Buffer without going
+    // through a Packet object. With FLAG_NO_ALLOCATE the Buffer's memory is
+    // sent in place, and must not be modified until ENet is done with it.
+    static v8::Handle<v8::Value> SendBuffer(const v8::Arguments& args)
+    {
+        v8::HandleScope scope;
+        Peer *peer = node::ObjectWrap::Unwrap<Peer>(args.This());
+        if (peer->peer == NULL)
+            return ThrowDisconnected();
+        if (args.Length() < 2 || !args[0]->IsInt32() || !args[1]->IsObject())
+        {
+            return v8::ThrowException(v8::Exception::Error(v8::String::New("sendBuffer requires a channel number and a buffer")));
+        }
+        enet_uint8 channel = (enet_uint8) args[0]->Int32Value();
+        enet_uint32 flags = 0;
+        if (args.Length() > 2)
+            flags = args[2]->Uint32Value();
+        // Assume it is a Buffer.
+        v8::Local<v8::Object> buffer = args[1]->ToObject();
+        // The pinned Buffer would be released on the service thread, so a
+        // threaded host always copies.
+        if (ThreadFor(peer->peer->host) != NULL)
+            flags &= ~ENET_PACKET_FLAG_NO_ALLOCATE;
+        ENetPacket *packet;
+        if (flags & ENET_PACKET_FLAG_NO_ALLOCATE)
+            packet = Packet::CreatePinned(buffer, flags);
+        else
+            packet = Packet::CreatePacket(node::Buffer::Data(buffer), node::Buffer::Length(buffer), flags);
+        return SendPacket(peer, channel, packet);
+    }
+    
+    // sendString(channel, string[, flags]) -- sends a string as UTF-8.
+    static v8::Handle<v8::Value> SendString(const v8::Arguments& args)
+    {
+        v8::HandleScope scope;
+        Peer *peer = node::ObjectWrap::Unwrap<Peer>(args.This());
+        if (peer->peer == NULL)
+            return ThrowDisconnected();
+        if (args.Length() < 2 || !args[0]->IsInt32())
+        {
+            return v8::ThrowException(v8::Exception::Error(v8::String::New("sendString requires a channel number and a string")));
+        }
+        enet_uint8 channel = (enet_uint8) args[0]->Int32Value();
+        enet_uint32 flags = 0;
+        if (args.Length() > 2)
+            flags = args[2]->Uint32Value() & ~ENET_PACKET_FLAG_NO_ALLOCATE;
+        v8::String::Utf8Value utf8(args[1]);
+        return SendPacket(peer, channel, Packet::CreatePacket(*utf8, utf8.length(), flags));
+    }
+    
+    // sendMany(channel, buffers[, flags[, flush]]) or
+    // sendMany(channel, buffer, offsets[, flags[, flush]]) -- queues several
+    // messages in one call, optionally flushing the host afterwards. Returns
+    // the number of messages queued.
+    static v8::Handle<v8::Value> SendMany(const v8::Arguments& args)
+    {
+        v8::HandleScope scope;
+        Peer *peer = node::ObjectWrap::Unwrap<Peer>(args.This());
+        if (peer->peer == NULL)
+            return ThrowDisconnected();
+        std::vector<ENetBuffer> messages;
+        int next = -1;
+        if (args.Length() > 1 && args[0]->IsInt32())
+            next = CollectMessages(args, 1, messages);
+        if (next < 0)
+        {
+            return v8::ThrowException(v8::Exception::Error(v8::String::New("sendMany requires a channel number and an array of buffers, or a buffer and an array of offsets")));
+        }
+        enet_uint8 channel = (enet_uint8) args[0]->Int32Value();
+        enet_uint32 flags = 0;
+        if (args.Length() > next)
+            flags = args[next]->Uint32Value() & ~ENET_PACKET_FLAG_NO_ALLOCATE;
+        bool flush = args.Length() > next + 1 && args[next + 1]->BooleanValue();
+        ServiceThread *thread = ThreadFor(peer->peer->host);
+        size_t sent = 0;
+        for (; sent < messages.size(); sent++)
+        {
+            ENetPacket *packet = Packet::CreatePacket(messages[sent].data, messages[sent].dataLength, flags);
+            if (packet == NULL)
+                break;
+            CaptureSend(peer->peer->host, peer->CurrentAddress(thread), channel, packet);
+            if (thread != NULL)
+            {
+                if (!peer->PostCommand(thread, ServiceCommand::SEND, channel, 0, packet))
+                {
+                    enet_packet_destroy(packet);
+                    break;
+                }
+            }
+            else if (QueueSend(peer->peer, channel, packet) < 0)
+            {
+                enet_packet_destroy(packet);
+                break;
+            }
+        }
+        if (flush && thread != NULL)
+            peer->PostCommand(thread, ServiceCommand::FLUSH, 0, 0, NULL);
+        else if (flush)
+            enet_host_flush(peer->peer->host);
+        if (sent < messages.size())
+            return v8::ThrowException(v8::Exception::Error(v8::String::New("enet.Peer.sendMany error")));
+        return scope.Close(v8::Integer::New(sent));
+    }
+    
+    // sendStream(channel, window, header, buffer, offset, maxBytes) -- sends
+    // buffer from offset as reliable packets small enough that enet never
+    // fragments them, each starting with header and counted against the
+    // StreamWindow, until at least maxBytes (or the rest of the buffer) have
+    // gone. With nothing left to send, sends header alone. Returns the
+    // number of bytes of buffer sent.
+    static v8::Handle<v8::Value> SendStream(const v8::Arguments& args)
+    {
+        v8::HandleScope scope;
+        Peer *peer = node::ObjectWrap::Unwrap<Peer>(args.This());
+        if (peer->peer == NULL)
+            return ThrowDisconnected();
+        if (args.Length() < 6 || !args[0]->IsInt32() || !StreamWindow::s_ct->HasInstance(args[1])
+            || !node::Buffer::HasInstance(args[2]) || !node::Buffer::HasInstance(args[3]))
+        {
+            return v8::ThrowException(v8::Exception::Error(v8::String::New("sendStream requires a channel number, a window, a header, a buffer, an offset and a byte count")));
+        }
+        enet_uint8 channel = (enet_uint8) args[0]->Int32Value();
+        StreamWindow *window = node::ObjectWrap::Unwrap<StreamWindow>(args[1]->ToObject());
+        v8::Local<v8::Object> header = args[2]->ToObject();
+        v8::Local<v8::Object> buffer = args[3]->ToObject();
+        size_t headerLength = node::Buffer::Length(header);
+        size_t length = node::Buffer::Length(buffer);
+        double offsetArg = args[4]->NumberValue();
+        size_t offset = offsetArg > 0 ? (size_t) offsetArg : 0;
+        if (offset > length)
+            offset = length;
+        double maxArg = args[5]->NumberValue();
+        size_t maxBytes = maxArg > 0 ? (size_t) maxArg : 0;
+        size_t chunk = SendWindow::ChunkSize(peer->peer, headerLength);
+        const char *data = node::Buffer::Data(buffer) + offset;
+        length -= offset;
+        ServiceThread *thread = ThreadFor(peer->peer->host);
+        window->wake = thread != NULL ? thread->Sink() : NULL;
+        size_t sent = 0;
+        do
+        {
+            size_t n = length - sent < chunk ? length - sent : chunk;
+            ENetPacket *packet = window->window->CreatePacket(node::Buffer::Data(header), headerLength, data + sent, n);
+            if (packet == NULL)
+                return v8::ThrowException(v8::Exception::Error(v8::String::New("could not allocate packet")));
+            TrackPacket(packet);
+            CaptureSend(peer->peer->host, peer->CurrentAddress(thread), channel, packet);
+            if (thread != NULL)
+            {
+                if (!peer->PostCommand(thread, ServiceCommand::SEND, channel, 0, packet))
+                {
+                    enet_packet_destroy(packet);
+                    return ThrowQueueFull();
+                }
+            }
+            else if (QueueSend(peer->peer, channel, packet) < 0)
+            {
+                enet_packet_destroy(packet);
+                return v8::ThrowException(v8::Exception::Error(v8::String::New("enet.Peer.sendStream error")));
+            }
+            sent += n;
+        }
+        while (sent < maxBytes && sent < length);
+        return scope.Close(v8::Number::New((double) sent));
+    }
+    
     static v8::Handle<v8::Value> Receive(const v8::Arguments& args)
     {
         v8::HandleScope scope;
         Peer *peer = node::ObjectWrap::Unwrap<Peer>(args.This());
+        if (peer->peer == NULL)
+            return ThrowDisconnected();
+        if (ThreadFor(peer->peer->host) != NULL)
+            return v8::ThrowException(v8::Exception::Error(v8::String::New("receive is not available on a threaded host")));
         enet_uint8 channelID = 0;
         v8::Local<v8::Array> result = v8::Array::New(2);
         ENetPacket *packet = enet_peer_receive(peer->peer, &channelID);
@@ -512,7 +1392,21 @@ public:
     {
         v8::HandleScope scope;
         Peer *peer = node::ObjectWrap::Unwrap<Peer>(args.This());
-        enet_peer_reset(peer->peer);
+        if (peer->peer == NULL)
+            return ThrowDisconnected();
+        ENetPeer *p = peer->peer;
+        ServiceThread *thread = ThreadFor(p->host);
+        if (thread != NULL)
+        {
+            if (!peer->PostCommand(thread, ServiceCommand::RESET, 0, 0, NULL))
+                return ThrowQueueFull();
+            Retire(p);
+        }
+        else
+        {
+            enet_peer_reset(p);
+            Invalidate(p);
+        }
         return scope.Close(v8::Undefined());
     }
     
@@ -520,7 +1414,18 @@ public:
     {
         v8::HandleScope scope;
         Peer *peer = node::ObjectWrap::Unwrap<Peer>(args.This());
-        enet_peer_ping(peer->peer);
+        if (peer->peer == NULL)
+            return ThrowDisconnected();
+        ServiceThread *thread = ThreadFor(peer->peer->host);
+        if (thread != NULL)
+        {
+            if (!peer->PostCommand(thread, ServiceCommand::PING, 0, 0, NULL))
+                return ThrowQueueFull();
+        }
+        else
+        {
+            enet_peer_ping(peer->peer);
+        }
         return scope.Close(v8::Undefined());        
     }
     
@@ -528,10 +1433,24 @@ public:
     {
         v8::HandleScope scope;
         Peer *peer = node::ObjectWrap::Unwrap<Peer>(args.This());
+        if (peer->peer == NULL)
+            return ThrowDisconnected();
         enet_uint32 data = 0;
         if (args.Length() > 0)
             data = args[0]->Uint32Value();
-        enet_peer_disconnect_now(peer->peer, data);
+        ENetPeer *p = peer->peer;
+        ServiceThread *thread = ThreadFor(p->host);
+        if (thread != NULL)
+        {
+            if (!peer->PostCommand(thread, ServiceCommand::DISCONNECT_NOW, 0, data, NULL))
+                return ThrowQueueFull();
+            Retire(p);
+        }
+        else
+        {
+            enet_peer_disconnect_now(p, data);
+            Invalidate(p);
+        }
         return scope.Close(v8::Undefined());        
     }
 
@@ -539,10 +1458,21 @@ public:
     {
         v8::HandleScope scope;
         Peer *peer = node::ObjectWrap::Unwrap<Peer>(args.This());
+        if (peer->peer == NULL)
+            return ThrowDisconnected();
         enet_uint32 data = 0;
         if (args.Length() > 0)
             data = args[0]->Uint32Value();
-        enet_peer_disconnect(peer->peer, data);
+        ServiceThread *thread = ThreadFor(peer->peer->host);
+        if (thread != NULL)
+        {
+            if (!peer->PostCommand(thread, ServiceCommand::DISCONNECT, 0, data, NULL))
+                return ThrowQueueFull();
+        }
+        else
+        {
+            enet_peer_disconnect(peer->peer, data);
+        }
         return scope.Close(v8::Undefined());        
     }
 
@@ -550,18 +1480,126 @@ public:
     {
         v8::HandleScope scope;
         Peer *peer = node::ObjectWrap::Unwrap<Peer>(args.This());
+        if (peer->peer == NULL)
+            return ThrowDisconnected();
         enet_uint32 data = 0;
         if (args.Length() > 0)
             data = args[0]->Uint32Value();
-        enet_peer_disconnect_later(peer->peer, data);
+        ServiceThread *thread = ThreadFor(peer->peer->host);
+        if (thread != NULL)
+        {
+            if (!peer->PostCommand(thread, ServiceCommand::DISCONNECT_LATER, 0, data, NULL))
+                return ThrowQueueFull();
+        }
+        else
+        {
+            enet_peer_disconnect_later(peer->peer, data);
+        }
         return scope.Close(v8::Undefined());        
     }
     
+    // Counters reported by stats() and Host.peerStats(), in this order.
+    enum PeerStat
+    {
+        kStatState,
+        kStatRoundTripTime,
+        kStatRoundTripTimeVariance,
+        kStatPacketLoss,
+        kStatPacketLossVariance,
+        kStatPacketsSent,
+        kStatPacketsLost,
+        kStatIncomingDataTotal,
+        kStatOutgoingDataTotal,
+        kStatReliableDataInTransit,
+        kStatOutgoingReliableCommands,
+        kStatSentReliableCommands,
+        kStatOutgoingUnreliableCommands,
+        kStatMTU,
+        kStatCount
+    };
+    
+    // Writes p's counters to out[0], out[stride], out[2 * stride] and so on.
+    // It walks p's command lists, so on a threaded host it must run on the
+    // service thread.
+    static void FillStats(ENetPeer *p, enet_uint32 *out, size_t stride)
+    {
+        out[kStatState * stride] = p->state;
+        out[kStatRoundTripTime * stride] = p->roundTripTime;
+        out[kStatRoundTripTimeVariance * stride] = p->roundTripTimeVariance;
+        out[kStatPacketLoss * stride] = p->packetLoss;
+        out[kStatPacketLossVariance * stride] = p->packetLossVariance;
+        out[kStatPacketsSent * stride] = p->packetsSent;
+        out[kStatPacketsLost * stride] = p->packetsLost;
+        out[kStatIncomingDataTotal * stride] = p->incomingDataTotal;
+        out[kStatOutgoingDataTotal * stride] = p->outgoingDataTotal;
+        out[kStatReliableDataInTransit * stride] = p->reliableDataInTransit;
+        if (p->state == ENET_PEER_STATE_DISCONNECTED)
+        {
+            out[kStatOutgoingReliableCommands * stride] = 0;
+            out[kStatSentReliableCommands * stride] = 0;
+            out[kStatOutgoingUnreliableCommands * stride] = 0;
+        }
+        else
+        {
+            out[kStatOutgoingReliableCommands * stride] = enet_list_size(&p->outgoingReliableCommands);
+            out[kStatSentReliableCommands * stride] = enet_list_size(&p->sentReliableCommands);
+            out[kStatOutgoingUnreliableCommands * stride] = enet_list_size(&p->outgoingUnreliableCommands);
+        }
+        out[kStatMTU * stride] = p->mtu;
+    }
+    
+    static enet_uint32 statsData[kStatCount];
+    static v8::Persistent<v8::Object> statsObject;
+    
+    struct StatsCall
+    {
+        ENetPeer *peer;
+        enet_uint32 connectID;
+    };
+    
+    // A slot the service thread has already given to another connection
+    // reads as disconnected.
+    static void StatsOnThread(ENetHost *host, void *arg)
+    {
+        StatsCall *call = (StatsCall *) arg;
+        if (call->peer->connectID == call->connectID)
+            FillStats(call->peer, statsData, 1);
+        else
+            ::memset(statsData, 0, sizeof(statsData));
+    }
+    
+    // stats() -- returns the peer's counters, indexed by the Peer.STAT_*
+    // constants. The array is shared by all peers and overwritten by the
+    // next call.
+    static v8::Handle<v8::Value> Stats(const v8::Arguments& args)
+    {
+        v8::HandleScope scope;
+        Peer *peer = node::ObjectWrap::Unwrap<Peer>(args.This());
+        if (peer->peer == NULL)
+            return ThrowDisconnected();
+        if (statsObject.IsEmpty())
+            statsObject = NewExternalArray(statsData, kStatCount);
+        ServiceThread *thread = ThreadFor(peer->peer->host);
+        if (thread != NULL)
+        {
+            StatsCall call = { peer->peer, peer->connectID };
+            if (!thread->Call(StatsOnThread, &call))
+                return ThrowQueueFull();
+        }
+        else
+        {
+            FillStats(peer->peer, statsData, 1);
+        }
+        return scope.Close(statsObject);
+    }
+    
     static v8::Handle<v8::Value> GetAddress(const v8::Arguments& args)
     {
         v8::HandleScope scope;
         Peer *peer = node::ObjectWrap::Unwrap<Peer>(args.This());
-        return scope.Close(Address::WrapAddress(peer->peer->address));
+        if (peer->peer == NULL)
+            return scope.Close(Address::WrapAddress(peer->address));
+        return scope.Close(Address::WrapAddress(*peer->CurrentAddress(ThreadFor(peer->peer->host))));
     }
 };
 
@@ -569,10 +1607,23 @@ class Event : node::ObjectWrap
 {
 private:
     ENetEvent event;
+    // For disconnects, the peer wrapper is looked up before the slot is
+    // released, since ENet may reuse it for the next connection.
+    v8::Persistent<v8::Value> peerObject;
     
 public:
     Event(ENetEvent event) : event(event)
     {
+        if (event.packet != NULL)
+            Packet::RetainPacket(event.packet);
+    }
+    
+    ~Event()
+    {
+        if (event.packet != NULL)
+            Packet::ReleasePacket(event.packet);
+        if (!peerObject.IsEmpty())
+            peerObject.Dispose();
     }
     
     static v8::Persistent<v8::FunctionTemplate> s_ct;
@@ -601,9 +1652,37 @@ public:
         Event *event = new Event(e);
         v8::Handle<v8::Object> o = s_ct->InstanceTemplate()->NewInstance();
         event->Wrap(o);
+        event->ResolvePeer();
         return o;
     }
     
+    // Points an existing Event object at a new event, so a host can hand
+    // out the same object for every service() call.
+    static void ReuseEvent(v8::Handle<v8::Object> o, ENetEvent e)
+    {
+        Event *event = node::ObjectWrap::Unwrap<Event>(o);
+        if (e.packet != NULL)
+            Packet::RetainPacket(e.packet);
+        if (event->event.packet != NULL)
+            Packet::ReleasePacket(event->event.packet);
+        if (!event->peerObject.IsEmpty())
+        {
+            event->peerObject.Dispose();
+            event->peerObject.Clear();
+        }
+        event->event = e;
+        event->ResolvePeer();
+    }
+    
+    void ResolvePeer()
+    {
+        if (event.type == ENET_EVENT_TYPE_DISCONNECT && event.peer != NULL)
+        {
+            peerObject = v8::Persistent<v8::Value>::New(Peer::WrapPeer(event.peer));
+            Peer::Invalidate(event.peer);
+        }
+    }
+    
     static v8::Handle<v8::Value> Type(const v8::Arguments& args)
     {
         v8::HandleScope scope;
@@ -615,6 +1694,8 @@ public:
     {
         v8::HandleScope scope;
         Event *e = node::ObjectWrap::Unwrap<Event>(args.This());
+        if (!e->peerObject.IsEmpty())
+            return scope.Close(e->peerObject);
         if (e->event.peer == NULL)
             return scope.Close(v8::Null());
         v8::Handle<v8::Value> result = Peer::WrapPeer(e->event.peer);
@@ -646,7 +1727,7 @@ public:
     }
 };
 
-class Host : node::EventEmitter
+class Host : node::EventEmitter, public EventSink
 {
 private:
     ENetHost *host;
@@ -656,10 +1737,128 @@ private:
     enet_uint32 incomingBandwidth;
     enet_uint32 outgoingBandwidth;
     
+    // serviceBatch() reports type, channelID and data for each event through
+    // this array, exposed to JS as an external uint32 array.
+    enum { kBatchStride = 3, kMaxBatch = 256 };
+    enet_uint32 batchInfo[kMaxBatch * kBatchStride];
+    v8::Persistent<v8::Object> batchInfoObject;
+    
+    // Buffers behind stats() and peerStats(); peerStatsData holds
+    // Peer::kStatCount columns of one value per peer slot.
+    enum HostStat
+    {
+        kStatTotalSentData,
+        kStatTotalSentPackets,
+        kStatTotalReceivedData,
+        kStatTotalReceivedPackets,
+        kStatConnectedPeers,
+        kStatPeerCount,
+        kStatCount
+    };
+    enet_uint32 statsData[kStatCount];
+    v8::Persistent<v8::Object> statsObject;
+    enet_uint32 *peerStatsData;
+    v8::Persistent<v8::Object> peerStatsObject;
+    
+    // Filled in by the compressor installed with setCompression().
+    CompressorStats compressionStats;
+    
+    // Connection screening; created by the first admission setting.
+    Admission *admission;
+    
+    // Non-enet datagrams; created by the first addRawFilter(). Matches are
+    // handed to rawHandler after each serviceBatch()/dispatch().
+    RawChannel *raw;
+    v8::Persistent<v8::Function> rawHandler;
+    
+    // Impairs incoming traffic while set with simulateLink().
+    LinkSimulator *link;
+    
+    // The trace being recorded by startCapture(), and the one being played
+    // back by startReplay().
+    TraceWriter *capture;
+    TraceReplay *replay;
+    
+    // Set by setScheduling(); sends wait here to be released in priority
+    // and round-robin order.
+    Scheduler *scheduler;
+    
+    // The Event handed out by service()/checkEvents() when asked to reuse
+    // one, and the handlers dispatch() calls instead of building events.
+    v8::Persistent<v8::Object> reusedEvent;
+    v8::Persistent<v8::Function> onConnect;
+    v8::Persistent<v8::Function> onDisconnect;
+    v8::Persistent<v8::Function> onMessage;
+    
+    // Handlers registered with route(), keyed by channel and type.
+    // A received message whose channel and leading type match one is
+    // delivered to it with the type stripped, instead of through
+    // serviceBatch's result.
+    enum RouteHeader { kRouteHeaderByte, kRouteHeaderVarint };
+    RouteHeader routeHeader;
+    typedef std::map<std::pair<enet_uint8, enet_uint32>, v8::Persistent<v8::Function> > RouteMap;
+    RouteMap routes;
+    
+    // Reads the type at the front of a message; *headerLength gets the
+    // number of bytes it took. Varints are unsigned LEB128, up to 32 bits.
+    bool ParseRouteType(const ENetPacket *p, enet_uint32 *type, size_t *headerLength)
+    {
+        if (p->dataLength == 0)
+            return false;
+        if (routeHeader == kRouteHeaderByte)
+        {
+            *type = p->data[0];
+            *headerLength = 1;
+            return true;
+        }
+        enet_uint32 value = 0;
+        for (size_t i = 0; i < p->dataLength && i < 5; i++)
+        {
+            value |= (enet_uint32) (p->data[i] & 0x7F) << (7 * i);
+            if ((p->data[i] & 0x80) == 0)
+            {
+                *type = value;
+                *headerLength = i + 1;
+                return true;
+            }
+        }
+        return false;
+    }
+    
+    // Messages collected for one route during a serviceBatch call.
+    struct RouteBatch
+    {
+        v8::Local<v8::Function> handler;
+        v8::Local<v8::Array> peers;
+        v8::Local<v8::Array> payloads;
+        uint32_t count;
+    };
+    
+    // The watcher calls serviceCallback when the socket is readable, or when
+    // the one-shot timer for ENet's next deadline fires. The prepare watcher
+    // rearms that timer before each pass through the event loop, so anything
+    // queued by JS in the meantime gets flushed right away.
+    ev_io ioWatcher;
+    ev_timer serviceTimer;
+    ev_prepare prepareWatcher;
+    v8::Persistent<v8::Function> serviceCallback;
+    bool watching;
+    
+    // In threaded mode every ENet call for this host happens on `thread';
+    // its events come back through threadEvents, and threadWakeup runs the
+    // service callback to collect them.
+    ServiceThread *thread;
+    MpscQueue *threadEvents;
+    ev_async threadWakeup;
+    enum { kDefaultCaptureBytes = 64 << 20 };
+    
 public:
     Host(Address *address_, size_t peerCount, size_t channelLimit, enet_uint32 incomingBandwidth, enet_uint32 outgoingBandwidth)
         : address(0), peerCount(peerCount), channelLimit(channelLimit),
-          incomingBandwidth(incomingBandwidth), outgoingBandwidth(outgoingBandwidth)
+          incomingBandwidth(incomingBandwidth), outgoingBandwidth(outgoingBandwidth),
+          peerStatsData(NULL), admission(NULL), raw(NULL), link(NULL),
+          capture(NULL), replay(NULL), scheduler(NULL), routeHeader(kRouteHeaderByte), watching(false),
+          thread(NULL), threadEvents(NULL)
     {
         ENetAddress *addr = NULL;
         if (address_ != NULL)
@@ -672,10 +1871,87 @@ public:
         {
             throw "failed to create host";
         }
+        ev_io_init(&ioWatcher, OnReadable, host->socket, EV_READ);
+        ioWatcher.data = this;
+        ev_timer_init(&serviceTimer, OnTimer, 0., 0.);
+        serviceTimer.data = this;
+        ev_prepare_init(&prepareWatcher, OnPrepare);
+        prepareWatcher.data = this;
+        ev_async_init(&threadWakeup, OnThreadWakeup);
+        threadWakeup.data = this;
+        ::memset(&compressionStats, 0, sizeof(CompressorStats));
     }
     
     ~Host()
     {
+        StopWatching();
+        // enet_host_destroy resets peers up to peerCount; bring back any
+        // slots setPeerLimit() hid.
+        host->peerCount = peerCount;
+        if (threadEvents != NULL)
+        {
+            QueueNode *node;
+            while ((node = threadEvents->Pop()) != NULL)
+            {
+                ServiceEvent *event = (ServiceEvent *) node;
+                if (event->packet != NULL)
+                    enet_packet_destroy(event->packet);
+                delete event;
+            }
+            delete threadEvents;
+        }
+        for (size_t i = 0; i < host->peerCount; i++)
+        {
+            Peer::Invalidate(&host->peers[i]);
+        }
+        if (!batchInfoObject.IsEmpty())
+        {
+            batchInfoObject.Dispose();
+        }
+        if (!statsObject.IsEmpty())
+        {
+            statsObject.Dispose();
+        }
+        for (RouteMap::iterator it = routes.begin(); it != routes.end(); ++it)
+        {
+            it->second.Dispose();
+        }
+        if (admission != NULL)
+        {
+            RemoveInterceptor(host, admission);
+            delete admission;
+        }
+        if (raw != NULL)
+        {
+            RemoveInterceptor(host, raw);
+            delete raw;
+        }
+        if (link != NULL)
+        {
+            RemoveInterceptor(host, link);
+            delete link;
+        }
+        StopCapture();
+        StopReplay();
+        if (scheduler != NULL)
+        {
+            schedulers.erase(host);
+            delete scheduler;
+        }
+        if (!rawHandler.IsEmpty())
+        {
+            rawHandler.Dispose();
+        }
+        if (!reusedEvent.IsEmpty())
+        {
+            reusedEvent.Dispose();
+        }
+        ClearHandlers();
+        if (!peerStatsObject.IsEmpty())
+        {
+            peerStatsObject.Dispose();
+            delete [] peerStatsData;
+        }
         enet_host_destroy(host);
         if (address != NULL)
         {
@@ -694,8 +1970,11 @@ public:
         s_ct->SetClassName(v8::String::NewSymbol("Host"));
         NODE_SET_PROTOTYPE_METHOD(s_ct, "connect", Connect);
         NODE_SET_PROTOTYPE_METHOD(s_ct, "broadcast", Broadcast);
+        NODE_SET_PROTOTYPE_METHOD(s_ct, "broadcastMany", BroadcastMany);
         NODE_SET_PROTOTYPE_METHOD(s_ct, "address", GetAddress);
         NODE_SET_PROTOTYPE_METHOD(s_ct, "peerCount", PeerCount);
+        NODE_SET_PROTOTYPE_METHOD(s_ct, "peerLimit", PeerLimit);
+        NODE_SET_PROTOTYPE_METHOD(s_ct, "setPeerLimit", SetPeerLimit);
         NODE_SET_PROTOTYPE_METHOD(s_ct, "channelLimit", ChannelLimit);
         NODE_SET_PROTOTYPE_METHOD(s_ct, "setChannelLimit", SetChannelLimit);
         NODE_SET_PROTOTYPE_METHOD(s_ct, "incomingBandwidth", IncomingBandwidth);
@@ -704,7 +1983,47 @@ public:
         NODE_SET_PROTOTYPE_METHOD(s_ct, "flush", Flush);
         NODE_SET_PROTOTYPE_METHOD(s_ct, "checkEvents", CheckEvents);
         NODE_SET_PROTOTYPE_METHOD(s_ct, "service", Service);
+        NODE_SET_PROTOTYPE_METHOD(s_ct, "serviceBatch", ServiceBatch);
+        NODE_SET_PROTOTYPE_METHOD(s_ct, "setHandlers", SetHandlers);
+        NODE_SET_PROTOTYPE_METHOD(s_ct, "dispatch", Dispatch);
+        NODE_SET_PROTOTYPE_METHOD(s_ct, "route", Route);
+        NODE_SET_PROTOTYPE_METHOD(s_ct, "setRouteHeader", SetRouteHeader);
+        NODE_SET_PROTOTYPE_METHOD(s_ct, "stats", Stats);
+        NODE_SET_PROTOTYPE_METHOD(s_ct, "peerStats", PeerStats);
+        NODE_SET_PROTOTYPE_METHOD(s_ct, "setCompression", SetCompression);
+        NODE_SET_PROTOTYPE_METHOD(s_ct, "compressionStats", GetCompressionStats);
+        NODE_SET_PROTOTYPE_METHOD(s_ct, "setChecksum", SetChecksum);
+        NODE_SET_PROTOTYPE_METHOD(s_ct, "setConnectRateLimit", SetConnectRateLimit);
+        NODE_SET_PROTOTYPE_METHOD(s_ct, "setConnectCookies", SetConnectCookies);
+        NODE_SET_PROTOTYPE_METHOD(s_ct, "allowConnections", AllowConnections);
+        NODE_SET_PROTOTYPE_METHOD(s_ct, "denyConnections", DenyConnections);
+        NODE_SET_PROTOTYPE_METHOD(s_ct, "clearConnectionRules", ClearConnectionRules);
+        NODE_SET_PROTOTYPE_METHOD(s_ct, "admissionStats", GetAdmissionStats);
+        NODE_SET_PROTOTYPE_METHOD(s_ct, "addRawFilter", AddRawFilter);
+        NODE_SET_PROTOTYPE_METHOD(s_ct, "clearRawFilters", ClearRawFilters);
+        NODE_SET_PROTOTYPE_METHOD(s_ct, "setRawHandler", SetRawHandler);
+        NODE_SET_PROTOTYPE_METHOD(s_ct, "sendRaw", SendRaw);
+        NODE_SET_PROTOTYPE_METHOD(s_ct, "rawStats", GetRawStats);
+        NODE_SET_PROTOTYPE_METHOD(s_ct, "simulateLink", SimulateLink);
+        NODE_SET_PROTOTYPE_METHOD(s_ct, "linkStats", GetLinkStats);
+        NODE_SET_PROTOTYPE_METHOD(s_ct, "startCapture", StartCapture);
+        NODE_SET_PROTOTYPE_METHOD(s_ct, "stopCapture", StopCapture);
+        NODE_SET_PROTOTYPE_METHOD(s_ct, "captureStats", GetCaptureStats);
+        NODE_SET_PROTOTYPE_METHOD(s_ct, "startReplay", StartReplay);
+        NODE_SET_PROTOTYPE_METHOD(s_ct, "stopReplay", StopReplay);
+        NODE_SET_PROTOTYPE_METHOD(s_ct, "replayStats", GetReplayStats);
+        NODE_SET_PROTOTYPE_METHOD(s_ct, "setScheduling", SetScheduling);
+        NODE_SET_PROTOTYPE_METHOD(s_ct, "schedulerStats", GetSchedulerStats);
+        MY_NODE_DEFINE_CONSTANT(s_ct, "STAT_TOTAL_SENT_DATA", kStatTotalSentData);
+        MY_NODE_DEFINE_CONSTANT(s_ct, "STAT_TOTAL_SENT_PACKETS", kStatTotalSentPackets);
+        MY_NODE_DEFINE_CONSTANT(s_ct, "STAT_TOTAL_RECEIVED_DATA", kStatTotalReceivedData);
+        MY_NODE_DEFINE_CONSTANT(s_ct, "STAT_TOTAL_RECEIVED_PACKETS", kStatTotalReceivedPackets);
+        MY_NODE_DEFINE_CONSTANT(s_ct, "STAT_CONNECTED_PEERS", kStatConnectedPeers);
+        MY_NODE_DEFINE_CONSTANT(s_ct, "STAT_PEER_COUNT", kStatPeerCount);
+        MY_NODE_DEFINE_CONSTANT(s_ct, "STAT_COUNT", kStatCount);
         NODE_SET_PROTOTYPE_METHOD(s_ct, "fd", FD);
+        NODE_SET_PROTOTYPE_METHOD(s_ct, "startWatcher", StartWatcher);
+        NODE_SET_PROTOTYPE_METHOD(s_ct, "stopWatcher", StopWatcher);
         target->Set(v8::String::NewSymbol("Host"), s_ct->GetFunction());
     }
     
@@ -736,6 +2055,44 @@ public:
         }
     }
     
+    struct ConnectCall
+    {
+        ENetAddress address;
+        size_t channelCount;
+        enet_uint32 data;
+        ENetPeer *peer;
+        enet_uint32 connectID;
+        ServiceThread *thread;
+    };
+    
+    static void ConnectOnThread(ENetHost *host, void *arg)
+    {
+        ConnectCall *call = (ConnectCall *) arg;
+        call->peer = enet_host_connect(host, &call->address, call->channelCount, call->data);
+        if (call->peer != NULL)
+        {
+            call->connectID = call->peer->connectID;
+            call->thread->Connecting(call->peer);
+        }
+    }
+    
+    // Posts a host-wide command to the service thread.
+    bool PostCommand(ServiceCommand::Type type, enet_uint8 channel, enet_uint32 data,
+        enet_uint32 data2, ENetPacket *packet)
+    {
+        ServiceCommand command;
+        ::memset(&command, 0, sizeof(ServiceCommand));
+        command.type = type;
+        command.channelID = channel;
+        command.data = data;
+        command.data2 = data2;
+        command.packet = packet;
+        if (!thread->Post(command))
+            return false;
+        thread->Wake();
+        return true;
+    }
+    
     static v8::Handle<v8::Value> Connect(const v8::Arguments& args)
     {
         v8::HandleScope scope;
@@ -751,8 +2108,21 @@ public:
                 return v8::ThrowException(v8::Exception::Error(v8::String::New("invalid data argument")));
             data = args[2]->Uint32Value();
         }
-        ENetPeer *ep = enet_host_connect(host->host,
-            (const ENetAddress *) &(address->address), channelCount, data);
+        ENetPeer *ep;
+        if (host->thread != NULL)
+        {
+            ConnectCall call = { address->address, channelCount, data, NULL, 0, host->thread };
+            if (!host->thread->Call(ConnectOnThread, &call))
+                return ThrowQueueFull();
+            if (call.peer == NULL)
+                return v8::Null();
+            return scope.Close(Peer::WrapPeer(call.peer, call.connectID, address->address));
+        }
+        else
+        {
+            ep = enet_host_connect(host->host,
+                (const ENetAddress *) &(address->address), channelCount, data);
+        }
         if (ep == NULL)
             return v8::Null();
         return scope.Close(Peer::WrapPeer(ep));
@@ -764,7 +2134,68 @@ public:
         Host *host = node::ObjectWrap::Unwrap<Host>(args.This());
         enet_uint8 channelID = args[0]->Int32Value();
         Packet *packet = node::ObjectWrap::Unwrap<Packet>(args[1]->ToObject());
-        enet_host_broadcast(host->host, channelID, packet->packet);
+        if (packet->packet == NULL)
+            return Packet::ThrowSent();
+        if (host->thread != NULL)
+        {
+            ENetPacket *p = packet->Detach();
+            if (p == NULL)
+                return v8::ThrowException(v8::Exception::Error(v8::String::New("could not allocate packet")));
+            CaptureSend(host->host, NULL, channelID, p);
+            if (!host->PostCommand(ServiceCommand::BROADCAST, channelID, 0, 0, p))
+            {
+                packet->Reattach(p);
+                return ThrowQueueFull();
+            }
+            return v8::Undefined();
+        }
+        // The Packet's own reference keeps enet_host_broadcast from
+        // destroying it when there is nobody to send to.
+        CaptureSend(host->host, NULL, channelID, packet->packet);
+        QueueBroadcast(host->host, channelID, packet->packet);
+        return v8::Undefined();
+    }
+    
+    // broadcastMany(channel, buffers[, flags[, flush]]) or
+    // broadcastMany(channel, buffer, offsets[, flags[, flush]]) -- the
+    // broadcast counterpart of Peer.sendMany().
+    static v8::Handle<v8::Value> BroadcastMany(const v8::Arguments& args)
+    {
+        v8::HandleScope scope;
+        Host *host = node::ObjectWrap::Unwrap<Host>(args.This());
+        std::vector<ENetBuffer> messages;
+        int next = -1;
+        if (args.Length() > 1 && args[0]->IsInt32())
+            next = CollectMessages(args, 1, messages);
+        if (next < 0)
+        {
+            return v8::ThrowException(v8::Exception::Error(v8::String::New("broadcastMany requires a channel number and an array of buffers, or a buffer and an array of offsets")));
+        }
+        enet_uint8 channelID = (enet_uint8) args[0]->Int32Value();
+        enet_uint32 flags = 0;
+        if (args.Length() > next)
+            flags = args[next]->Uint32Value() & ~ENET_PACKET_FLAG_NO_ALLOCATE;
+        bool flush = args.Length() > next + 1 && args[next + 1]->BooleanValue();
+        for (size_t i = 0; i < messages.size(); i++)
+        {
+            ENetPacket *packet = Packet::CreatePacket(messages[i].data, messages[i].dataLength, flags);
+            if (packet == NULL)
+                return v8::ThrowException(v8::Exception::Error(v8::String::New("could not allocate packet")));
+            CaptureSend(host->host, NULL, channelID, packet);
+            if (host->thread == NULL)
+            {
+                QueueBroadcast(host->host, channelID, packet);
+            }
+            else if (!host->PostCommand(ServiceCommand::BROADCAST, channelID, 0, 0, packet))
+            {
+                enet_packet_destroy(packet);
+                return ThrowQueueFull();
+            }
+        }
+        if (flush && host->thread != NULL)
+            host->PostCommand(ServiceCommand::FLUSH, 0, 0, 0, NULL);
+        else if (flush)
+            enet_host_flush(host->host);
         return v8::Undefined();
     }
     
@@ -782,6 +2213,63 @@ public:
         Host *host = node::ObjectWrap::Unwrap<Host>(args.This());
         return scope.Close(v8::Int32::New(host->peerCount));
     }
+    
+    static v8::Handle<v8::Value> PeerLimit(const v8::Arguments& args)
+    {
+        v8::HandleScope scope;
+        Host *host = node::ObjectWrap::Unwrap<Host>(args.This());
+        return scope.Close(v8::Int32::New(host->host->peerCount));
+    }
+    
+    struct PeerLimitCall
+    {
+        size_t limit;
+        size_t capacity;
+    };
+    
+    // enet only looks at peers[0 .. peerCount) when accepting connections
+    // and servicing, so lowering peerCount within what was allocated
+    // shrinks the table it walks. It can't go below a slot still in use.
+    static void SetPeerLimitOnThread(ENetHost *host, void *arg)
+    {
+        PeerLimitCall *call = (PeerLimitCall *) arg;
+        size_t inUse = host->peerCount;
+        if (call->limit < inUse)
+        {
+            while (inUse > 0 && host->peers[inUse - 1].state == ENET_PEER_STATE_DISCONNECTED)
+                inUse--;
+        }
+        size_t limit = call->limit < 1 ? 1 : call->limit;
+        if (limit > call->capacity)
+            limit = call->capacity;
+        if (limit < inUse)
+            limit = inUse;
+        host->peerCount = limit;
+        call->limit = limit;
+    }
+    
+    // setPeerLimit(n) -- how many of the peerCount slots the host created
+    // with are in use: new connections only get slots below the limit, and
+    // servicing skips the rest. Returns the limit actually set, which
+    // stays above any connected slot and at most peerCount.
+    static v8::Handle<v8::Value> SetPeerLimit(const v8::Arguments& args)
+    {
+        v8::HandleScope scope;
+        Host *host = node::ObjectWrap::Unwrap<Host>(args.This());
+        if (args.Length() < 1 || !args[0]->IsNumber())
+            return v8::ThrowException(v8::Exception::Error(v8::String::New("setPeerLimit requires a number of peers")));
+        PeerLimitCall call = { args[0]->Uint32Value(), host->peerCount };
+        if (host->thread != NULL)
+        {
+            if (!host->thread->Call(SetPeerLimitOnThread, &call))
+                return ThrowQueueFull();
+        }
+        else
+        {
+            SetPeerLimitOnThread(host->host, &call);
+        }
+        return scope.Close(v8::Int32::New(call.limit));
+    }
 
     static v8::Handle<v8::Value> ChannelLimit(const v8::Arguments& args)
     {
@@ -795,7 +2283,15 @@ public:
         v8::HandleScope scope;
         Host *host = node::ObjectWrap::Unwrap<Host>(args.This());
         size_t newLimit = args[0]->Int32Value();
-        enet_host_channel_limit(host->host, newLimit);
+        if (host->thread != NULL)
+        {
+            if (!host->PostCommand(ServiceCommand::CHANNEL_LIMIT, 0, newLimit, 0, NULL))
+                return ThrowQueueFull();
+        }
+        else
+        {
+            enet_host_channel_limit(host->host, newLimit);
+        }
         host->channelLimit = newLimit;
         return v8::Undefined();
     }
@@ -820,7 +2316,15 @@ public:
         Host *host = node::ObjectWrap::Unwrap<Host>(args.This());
         enet_uint32 inbw = args[0]->Uint32Value();
         enet_uint32 outbw = args[1]->Uint32Value();
-        enet_host_bandwidth_limit(host->host, inbw, outbw);
+        if (host->thread != NULL)
+        {
+            if (!host->PostCommand(ServiceCommand::BANDWIDTH_LIMIT, 0, inbw, outbw, NULL))
+                return ThrowQueueFull();
+        }
+        else
+        {
+            enet_host_bandwidth_limit(host->host, inbw, outbw);
+        }
         host->incomingBandwidth = inbw;
         host->outgoingBandwidth = outbw;
         return v8::Undefined();
@@ -830,41 +2334,1246 @@ public:
     {
         v8::HandleScope scope;
         Host *host = node::ObjectWrap::Unwrap<Host>(args.This());
-        enet_host_flush(host->host);
+        if (host->thread != NULL)
+            host->PostCommand(ServiceCommand::FLUSH, 0, 0, 0, NULL);
+        else
+            enet_host_flush(host->host);
         return v8::Undefined();
     }
     
-    static v8::Handle<v8::Value> CheckEvents(const v8::Arguments& args)
+    // Called on the service thread, which must never wait for JS: it may
+    // be blocked in thread->Call(), and acknowledgements and retransmits
+    // can't stall behind a slow loop. So the queue has no bound.
+    void Deliver(ServiceEvent *event)
     {
-        v8::HandleScope scope;
-        Host *host = node::ObjectWrap::Unwrap<Host>(args.This());
-        ENetEvent event;
-        int ret = enet_host_check_events(host->host, &event);
-        if (ret < 0)
-            return v8::ThrowException(v8::String::New("error checking events"));
-        if (ret < 1)
-            return v8::Null();
-        v8::Handle<v8::Value> result = Event::WrapEvent(event);
-        return scope.Close(result);
+        threadEvents->Push(event);
     }
     
-    static v8::Handle<v8::Value> Service(const v8::Arguments& args)
+    // Also called by the raw channel, which may run on this thread when
+    // the host isn't threaded; there is nothing to wake then.
+    void Flush()
     {
-        v8::HandleScope scope;
-        Host *host = node::ObjectWrap::Unwrap<Host>(args.This());
-        enet_uint32 timeout = 0;
+        if (thread != NULL)
+            ev_async_send(&threadWakeup);
+    }
+    
+    // Fetches the next event: from the service thread's queue (including any
+    // left over after the thread stopped), or else from ENet directly.
+    int NextEvent(ENetEvent *event, enet_uint32 timeout, bool checkOnly)
+    {
+        QueueNode *node;
+        while (threadEvents != NULL && (node = threadEvents->Pop()) != NULL)
+        {
+            ServiceEvent *e = (ServiceEvent *) node;
+            if (!Peer::Claim(&host->peers[e->peerID], e->type, e->connectID, e->address))
+            {
+                if (e->packet != NULL)
+                    enet_packet_destroy(e->packet);
+                delete e;
+                continue;
+            }
+            event->type = e->type;
+            event->peer = &host->peers[e->peerID];
+            event->channelID = e->channelID;
+            event->data = e->data;
+            event->packet = e->packet;
+            delete e;
+            return 1;
+        }
+        if (thread != NULL)
+            return 0;
+        if (checkOnly)
+            return enet_host_check_events(host, event);
+        if (scheduler != NULL)
+        {
+            enet_uint32 backlogDelay;
+            scheduler->Drain(host, enet_time_get(), &backlogDelay);
+        }
+        return enet_host_service(host, event, timeout);
+    }
+    
+    static v8::Handle<v8::Value> CheckEvents(const v8::Arguments& args)
+    {
+        v8::HandleScope scope;
+        Host *host = node::ObjectWrap::Unwrap<Host>(args.This());
+        ENetEvent event;
+        int ret = host->NextEvent(&event, 0, true);
+        if (ret < 0)
+            return v8::ThrowException(v8::String::New("error checking events"));
+        if (ret < 1)
+            return v8::Null();
+        if (args.Length() > 0 && args[0]->BooleanValue())
+            return scope.Close(host->ReuseEvent(event));
+        v8::Handle<v8::Value> result = Event::WrapEvent(event);
+        return scope.Close(result);
+    }
+    
+    v8::Handle<v8::Object> ReuseEvent(ENetEvent event)
+    {
+        if (reusedEvent.IsEmpty())
+        {
+            ENetEvent none;
+            ::memset(&none, 0, sizeof(ENetEvent));
+            reusedEvent = v8::Persistent<v8::Object>::New(Event::WrapEvent(none)->ToObject());
+        }
+        Event::ReuseEvent(reusedEvent, event);
+        return reusedEvent;
+    }
+    
+    static v8::Handle<v8::Value> Service(const v8::Arguments& args)
+    {
+        v8::HandleScope scope;
+        Host *host = node::ObjectWrap::Unwrap<Host>(args.This());
+        enet_uint32 timeout = 0;
         if (args.Length() > 0)
             timeout = args[0]->Uint32Value();
         ENetEvent event;
-        int ret = enet_host_service(host->host, &event, timeout);
+        int ret = host->NextEvent(&event, timeout, false);
         if (ret < 0)
             return v8::ThrowException(v8::String::New("error servicing host"));
         if (ret < 1)
             return v8::Null();
+        // service(timeout, true) returns the same Event object every time,
+        // valid until the next such call.
+        if (args.Length() > 1 && args[1]->BooleanValue())
+            return scope.Close(host->ReuseEvent(event));
         v8::Handle<v8::Value> result = Event::WrapEvent(event);
         return scope.Close(result);        
     }
     
+    // Drains up to maxEvents events in one call. Returns an object with
+    // `count', `info' (type, channelID, data for each event, in that order),
+    // and `peers' and `packets' arrays indexed by event. `more' is true if
+    // events may be left: the batch filled up, or it ended early at a
+    // connect or disconnect so that route handlers, which run during this
+    // call, never get ahead of it.
+    static v8::Handle<v8::Value> ServiceBatch(const v8::Arguments& args)
+    {
+        v8::HandleScope scope;
+        Host *host = node::ObjectWrap::Unwrap<Host>(args.This());
+        size_t maxEvents = kMaxBatch;
+        enet_uint32 timeout = 0;
+        if (args.Length() > 0 && args[0]->Uint32Value() > 0 && args[0]->Uint32Value() < kMaxBatch)
+            maxEvents = args[0]->Uint32Value();
+        if (args.Length() > 1)
+            timeout = args[1]->Uint32Value();
+        if (host->batchInfoObject.IsEmpty())
+        {
+            host->batchInfoObject = NewExternalArray(host->batchInfo, kMaxBatch * kBatchStride);
+        }
+        v8::Local<v8::Array> peers = v8::Array::New();
+        v8::Local<v8::Array> packets = v8::Array::New();
+        std::vector<RouteBatch> routed;
+        size_t count = 0;
+        size_t processed = 0;
+        bool more = false;
+        ENetEvent event;
+        while (processed < maxEvents)
+        {
+            int ret = host->NextEvent(&event, processed == 0 ? timeout : 0, false);
+            if (ret < 0 && processed == 0)
+                return v8::ThrowException(v8::String::New("error servicing host"));
+            if (ret < 1)
+                break;
+            processed++;
+            if (event.type == ENET_EVENT_TYPE_RECEIVE && host->RouteMessage(&event, routed))
+                continue;
+            // Messages routed so far came before this event; JS only hears
+            // of it after we return, so it ends the batch.
+            bool boundary = event.type != ENET_EVENT_TYPE_RECEIVE && !host->routes.empty();
+            if (boundary)
+                host->DeliverRouted(routed);
+            enet_uint32 *info = &host->batchInfo[count * kBatchStride];
+            info[0] = event.type;
+            info[1] = event.channelID;
+            info[2] = event.data;
+            if (event.peer != NULL)
+            {
+                peers->Set(count, Peer::WrapPeer(event.peer));
+                if (event.type == ENET_EVENT_TYPE_DISCONNECT)
+                    Peer::Invalidate(event.peer);
+            }
+            else
+                peers->Set(count, v8::Null());
+            if (event.packet != NULL)
+                packets->Set(count, Packet::WrapPacket(event.packet));
+            else
+                packets->Set(count, v8::Null());
+            count++;
+            if (boundary)
+            {
+                more = true;
+                break;
+            }
+        }
+        host->DeliverRouted(routed);
+        host->DeliverRaw();
+        v8::Local<v8::Object> result = v8::Object::New();
+        result->Set(v8::String::NewSymbol("count"), v8::Integer::New(count));
+        result->Set(v8::String::NewSymbol("processed"), v8::Integer::New(processed));
+        result->Set(v8::String::NewSymbol("more"), v8::Boolean::New(more || processed == maxEvents));
+        result->Set(v8::String::NewSymbol("info"), host->batchInfoObject);
+        result->Set(v8::String::NewSymbol("peers"), peers);
+        result->Set(v8::String::NewSymbol("packets"), packets);
+        return scope.Close(result);
+    }
+    
+    void DeliverRouted(std::vector<RouteBatch>& routed)
+    {
+        for (size_t i = 0; i < routed.size(); i++)
+        {
+            v8::Handle<v8::Value> argv[2] = { routed[i].peers, routed[i].payloads };
+            v8::TryCatch try_catch;
+            routed[i].handler->Call(handle_, 2, argv);
+            if (try_catch.HasCaught())
+                node::FatalException(try_catch);
+        }
+        routed.clear();
+    }
+    
+    void ClearHandlers()
+    {
+        if (!onConnect.IsEmpty())
+            onConnect.Dispose();
+        if (!onDisconnect.IsEmpty())
+            onDisconnect.Dispose();
+        if (!onMessage.IsEmpty())
+            onMessage.Dispose();
+        onConnect.Clear();
+        onDisconnect.Clear();
+        onMessage.Clear();
+    }
+    
+    static v8::Persistent<v8::Function> HandlerArgument(v8::Local<v8::Value> value)
+    {
+        if (!value->IsFunction())
+            return v8::Persistent<v8::Function>();
+        return v8::Persistent<v8::Function>::New(v8::Local<v8::Function>::Cast(value));
+    }
+    
+    // setHandlers(onConnect, onDisconnect, onMessage) -- the functions
+    // dispatch() calls; any may be null to ignore that kind of event.
+    static v8::Handle<v8::Value> SetHandlers(const v8::Arguments& args)
+    {
+        v8::HandleScope scope;
+        Host *host = node::ObjectWrap::Unwrap<Host>(args.This());
+        host->ClearHandlers();
+        host->onConnect = HandlerArgument(args[0]);
+        host->onDisconnect = HandlerArgument(args[1]);
+        host->onMessage = HandlerArgument(args[2]);
+        return v8::Undefined();
+    }
+    
+    // dispatch([maxEvents[, timeout]]) -- like serviceBatch, but delivers
+    // each event straight to the setHandlers() functions as
+    // onConnect(peer, data), onDisconnect(peer, data) and
+    // onMessage(peer, buffer, channel), where buffer is the received
+    // payload, uncopied. No Event, Packet or batch objects are made.
+    // Routes still apply. Returns the number of events processed; if a
+    // handler throws, dispatch stops there and rethrows.
+    static v8::Handle<v8::Value> Dispatch(const v8::Arguments& args)
+    {
+        v8::HandleScope scope;
+        Host *host = node::ObjectWrap::Unwrap<Host>(args.This());
+        size_t maxEvents = kMaxBatch;
+        enet_uint32 timeout = 0;
+        if (args.Length() > 0 && args[0]->Uint32Value() > 0)
+            maxEvents = args[0]->Uint32Value();
+        if (args.Length() > 1)
+            timeout = args[1]->Uint32Value();
+        std::vector<RouteBatch> routed;
+        size_t processed = 0;
+        ENetEvent event;
+        v8::TryCatch try_catch;
+        while (processed < maxEvents)
+        {
+            int ret = host->NextEvent(&event, processed == 0 ? timeout : 0, false);
+            if (ret < 0 && processed == 0)
+                return v8::ThrowException(v8::String::New("error servicing host"));
+            if (ret < 1)
+                break;
+            processed++;
+            if (event.type == ENET_EVENT_TYPE_RECEIVE)
+            {
+                if (host->RouteMessage(&event, routed))
+                    continue;
+                if (host->onMessage.IsEmpty())
+                {
+                    enet_packet_destroy(event.packet);
+                    continue;
+                }
+                v8::HandleScope eventScope;
+                v8::Handle<v8::Value> argv[3] = {
+                    Peer::WrapPeer(event.peer),
+                    Packet::SliceReceived(event.packet, 0),
+                    v8::Integer::New(event.channelID)
+                };
+                host->onMessage->Call(host->handle_, 3, argv);
+            }
+            else if (event.type == ENET_EVENT_TYPE_CONNECT || event.type == ENET_EVENT_TYPE_DISCONNECT)
+            {
+                // Messages routed so far came first, and still have their
+                // peer attached.
+                host->DeliverRouted(routed);
+                v8::HandleScope eventScope;
+                v8::Handle<v8::Value> peer = Peer::WrapPeer(event.peer);
+                if (event.type == ENET_EVENT_TYPE_DISCONNECT)
+                    Peer::Invalidate(event.peer);
+                v8::Persistent<v8::Function>& handler =
+                    event.type == ENET_EVENT_TYPE_CONNECT ? host->onConnect : host->onDisconnect;
+                if (handler.IsEmpty())
+                    continue;
+                v8::Handle<v8::Value> argv[2] = { peer, v8::Uint32::New(event.data) };
+                handler->Call(host->handle_, 2, argv);
+            }
+            if (try_catch.HasCaught())
+                break;
+        }
+        host->DeliverRouted(routed);
+        host->DeliverRaw();
+        if (try_catch.HasCaught())
+            return try_catch.ReThrow();
+        return scope.Close(v8::Integer::New(processed));
+    }
+    
+    // Adds a received message to its route's batch, if it has one. Takes
+    // over the event's packet in that case.
+    bool RouteMessage(ENetEvent *event, std::vector<RouteBatch>& routed)
+    {
+        if (routes.empty())
+            return false;
+        enet_uint32 type;
+        size_t headerLength;
+        if (!ParseRouteType(event->packet, &type, &headerLength))
+            return false;
+        RouteMap::iterator it = routes.find(std::make_pair(event->channelID, type));
+        if (it == routes.end())
+            return false;
+        RouteBatch *batch = NULL;
+        for (size_t i = 0; i < routed.size(); i++)
+        {
+            if (routed[i].handler == it->second)
+            {
+                batch = &routed[i];
+                break;
+            }
+        }
+        if (batch == NULL)
+        {
+            RouteBatch b;
+            b.handler = v8::Local<v8::Function>::New(it->second);
+            b.peers = v8::Array::New();
+            b.payloads = v8::Array::New();
+            b.count = 0;
+            routed.push_back(b);
+            batch = &routed.back();
+        }
+        batch->peers->Set(batch->count, Peer::WrapPeer(event->peer));
+        batch->payloads->Set(batch->count, Packet::SliceReceived(event->packet, headerLength));
+        batch->count++;
+        return true;
+    }
+    
+    // route(channel, type, handler) -- sends messages on `channel' whose
+    // payload starts with `type' (see setRouteHeader) straight to
+    // handler(peers, payloads), once per serviceBatch call with all of that
+    // route's messages, in order; a connect or disconnect among them
+    // delivers those before it first. Payloads are Buffers over the received
+    // data with the type removed. Routed messages don't appear in
+    // serviceBatch's result. A null handler removes the route.
+    static v8::Handle<v8::Value> Route(const v8::Arguments& args)
+    {
+        v8::HandleScope scope;
+        Host *host = node::ObjectWrap::Unwrap<Host>(args.This());
+        if (args.Length() < 3 || !args[0]->IsNumber() || !args[1]->IsNumber())
+            return v8::ThrowException(v8::Exception::Error(v8::String::New("route requires a channel, a type and a handler")));
+        std::pair<enet_uint8, enet_uint32> key((enet_uint8) args[0]->Uint32Value(), args[1]->Uint32Value());
+        RouteMap::iterator it = host->routes.find(key);
+        if (it != host->routes.end())
+        {
+            it->second.Dispose();
+            host->routes.erase(it);
+        }
+        if (args[2]->IsFunction())
+        {
+            host->routes[key] = v8::Persistent<v8::Function>::New(v8::Local<v8::Function>::Cast(args[2]));
+        }
+        else if (!args[2]->IsNull() && !args[2]->IsUndefined())
+        {
+            return v8::ThrowException(v8::Exception::Error(v8::String::New("route handler must be a function or null")));
+        }
+        return v8::Undefined();
+    }
+    
+    // setRouteHeader('byte' | 'varint') -- how route() reads the type at the
+    // front of a message: a single byte (the default) or a LEB128 varint.
+    static v8::Handle<v8::Value> SetRouteHeader(const v8::Arguments& args)
+    {
+        v8::HandleScope scope;
+        Host *host = node::ObjectWrap::Unwrap<Host>(args.This());
+        if (args.Length() < 1 || !args[0]->IsString())
+            return v8::ThrowException(v8::Exception::Error(v8::String::New("setRouteHeader requires 'byte' or 'varint'")));
+        v8::String::AsciiValue name(args[0]->ToString());
+        if (strcmp(*name, "byte") == 0)
+            host->routeHeader = kRouteHeaderByte;
+        else if (strcmp(*name, "varint") == 0)
+            host->routeHeader = kRouteHeaderVarint;
+        else
+            return v8::ThrowException(v8::Exception::Error(v8::String::New("unknown route header; expected 'byte' or 'varint'")));
+        return v8::Undefined();
+    }
+    
+    void Reschedule()
+    {
+        enet_uint32 now = enet_time_get();
+        enet_uint32 delay, backlogDelay;
+        bool backlog = scheduler != NULL && scheduler->Drain(host, now, &backlogDelay);
+        ev_timer_stop(&serviceTimer);
+        bool due = HostDeadline(host, now, &delay);
+        // Come back when the scheduler has budget for what it held back.
+        if (backlog && (!due || backlogDelay < delay))
+        {
+            delay = backlogDelay;
+            due = true;
+        }
+        if (due)
+        {
+            ev_timer_set(&serviceTimer, delay / 1000., 0.);
+            ev_timer_start(&serviceTimer);
+        }
+    }
+    
+    void RunServiceCallback()
+    {
+        v8::HandleScope scope;
+        v8::TryCatch try_catch;
+        serviceCallback->Call(handle_, 0, NULL);
+        if (try_catch.HasCaught())
+            node::FatalException(try_catch);
+    }
+    
+    static void OnReadable(ev_io *w, int revents)
+    {
+        ((Host *) w->data)->RunServiceCallback();
+    }
+    
+    static void OnTimer(ev_timer *w, int revents)
+    {
+        ((Host *) w->data)->RunServiceCallback();
+    }
+    
+    static void OnPrepare(ev_prepare *w, int revents)
+    {
+        ((Host *) w->data)->Reschedule();
+    }
+    
+    static void OnThreadWakeup(ev_async *w, int revents)
+    {
+        ((Host *) w->data)->RunServiceCallback();
+    }
+    
+    void StopWatching()
+    {
+        if (!watching)
+            return;
+        if (thread != NULL)
+        {
+            thread->Stop();
+            serviceThreads.erase(host);
+            delete thread;
+            thread = NULL;
+            ev_async_stop(&threadWakeup);
+        }
+        else
+        {
+            ev_io_stop(&ioWatcher);
+            ev_timer_stop(&serviceTimer);
+            ev_ref(EV_DEFAULT_UC);
+            ev_prepare_stop(&prepareWatcher);
+        }
+        serviceCallback.Dispose();
+        serviceCallback.Clear();
+        watching = false;
+    }
+    
+    // startWatcher(callback[, threaded]) -- calls callback whenever the host
+    // should be serviced, until stopWatcher() is called. If threaded is true,
+    // ENet runs on its own thread from then on: sends, connects and the rest
+    // are passed to it through a command queue, and callback runs when it has
+    // events to hand over.
+    static v8::Handle<v8::Value> StartWatcher(const v8::Arguments& args)
+    {
+        v8::HandleScope scope;
+        Host *host = node::ObjectWrap::Unwrap<Host>(args.This());
+        if (args.Length() < 1 || !args[0]->IsFunction())
+            return v8::ThrowException(v8::Exception::Error(v8::String::New("startWatcher requires a callback")));
+        if (host->watching)
+            return v8::Undefined();
+        host->serviceCallback = v8::Persistent<v8::Function>::New(v8::Local<v8::Function>::Cast(args[0]));
+        if (args.Length() > 1 && args[1]->BooleanValue())
+        {
+            if (host->threadEvents == NULL)
+                host->threadEvents = new MpscQueue;
+            host->thread = new ServiceThread(host->host, 0, host);
+            host->thread->SetScheduler(host->scheduler);
+            ev_async_start(&host->threadWakeup);
+            if (!host->thread->Start())
+            {
+                ev_async_stop(&host->threadWakeup);
+                delete host->thread;
+                host->thread = NULL;
+                host->serviceCallback.Dispose();
+                host->serviceCallback.Clear();
+                return v8::ThrowException(v8::Exception::Error(v8::String::New("could not start service thread")));
+            }
+            serviceThreads[host->host] = host->thread;
+        }
+        else
+        {
+            ev_io_start(&host->ioWatcher);
+            // The prepare watcher alone shouldn't keep the process running.
+            ev_prepare_start(&host->prepareWatcher);
+            ev_unref(EV_DEFAULT_UC);
+        }
+        host->watching = true;
+        host->Ref();
+        return v8::Undefined();
+    }
+    
+    static v8::Handle<v8::Value> StopWatcher(const v8::Arguments& args)
+    {
+        v8::HandleScope scope;
+        Host *host = node::ObjectWrap::Unwrap<Host>(args.This());
+        if (host->watching)
+        {
+            host->StopWatching();
+            host->Unref();
+        }
+        return v8::Undefined();
+    }
+    
+    // Takes host's counters into out, indexed by kStat*. Reads the peer
+    // table, so on a threaded host it runs on the service thread.
+    static void StatsOnThread(ENetHost *h, void *arg)
+    {
+        enet_uint32 *out = (enet_uint32 *) arg;
+        enet_uint32 connected = 0;
+        for (ENetPeer *p = h->peers; p < &h->peers[h->peerCount]; ++p)
+        {
+            if (p->state == ENET_PEER_STATE_CONNECTED || p->state == ENET_PEER_STATE_DISCONNECT_LATER)
+                connected++;
+        }
+        out[kStatTotalSentData] = h->totalSentData;
+        out[kStatTotalSentPackets] = h->totalSentPackets;
+        out[kStatTotalReceivedData] = h->totalReceivedData;
+        out[kStatTotalReceivedPackets] = h->totalReceivedPackets;
+        out[kStatConnectedPeers] = connected;
+        out[kStatPeerCount] = h->peerCount;
+    }
+    
+    // stats() -- returns the host's counters, indexed by the Host.STAT_*
+    // constants. The same array is reused by every call on this host.
+    static v8::Handle<v8::Value> Stats(const v8::Arguments& args)
+    {
+        v8::HandleScope scope;
+        Host *host = node::ObjectWrap::Unwrap<Host>(args.This());
+        if (host->statsObject.IsEmpty())
+            host->statsObject = NewExternalArray(host->statsData, kStatCount);
+        if (host->thread != NULL)
+        {
+            if (!host->thread->Call(StatsOnThread, host->statsData))
+                return ThrowQueueFull();
+        }
+        else
+        {
+            StatsOnThread(host->host, host->statsData);
+        }
+        return scope.Close(host->statsObject);
+    }
+    
+    struct PeerStatsCall
+    {
+        enet_uint32 *out;
+        size_t count;
+    };
+    
+    static void PeerStatsOnThread(ENetHost *h, void *arg)
+    {
+        PeerStatsCall *call = (PeerStatsCall *) arg;
+        call->count = h->peerCount;
+        for (size_t i = 0; i < call->count; i++)
+        {
+            Peer::FillStats(&h->peers[i], &call->out[i], call->count);
+        }
+    }
+    
+    // peerStats() -- every peer slot's counters in one call, as
+    // {count, data}: data[stat * count + slot] holds counter `stat' (a
+    // Peer.STAT_* constant) for peer slot `slot'. Reused between calls.
+    static v8::Handle<v8::Value> PeerStats(const v8::Arguments& args)
+    {
+        v8::HandleScope scope;
+        Host *host = node::ObjectWrap::Unwrap<Host>(args.This());
+        if (host->peerStatsObject.IsEmpty())
+        {
+            host->peerStatsData = new enet_uint32[Peer::kStatCount * host->peerCount];
+            host->peerStatsObject = NewExternalArray(host->peerStatsData, Peer::kStatCount * host->peerCount);
+        }
+        PeerStatsCall call = { host->peerStatsData, 0 };
+        if (host->thread != NULL)
+        {
+            if (!host->thread->Call(PeerStatsOnThread, &call))
+                return ThrowQueueFull();
+        }
+        else
+        {
+            PeerStatsOnThread(host->host, &call);
+        }
+        size_t count = call.count;
+        v8::Local<v8::Object> result = v8::Object::New();
+        result->Set(v8::String::NewSymbol("count"), v8::Integer::New(count));
+        result->Set(v8::String::NewSymbol("data"), host->peerStatsObject);
+        return scope.Close(result);
+    }
+    
+    struct CompressionCall
+    {
+        CompressionKind kind;
+        CompressorStats *stats;
+        bool ok;
+    };
+    
+    static void SetCompressionOnThread(ENetHost *host, void *arg)
+    {
+        CompressionCall *call = (CompressionCall *) arg;
+        call->ok = SetCompressor(host, call->kind, call->stats);
+    }
+    
+    // setCompression('range' | 'lz4' | 'none') -- compresses outgoing
+    // datagrams. The other end must use the same setting.
+    static v8::Handle<v8::Value> SetCompression(const v8::Arguments& args)
+    {
+        v8::HandleScope scope;
+        Host *host = node::ObjectWrap::Unwrap<Host>(args.This());
+        if (args.Length() < 1 || !args[0]->IsString())
+            return v8::ThrowException(v8::Exception::Error(v8::String::New("setCompression requires 'range', 'lz4' or 'none'")));
+        v8::String::AsciiValue name(args[0]->ToString());
+        CompressionCall call = { COMPRESSION_NONE, &host->compressionStats, false };
+        if (strcmp(*name, "range") == 0)
+            call.kind = COMPRESSION_RANGE;
+        else if (strcmp(*name, "lz4") == 0)
+            call.kind = COMPRESSION_LZ4;
+        else if (strcmp(*name, "none") != 0)
+            return v8::ThrowException(v8::Exception::Error(v8::String::New("unknown compression; expected 'range', 'lz4' or 'none'")));
+        if (host->thread != NULL)
+        {
+            if (!host->thread->Call(SetCompressionOnThread, &call))
+                return ThrowQueueFull();
+        }
+        else
+        {
+            SetCompressionOnThread(host->host, &call);
+        }
+        if (!call.ok)
+            return v8::ThrowException(v8::Exception::Error(v8::String::New("could not create compressor")));
+        return v8::Undefined();
+    }
+    
+    // compressionStats() -- bytes before and after compression, both ways,
+    // since the host was created.
+    static v8::Handle<v8::Value> GetCompressionStats(const v8::Arguments& args)
+    {
+        v8::HandleScope scope;
+        Host *host = node::ObjectWrap::Unwrap<Host>(args.This());
+        CompressorStats *stats = &host->compressionStats;
+        v8::Local<v8::Object> result = v8::Object::New();
+        result->Set(v8::String::NewSymbol("outgoingRaw"), v8::Number::New(stats->outgoingRaw));
+        result->Set(v8::String::NewSymbol("outgoingCompressed"), v8::Number::New(stats->outgoingCompressed));
+        result->Set(v8::String::NewSymbol("incomingCompressed"), v8::Number::New(stats->incomingCompressed));
+        result->Set(v8::String::NewSymbol("incomingRaw"), v8::Number::New(stats->incomingRaw));
+        return scope.Close(result);
+    }
+    
+    static void SetChecksumOnThread(ENetHost *host, void *arg)
+    {
+        host->checksum = (ENetChecksumCallback) arg;
+    }
+    
+    // setChecksum('crc32c' | 'crc32' | 'none') -- checksums every datagram,
+    // dropping any that arrive corrupted. 'crc32c' is hardware-accelerated
+    // where the CPU allows; 'crc32' is enet's own. Both ends must agree.
+    static v8::Handle<v8::Value> SetChecksum(const v8::Arguments& args)
+    {
+        v8::HandleScope scope;
+        Host *host = node::ObjectWrap::Unwrap<Host>(args.This());
+        if (args.Length() < 1 || !args[0]->IsString())
+            return v8::ThrowException(v8::Exception::Error(v8::String::New("setChecksum requires 'crc32c', 'crc32' or 'none'")));
+        v8::String::AsciiValue name(args[0]->ToString());
+        ENetChecksumCallback checksum;
+        if (strcmp(*name, "crc32c") == 0)
+            checksum = Crc32c;
+        else if (strcmp(*name, "crc32") == 0)
+            checksum = enet_crc32;
+        else if (strcmp(*name, "none") == 0)
+            checksum = NULL;
+        else
+            return v8::ThrowException(v8::Exception::Error(v8::String::New("unknown checksum; expected 'crc32c', 'crc32' or 'none'")));
+        if (host->thread != NULL)
+        {
+            if (!host->thread->Call(SetChecksumOnThread, (void *) checksum))
+                return ThrowQueueFull();
+        }
+        else
+        {
+            host->host->checksum = checksum;
+        }
+        return v8::Undefined();
+    }
+    
+    Admission *GetAdmission()
+    {
+        if (admission == NULL)
+        {
+            admission = new Admission();
+            AddInterceptor(host, admission);
+        }
+        return admission;
+    }
+    
+    // setConnectRateLimit(perSecond[, burst]) -- connection attempts allowed
+    // from each source IP, refilling at perSecond up to burst (default the
+    // same). 0 turns the limit off.
+    static v8::Handle<v8::Value> SetConnectRateLimit(const v8::Arguments& args)
+    {
+        v8::HandleScope scope;
+        Host *host = node::ObjectWrap::Unwrap<Host>(args.This());
+        if (args.Length() < 1 || !args[0]->IsNumber())
+            return v8::ThrowException(v8::Exception::Error(v8::String::New("setConnectRateLimit requires a rate")));
+        double rate = args[0]->NumberValue();
+        double burst = args.Length() > 1 ? args[1]->NumberValue() : rate;
+        host->GetAdmission()->SetRateLimit(rate, burst);
+        return v8::Undefined();
+    }
+    
+    // setConnectCookies(enabled) -- makes new clients echo a cookie before
+    // they get a peer slot, and answers cookie challenges from servers.
+    static v8::Handle<v8::Value> SetConnectCookies(const v8::Arguments& args)
+    {
+        v8::HandleScope scope;
+        Host *host = node::ObjectWrap::Unwrap<Host>(args.This());
+        host->GetAdmission()->SetCookies(args.Length() > 0 && args[0]->BooleanValue());
+        return v8::Undefined();
+    }
+    
+    static v8::Handle<v8::Value> AddConnectionRule(const v8::Arguments& args, bool allow)
+    {
+        v8::HandleScope scope;
+        Host *host = node::ObjectWrap::Unwrap<Host>(args.This());
+        if (args.Length() < 1 || !args[0]->IsString())
+            return v8::ThrowException(v8::Exception::Error(v8::String::New("expected an address or CIDR prefix")));
+        v8::String::AsciiValue cidr(args[0]->ToString());
+        if (!host->GetAdmission()->AddRule(*cidr, allow))
+            return v8::ThrowException(v8::Exception::Error(v8::String::New("invalid CIDR prefix")));
+        return v8::Undefined();
+    }
+    
+    // allowConnections(cidr), denyConnections(cidr) -- e.g. '10.0.0.0/8'.
+    // The longest matching prefix decides; allowed sources skip the rate
+    // limit and cookies.
+    static v8::Handle<v8::Value> AllowConnections(const v8::Arguments& args)
+    {
+        return AddConnectionRule(args, true);
+    }
+    
+    static v8::Handle<v8::Value> DenyConnections(const v8::Arguments& args)
+    {
+        return AddConnectionRule(args, false);
+    }
+    
+    static v8::Handle<v8::Value> ClearConnectionRules(const v8::Arguments& args)
+    {
+        v8::HandleScope scope;
+        Host *host = node::ObjectWrap::Unwrap<Host>(args.This());
+        if (host->admission != NULL)
+            host->admission->ClearRules();
+        return v8::Undefined();
+    }
+    
+    static v8::Handle<v8::Value> GetAdmissionStats(const v8::Arguments& args)
+    {
+        v8::HandleScope scope;
+        Host *host = node::ObjectWrap::Unwrap<Host>(args.This());
+        AdmissionStats stats;
+        ::memset(&stats, 0, sizeof(AdmissionStats));
+        if (host->admission != NULL)
+            host->admission->GetStats(&stats);
+        v8::Local<v8::Object> result = v8::Object::New();
+        result->Set(v8::String::NewSymbol("admitted"), v8::Number::New(stats.admitted));
+        result->Set(v8::String::NewSymbol("denied"), v8::Number::New(stats.denied));
+        result->Set(v8::String::NewSymbol("rateLimited"), v8::Number::New(stats.rateLimited));
+        result->Set(v8::String::NewSymbol("challenged"), v8::Number::New(stats.challenged));
+        return scope.Close(result);
+    }
+    
+    static void FreeRawData(char *data, void *hint)
+    {
+        ::free(data);
+    }
+    
+    // Hands queued raw datagrams to rawHandler(addresses, payloads), as
+    // Buffers over the queued copies. Without a handler they are dropped.
+    void DeliverRaw()
+    {
+        if (raw == NULL)
+            return;
+        std::vector<RawDatagram> datagrams;
+        raw->Take(datagrams);
+        if (datagrams.empty())
+            return;
+        if (rawHandler.IsEmpty())
+        {
+            for (size_t i = 0; i < datagrams.size(); i++)
+                ::free(datagrams[i].data);
+            return;
+        }
+        v8::HandleScope scope;
+        v8::Local<v8::Array> addresses = v8::Array::New(datagrams.size());
+        v8::Local<v8::Array> payloads = v8::Array::New(datagrams.size());
+        for (size_t i = 0; i < datagrams.size(); i++)
+        {
+            addresses->Set(i, Address::WrapAddress(datagrams[i].address));
+            node::Buffer *slowBuf = node::Buffer::New(datagrams[i].data,
+                datagrams[i].length, FreeRawData, NULL);
+            payloads->Set(i, MakeFastBuffer(slowBuf, datagrams[i].length));
+        }
+        v8::Handle<v8::Value> argv[2] = { addresses, payloads };
+        v8::TryCatch try_catch;
+        rawHandler->Call(handle_, 2, argv);
+        if (try_catch.HasCaught())
+            node::FatalException(try_catch);
+    }
+    
+    RawChannel *GetRaw()
+    {
+        if (raw == NULL)
+        {
+            raw = new RawChannel(this);
+            AddInterceptor(host, raw);
+        }
+        return raw;
+    }
+    
+    // addRawFilter(offset, value[, mask]) -- datagrams whose bytes from
+    // offset match the value Buffer (under mask, if given) are taken off
+    // the socket before enet parses them and passed to the raw handler.
+    static v8::Handle<v8::Value> AddRawFilter(const v8::Arguments& args)
+    {
+        v8::HandleScope scope;
+        Host *host = node::ObjectWrap::Unwrap<Host>(args.This());
+        if (args.Length() < 2 || !args[0]->IsUint32() || !node::Buffer::HasInstance(args[1]))
+            return v8::ThrowException(v8::Exception::Error(v8::String::New("addRawFilter requires an offset and a Buffer")));
+        v8::Local<v8::Object> value = args[1]->ToObject();
+        const enet_uint8 *mask = NULL;
+        size_t maskLength = 0;
+        if (args.Length() > 2 && node::Buffer::HasInstance(args[2]))
+        {
+            mask = (const enet_uint8 *) node::Buffer::Data(args[2]->ToObject());
+            maskLength = node::Buffer::Length(args[2]->ToObject());
+        }
+        if (!host->GetRaw()->AddFilter(args[0]->Uint32Value(),
+                (const enet_uint8 *) node::Buffer::Data(value), node::Buffer::Length(value),
+                mask, maskLength))
+            return v8::ThrowException(v8::Exception::Error(v8::String::New("mask and value lengths differ")));
+        return v8::Undefined();
+    }
+    
+    static v8::Handle<v8::Value> ClearRawFilters(const v8::Arguments& args)
+    {
+        v8::HandleScope scope;
+        Host *host = node::ObjectWrap::Unwrap<Host>(args.This());
+        if (host->raw != NULL)
+            host->raw->ClearFilters();
+        return v8::Undefined();
+    }
+    
+    // setRawHandler(function(addresses, payloads) {...}), or null.
+    static v8::Handle<v8::Value> SetRawHandler(const v8::Arguments& args)
+    {
+        v8::HandleScope scope;
+        Host *host = node::ObjectWrap::Unwrap<Host>(args.This());
+        if (!host->rawHandler.IsEmpty())
+        {
+            host->rawHandler.Dispose();
+            host->rawHandler.Clear();
+        }
+        host->rawHandler = HandlerArgument(args[0]);
+        return v8::Undefined();
+    }
+    
+    // sendRaw(address, buffer) -- sends buffer as-is from the host's
+    // socket. Returns the number of bytes sent.
+    static v8::Handle<v8::Value> SendRaw(const v8::Arguments& args)
+    {
+        v8::HandleScope scope;
+        Host *host = node::ObjectWrap::Unwrap<Host>(args.This());
+        if (args.Length() < 2 || !args[0]->IsObject() || !node::Buffer::HasInstance(args[1]))
+            return v8::ThrowException(v8::Exception::Error(v8::String::New("sendRaw requires an address and a Buffer")));
+        Address *address = node::ObjectWrap::Unwrap<Address>(args[0]->ToObject());
+        v8::Local<v8::Object> buffer = args[1]->ToObject();
+        if (host->capture != NULL)
+            host->capture->Append(kTraceRaw, 0, 0, &address->address,
+                node::Buffer::Data(buffer), node::Buffer::Length(buffer));
+        int sent = host->GetRaw()->Send(host->host, address->address,
+            node::Buffer::Data(buffer), node::Buffer::Length(buffer));
+        if (sent < 0)
+            return v8::ThrowException(v8::Exception::Error(v8::String::New("error sending datagram")));
+        return scope.Close(v8::Integer::New(sent));
+    }
+    
+    static v8::Handle<v8::Value> GetRawStats(const v8::Arguments& args)
+    {
+        v8::HandleScope scope;
+        Host *host = node::ObjectWrap::Unwrap<Host>(args.This());
+        RawStats stats;
+        ::memset(&stats, 0, sizeof(RawStats));
+        if (host->raw != NULL)
+            host->raw->GetStats(&stats);
+        v8::Local<v8::Object> result = v8::Object::New();
+        result->Set(v8::String::NewSymbol("received"), v8::Number::New(stats.received));
+        result->Set(v8::String::NewSymbol("dropped"), v8::Number::New(stats.dropped));
+        result->Set(v8::String::NewSymbol("sent"), v8::Number::New(stats.sent));
+        return scope.Close(result);
+    }
+    
+    static double NumberOption(v8::Handle<v8::Object> options, const char *name, double fallback)
+    {
+        v8::Local<v8::Value> value = options->Get(v8::String::NewSymbol(name));
+        return value->IsNumber() ? value->NumberValue() : fallback;
+    }
+    
+    // simulateLink({loss, lossBurst, latency, jitter, jitterDistribution,
+    // duplicate, reorder, seed}) -- makes incoming traffic look as if it
+    // crossed a lossy, slow link; times are in milliseconds, rates are
+    // fractions. null turns it off.
+    static v8::Handle<v8::Value> SimulateLink(const v8::Arguments& args)
+    {
+        v8::HandleScope scope;
+        Host *host = node::ObjectWrap::Unwrap<Host>(args.This());
+        if (args.Length() < 1 || !args[0]->IsObject())
+        {
+            if (host->link != NULL)
+            {
+                RemoveInterceptor(host->host, host->link);
+                delete host->link;
+                host->link = NULL;
+            }
+            return v8::Undefined();
+        }
+        v8::Local<v8::Object> options = args[0]->ToObject();
+        LinkConditions conditions;
+        conditions.loss = NumberOption(options, "loss", 0);
+        conditions.lossBurst = NumberOption(options, "lossBurst", 1);
+        conditions.latency = NumberOption(options, "latency", 0);
+        conditions.jitter = NumberOption(options, "jitter", 0);
+        conditions.duplicate = NumberOption(options, "duplicate", 0);
+        conditions.reorder = NumberOption(options, "reorder", 0);
+        conditions.seed = (enet_uint32) NumberOption(options, "seed", 0);
+        v8::Local<v8::Value> distribution = options->Get(v8::String::NewSymbol("jitterDistribution"));
+        conditions.normalJitter = false;
+        if (distribution->IsString())
+        {
+            v8::String::AsciiValue name(distribution->ToString());
+            if (::strcmp(*name, "normal") == 0)
+                conditions.normalJitter = true;
+            else if (::strcmp(*name, "uniform") != 0)
+                return v8::ThrowException(v8::Exception::Error(v8::String::New("jitterDistribution must be 'uniform' or 'normal'")));
+        }
+        if (host->link == NULL)
+        {
+            LinkSimulator *link = new LinkSimulator();
+            if (!link->Start(host->host))
+            {
+                delete link;
+                return v8::ThrowException(v8::Exception::Error(v8::String::New("could not start link simulator")));
+            }
+            host->link = link;
+            // Ahead of the other interceptors, so they see the traffic
+            // that makes it across the link.
+            AddInterceptor(host->host, link, kInterceptLink);
+        }
+        host->link->SetConditions(conditions);
+        return v8::Undefined();
+    }
+    
+    static v8::Handle<v8::Value> GetLinkStats(const v8::Arguments& args)
+    {
+        v8::HandleScope scope;
+        Host *host = node::ObjectWrap::Unwrap<Host>(args.This());
+        LinkStats stats;
+        ::memset(&stats, 0, sizeof(LinkStats));
+        if (host->link != NULL)
+            host->link->GetStats(&stats);
+        v8::Local<v8::Object> result = v8::Object::New();
+        result->Set(v8::String::NewSymbol("passed"), v8::Number::New(stats.passed));
+        result->Set(v8::String::NewSymbol("dropped"), v8::Number::New(stats.dropped));
+        result->Set(v8::String::NewSymbol("duplicated"), v8::Number::New(stats.duplicated));
+        result->Set(v8::String::NewSymbol("reordered"), v8::Number::New(stats.reordered));
+        return scope.Close(result);
+    }
+    
+    void StopCapture()
+    {
+        if (capture == NULL)
+            return;
+        RemoveInterceptor(host, capture);
+        captures.erase(host);
+        delete capture;
+        capture = NULL;
+    }
+    
+    void StopReplay()
+    {
+        if (replay == NULL)
+            return;
+        replay->Stop();
+        RemoveInterceptor(host, replay);
+        delete replay;
+        replay = NULL;
+    }
+    
+    // startCapture(path[, bytes]) -- records incoming datagrams and
+    // outgoing packets into a trace file of about bytes (default 64MB),
+    // overwriting the oldest records once it is full. Replaces any capture
+    // already running.
+    static v8::Handle<v8::Value> StartCapture(const v8::Arguments& args)
+    {
+        v8::HandleScope scope;
+        Host *host = node::ObjectWrap::Unwrap<Host>(args.This());
+        if (args.Length() < 1 || !args[0]->IsString())
+            return v8::ThrowException(v8::Exception::Error(v8::String::New("startCapture requires a path")));
+        v8::String::Utf8Value path(args[0]->ToString());
+        size_t bytes = kDefaultCaptureBytes;
+        if (args.Length() > 1 && args[1]->IsNumber())
+            bytes = (size_t) args[1]->NumberValue();
+        host->StopCapture();
+        TraceWriter *capture = new TraceWriter();
+        if (!capture->Open(*path, bytes))
+        {
+            delete capture;
+            return v8::ThrowException(v8::Exception::Error(v8::String::New("could not create trace file")));
+        }
+        host->capture = capture;
+        captures[host->host] = capture;
+        AddInterceptor(host->host, capture, kInterceptCapture);
+        return v8::Undefined();
+    }
+    
+    static v8::Handle<v8::Value> StopCapture(const v8::Arguments& args)
+    {
+        v8::HandleScope scope;
+        Host *host = node::ObjectWrap::Unwrap<Host>(args.This());
+        host->StopCapture();
+        return v8::Undefined();
+    }
+    
+    static v8::Handle<v8::Value> GetCaptureStats(const v8::Arguments& args)
+    {
+        v8::HandleScope scope;
+        Host *host = node::ObjectWrap::Unwrap<Host>(args.This());
+        TraceStats stats;
+        ::memset(&stats, 0, sizeof(TraceStats));
+        if (host->capture != NULL)
+            host->capture->GetStats(&stats);
+        v8::Local<v8::Object> result = v8::Object::New();
+        result->Set(v8::String::NewSymbol("records"), v8::Number::New(stats.records));
+        result->Set(v8::String::NewSymbol("bytes"), v8::Number::New(stats.bytes));
+        result->Set(v8::String::NewSymbol("overwritten"), v8::Number::New(stats.overwritten));
+        result->Set(v8::String::NewSymbol("skipped"), v8::Number::New(stats.skipped));
+        return scope.Close(result);
+    }
+    
+    // startReplay(path[, speed[, keepAddresses]]) -- plays the incoming
+    // datagrams of a trace back into this host, speed times faster than
+    // they were recorded (0 for as fast as possible). Replaces any replay
+    // already running.
+    static v8::Handle<v8::Value> StartReplay(const v8::Arguments& args)
+    {
+        v8::HandleScope scope;
+        Host *host = node::ObjectWrap::Unwrap<Host>(args.This());
+        if (args.Length() < 1 || !args[0]->IsString())
+            return v8::ThrowException(v8::Exception::Error(v8::String::New("startReplay requires a path")));
+        v8::String::Utf8Value path(args[0]->ToString());
+        double speed = args.Length() > 1 && args[1]->IsNumber() ? args[1]->NumberValue() : 1;
+        bool keepAddresses = args.Length() > 2 && args[2]->BooleanValue();
+        host->StopReplay();
+        TraceReplay *replay = new TraceReplay();
+        const char *error;
+        if (!replay->Open(*path, &error))
+        {
+            delete replay;
+            return v8::ThrowException(v8::Exception::Error(v8::String::New(error)));
+        }
+        // Registered first, so the replayed datagrams are unwrapped by the
+        // time the thread starts sending them.
+        AddInterceptor(host->host, replay, kInterceptReplay);
+        if (!replay->Start(host->host, speed < 0 ? 0 : speed, keepAddresses))
+        {
+            RemoveInterceptor(host->host, replay);
+            delete replay;
+            return v8::ThrowException(v8::Exception::Error(v8::String::New("could not start replay")));
+        }
+        host->replay = replay;
+        return v8::Undefined();
+    }
+    
+    static v8::Handle<v8::Value> StopReplay(const v8::Arguments& args)
+    {
+        v8::HandleScope scope;
+        Host *host = node::ObjectWrap::Unwrap<Host>(args.This());
+        host->StopReplay();
+        return v8::Undefined();
+    }
+    
+    static v8::Handle<v8::Value> GetReplayStats(const v8::Arguments& args)
+    {
+        v8::HandleScope scope;
+        Host *host = node::ObjectWrap::Unwrap<Host>(args.This());
+        ReplayStats stats;
+        ::memset(&stats, 0, sizeof(ReplayStats));
+        if (host->replay != NULL)
+            host->replay->GetStats(&stats);
+        v8::Local<v8::Object> result = v8::Object::New();
+        result->Set(v8::String::NewSymbol("records"), v8::Number::New(stats.records));
+        result->Set(v8::String::NewSymbol("sent"), v8::Number::New(stats.sent));
+        result->Set(v8::String::NewSymbol("done"), v8::Boolean::New(host->replay == NULL || stats.done));
+        return scope.Close(result);
+    }
+    
+    struct SchedulingCall
+    {
+        Scheduler *scheduler;
+        int classes[256];       // -1 to leave a channel's class alone
+        size_t quantum;
+        size_t budget;
+        enet_uint32 tick;
+        SchedulerStats stats;
+    };
+    
+    static void ConfigureSchedulerOnThread(ENetHost *host, void *arg)
+    {
+        SchedulingCall *call = (SchedulingCall *) arg;
+        for (int i = 0; i < 256; i++)
+        {
+            if (call->classes[i] >= 0)
+                call->scheduler->SetChannelClass((enet_uint8) i, call->classes[i]);
+        }
+        call->scheduler->SetQuantum(call->quantum);
+        call->scheduler->SetBudget(call->budget, call->tick);
+    }
+    
+    static void SchedulerStatsOnThread(ENetHost *host, void *arg)
+    {
+        SchedulingCall *call = (SchedulingCall *) arg;
+        call->scheduler->GetStats(&call->stats);
+    }
+    
+    // setScheduling({priorities, quantum, budget, tick}) -- queues sends in
+    // a native scheduler: priorities[i] is the class (0, the most urgent,
+    // to 3) for channel i, peers share each class by deficit round robin
+    // with quantum bytes a turn, and at most budget bytes are released per
+    // tick milliseconds (no limit if 0). null sends everything still
+    // queued and goes back to sending directly.
+    static v8::Handle<v8::Value> SetScheduling(const v8::Arguments& args)
+    {
+        v8::HandleScope scope;
+        Host *host = node::ObjectWrap::Unwrap<Host>(args.This());
+        if (args.Length() < 1 || !args[0]->IsObject())
+        {
+            if (host->scheduler == NULL)
+                return v8::Undefined();
+            if (host->thread != NULL)
+            {
+                if (!host->thread->SetScheduler(NULL))
+                    return ThrowQueueFull();
+            }
+            else
+            {
+                host->scheduler->Flush(host->host);
+            }
+            schedulers.erase(host->host);
+            delete host->scheduler;
+            host->scheduler = NULL;
+            return v8::Undefined();
+        }
+        v8::Local<v8::Object> options = args[0]->ToObject();
+        SchedulingCall call;
+        for (int i = 0; i < 256; i++)
+            call.classes[i] = -1;
+        v8::Local<v8::Value> priorities = options->Get(v8::String::NewSymbol("priorities"));
+        if (priorities->IsArray())
+        {
+            v8::Local<v8::Array> list = v8::Local<v8::Array>::Cast(priorities);
+            for (uint32_t i = 0; i < list->Length() && i < 256; i++)
+                call.classes[i] = list->Get(i)->Int32Value();
+        }
+        call.quantum = (size_t) NumberOption(options, "quantum", 0);
+        call.budget = (size_t) NumberOption(options, "budget", 0);
+        call.tick = (enet_uint32) NumberOption(options, "tick", 0);
+        bool created = false;
+        if (host->scheduler == NULL)
+        {
+            host->scheduler = new Scheduler(host->peerCount);
+            created = true;
+        }
+        call.scheduler = host->scheduler;
+        if (host->thread != NULL && !created)
+        {
+            if (!host->thread->Call(ConfigureSchedulerOnThread, &call))
+                return ThrowQueueFull();
+            return v8::Undefined();
+        }
+        ConfigureSchedulerOnThread(host->host, &call);
+        if (created)
+        {
+            if (host->thread != NULL && !host->thread->SetScheduler(host->scheduler))
+            {
+                delete host->scheduler;
+                host->scheduler = NULL;
+                return ThrowQueueFull();
+            }
+            schedulers[host->host] = host->scheduler;
+        }
+        return v8::Undefined();
+    }
+    
+    static v8::Handle<v8::Value> GetSchedulerStats(const v8::Arguments& args)
+    {
+        v8::HandleScope scope;
+        Host *host = node::ObjectWrap::Unwrap<Host>(args.This());
+        SchedulingCall call;
+        ::memset(&call.stats, 0, sizeof(SchedulerStats));
+        call.scheduler = host->scheduler;
+        if (host->scheduler != NULL)
+        {
+            if (host->thread != NULL)
+            {
+                if (!host->thread->Call(SchedulerStatsOnThread, &call))
+                    return ThrowQueueFull();
+            }
+            else
+            {
+                SchedulerStatsOnThread(host->host, &call);
+            }
+        }
+        v8::Local<v8::Object> result = v8::Object::New();
+        result->Set(v8::String::NewSymbol("queuedPackets"), v8::Number::New(call.stats.queuedPackets));
+        result->Set(v8::String::NewSymbol("queuedBytes"), v8::Number::New(call.stats.queuedBytes));
+        result->Set(v8::String::NewSymbol("sentPackets"), v8::Number::New(call.stats.sentPackets));
+        result->Set(v8::String::NewSymbol("sentBytes"), v8::Number::New(call.stats.sentBytes));
+        result->Set(v8::String::NewSymbol("dropped"), v8::Number::New(call.stats.dropped));
+        return scope.Close(result);
+    }
+    
     static v8::Handle<v8::Value> FD(const v8::Arguments& args)
     {
         v8::HandleScope scope;
@@ -873,13 +3582,455 @@ public:
     }
 };
 
+// ShardedHost -- several ENet hosts bound to the same port with SO_REUSEPORT,
+// each serviced on its own thread. The kernel spreads clients across the
+// sockets, so protocol work scales across cores while JS sees one stream of
+// events. Peers are addressed by (shard, peerID, connectID) triples, since
+// the ENetPeers belong to the service threads.
+class ShardedHost : public node::ObjectWrap, public EventSink
+{
+private:
+    std::vector<ENetHost *> hosts;
+    std::vector<ServiceThread *> threads;
+    MpscQueue events;
+    ev_async wakeup;
+    v8::Persistent<v8::Function> callback;
+    bool running;
+    ENetAddress address;
+    
+    // Per event: type, shard, peerID, connectID, channelID, data, address
+    // host and address port.
+    enum { kBatchStride = 8, kMaxBatch = 256 };
+    enet_uint32 batchInfo[kMaxBatch * kBatchStride];
+    v8::Persistent<v8::Object> batchInfoObject;
+    
+public:
+    ShardedHost(const ENetAddress& address) : running(false), address(address)
+    {
+        ev_async_init(&wakeup, OnWakeup);
+        wakeup.data = this;
+    }
+    
+    ~ShardedHost()
+    {
+        Stop();
+        for (size_t i = 0; i < threads.size(); i++)
+        {
+            delete threads[i];
+        }
+        for (size_t i = 0; i < hosts.size(); i++)
+        {
+            enet_host_destroy(hosts[i]);
+        }
+        DrainEvents();
+        if (!batchInfoObject.IsEmpty())
+        {
+            batchInfoObject.Dispose();
+        }
+    }
+    
+    // Creates an unbound host, then binds it ourselves so SO_REUSEPORT can
+    // be set first. If the address asks for any port, the first shard's
+    // bind picks one and the rest share it.
+    bool AddShard(size_t peerCount, size_t channelLimit, enet_uint32 incomingBandwidth, enet_uint32 outgoingBandwidth)
+    {
+        ENetHost *host = enet_host_create(NULL, peerCount, channelLimit, incomingBandwidth, outgoingBandwidth);
+        if (host == NULL)
+            return false;
+        enet_socket_set_option(host->socket, ENET_SOCKOPT_REUSEADDR, 1);
+#ifdef SO_REUSEPORT
+        int one = 1;
+        ::setsockopt(host->socket, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+#endif
+        if (enet_socket_bind(host->socket, &address) < 0)
+        {
+            enet_host_destroy(host);
+            return false;
+        }
+        if (address.port == ENET_PORT_ANY)
+        {
+            struct sockaddr_in sin;
+            socklen_t sinLength = sizeof(sin);
+            if (::getsockname(host->socket, (struct sockaddr *) &sin, &sinLength) < 0)
+            {
+                enet_host_destroy(host);
+                return false;
+            }
+            address.port = ENET_NET_TO_HOST_16(sin.sin_port);
+        }
+        host->address = address;
+        hosts.push_back(host);
+        threads.push_back(new ServiceThread(host, (int) threads.size(), this));
+        return true;
+    }
+    
+    // Called on the service threads.
+    void Deliver(ServiceEvent *event)
+    {
+        events.Push(event);
+    }
+    
+    void Flush()
+    {
+        ev_async_send(&wakeup);
+    }
+    
+    void DrainEvents()
+    {
+        QueueNode *node;
+        while ((node = events.Pop()) != NULL)
+        {
+            ServiceEvent *event = (ServiceEvent *) node;
+            if (event->packet != NULL)
+                enet_packet_destroy(event->packet);
+            delete event;
+        }
+    }
+    
+    void Stop()
+    {
+        if (!running)
+            return;
+        for (size_t i = 0; i < threads.size(); i++)
+        {
+            threads[i]->Stop();
+        }
+        ev_async_stop(&wakeup);
+        callback.Dispose();
+        callback.Clear();
+        running = false;
+    }
+    
+    // Hands queued events to JS in batches of up to kMaxBatch, as
+    // callback({count, info, packets}) where packets holds zero-copy Buffers.
+    static void OnWakeup(ev_async *w, int revents)
+    {
+        ShardedHost *sharded = (ShardedHost *) w->data;
+        v8::HandleScope scope;
+        if (sharded->batchInfoObject.IsEmpty())
+        {
+            sharded->batchInfoObject = NewExternalArray(sharded->batchInfo, kMaxBatch * kBatchStride);
+        }
+        size_t count;
+        do
+        {
+            v8::Local<v8::Array> packets = v8::Array::New();
+            count = 0;
+            QueueNode *node;
+            while (count < kMaxBatch && (node = sharded->events.Pop()) != NULL)
+            {
+                ServiceEvent *event = (ServiceEvent *) node;
+                enet_uint32 *info = &sharded->batchInfo[count * kBatchStride];
+                info[0] = event->type;
+                info[1] = event->shard;
+                info[2] = event->peerID;
+                info[3] = event->connectID;
+                info[4] = event->channelID;
+                info[5] = event->data;
+                info[6] = event->address.host;
+                info[7] = event->address.port;
+                if (event->packet != NULL)
+                {
+                    ENetPacket *p = event->packet;
+                    Packet::RetainPacket(p);
+                    node::Buffer *slowBuf = node::Buffer::New((char *) p->data,
+                        p->dataLength, Packet::FreePacketData, p);
+                    packets->Set(count, MakeFastBuffer(slowBuf, p->dataLength));
+                }
+                else
+                {
+                    packets->Set(count, v8::Null());
+                }
+                delete event;
+                count++;
+            }
+            if (count == 0 || !sharded->running)
+                break;
+            v8::Local<v8::Object> batch = v8::Object::New();
+            batch->Set(v8::String::NewSymbol("count"), v8::Integer::New(count));
+            batch->Set(v8::String::NewSymbol("info"), sharded->batchInfoObject);
+            batch->Set(v8::String::NewSymbol("packets"), packets);
+            v8::Handle<v8::Value> argv[1] = { batch };
+            v8::TryCatch try_catch;
+            sharded->callback->Call(sharded->handle_, 1, argv);
+            if (try_catch.HasCaught())
+                node::FatalException(try_catch);
+        }
+        while (count == kMaxBatch);
+    }
+    
+    static v8::Persistent<v8::FunctionTemplate> s_ct;
+    
+    static void Init(v8::Handle<v8::Object> target)
+    {
+        v8::HandleScope scope;
+        v8::Local<v8::FunctionTemplate> t = v8::FunctionTemplate::New(New);
+        s_ct = v8::Persistent<v8::FunctionTemplate>::New(t);
+        s_ct->InstanceTemplate()->SetInternalFieldCount(1);
+        s_ct->SetClassName(v8::String::NewSymbol("ShardedHost"));
+        NODE_SET_PROTOTYPE_METHOD(s_ct, "start", Start);
+        NODE_SET_PROTOTYPE_METHOD(s_ct, "stop", StopMethod);
+        NODE_SET_PROTOTYPE_METHOD(s_ct, "send", Send);
+        NODE_SET_PROTOTYPE_METHOD(s_ct, "disconnect", Disconnect);
+        NODE_SET_PROTOTYPE_METHOD(s_ct, "flush", FlushMethod);
+        NODE_SET_PROTOTYPE_METHOD(s_ct, "shardCount", ShardCount);
+        NODE_SET_PROTOTYPE_METHOD(s_ct, "address", GetAddress);
+        MY_NODE_DEFINE_CONSTANT(s_ct, "DISCONNECT", ServiceCommand::DISCONNECT);
+        MY_NODE_DEFINE_CONSTANT(s_ct, "DISCONNECT_NOW", ServiceCommand::DISCONNECT_NOW);
+        MY_NODE_DEFINE_CONSTANT(s_ct, "DISCONNECT_LATER", ServiceCommand::DISCONNECT_LATER);
+        MY_NODE_DEFINE_CONSTANT(s_ct, "RESET", ServiceCommand::RESET);
+        target->Set(v8::String::NewSymbol("ShardedHost"), s_ct->GetFunction());
+    }
+    
+    // new ShardedHost(address, shards, peerCount[, channelLimit[, incomingBW[, outgoingBW]]])
+    // -- peerCount is per shard.
+    static v8::Handle<v8::Value> New(const v8::Arguments& args)
+    {
+        v8::HandleScope scope;
+        if (args.Length() < 3 || !args[0]->IsObject())
+            return v8::ThrowException(v8::Exception::Error(v8::String::New("constructor takes at least three arguments")));
+        Address *addr = node::ObjectWrap::Unwrap<Address>(args[0]->ToObject());
+        size_t shards = args[1]->Uint32Value();
+        size_t peerCount = args[2]->Uint32Value();
+        size_t channelLimit = 0;
+        enet_uint32 incomingBW = 0;
+        enet_uint32 outgoingBW = 0;
+        if (args.Length() > 3)
+            channelLimit = args[3]->Uint32Value();
+        if (args.Length() > 4)
+            incomingBW = args[4]->Uint32Value();
+        if (args.Length() > 5)
+            outgoingBW = args[5]->Uint32Value();
+        if (shards == 0)
+            return v8::ThrowException(v8::Exception::Error(v8::String::New("need at least one shard")));
+        ShardedHost *sharded = new ShardedHost(addr->address);
+        for (size_t i = 0; i < shards; i++)
+        {
+            if (!sharded->AddShard(peerCount, channelLimit, incomingBW, outgoingBW))
+            {
+                delete sharded;
+                return v8::ThrowException(v8::Exception::Error(v8::String::New("could not create host")));
+            }
+        }
+        sharded->Wrap(args.This());
+        return scope.Close(args.This());
+    }
+    
+    // start(callback) -- starts the service threads; callback receives each
+    // batch of events.
+    static v8::Handle<v8::Value> Start(const v8::Arguments& args)
+    {
+        v8::HandleScope scope;
+        ShardedHost *sharded = node::ObjectWrap::Unwrap<ShardedHost>(args.This());
+        if (args.Length() < 1 || !args[0]->IsFunction())
+            return v8::ThrowException(v8::Exception::Error(v8::String::New("start requires a callback")));
+        if (sharded->running)
+            return v8::Undefined();
+        sharded->callback = v8::Persistent<v8::Function>::New(v8::Local<v8::Function>::Cast(args[0]));
+        ev_async_start(&sharded->wakeup);
+        sharded->running = true;
+        for (size_t i = 0; i < sharded->threads.size(); i++)
+        {
+            if (!sharded->threads[i]->Start())
+            {
+                sharded->Stop();
+                return v8::ThrowException(v8::Exception::Error(v8::String::New("could not start service thread")));
+            }
+        }
+        sharded->Ref();
+        return v8::Undefined();
+    }
+    
+    static v8::Handle<v8::Value> StopMethod(const v8::Arguments& args)
+    {
+        v8::HandleScope scope;
+        ShardedHost *sharded = node::ObjectWrap::Unwrap<ShardedHost>(args.This());
+        if (sharded->running)
+        {
+            sharded->Stop();
+            sharded->Unref();
+        }
+        return v8::Undefined();
+    }
+    
+    // Looks up the shard named by args[0]; returns NULL if out of range.
+    static ServiceThread *ShardArg(ShardedHost *sharded, const v8::Arguments& args)
+    {
+        if (args.Length() < 1)
+            return NULL;
+        uint32_t shard = args[0]->Uint32Value();
+        if (shard >= sharded->threads.size())
+            return NULL;
+        return sharded->threads[shard];
+    }
+    
+    // send(shard, peerID, connectID, channel, buffer[, flags]) -- the buffer
+    // is copied; FLAG_NO_ALLOCATE is ignored here.
+    static v8::Handle<v8::Value> Send(const v8::Arguments& args)
+    {
+        v8::HandleScope scope;
+        ShardedHost *sharded = node::ObjectWrap::Unwrap<ShardedHost>(args.This());
+        ServiceThread *thread = ShardArg(sharded, args);
+        if (thread == NULL || args.Length() < 5 || !args[4]->IsObject())
+            return v8::ThrowException(v8::Exception::Error(v8::String::New("send requires shard, peerID, connectID, channel and buffer")));
+        enet_uint32 flags = 0;
+        if (args.Length() > 5)
+            flags = args[5]->Uint32Value() & ~ENET_PACKET_FLAG_NO_ALLOCATE;
+        v8::Local<v8::Object> buffer = args[4]->ToObject();
+        ServiceCommand command;
+        ::memset(&command, 0, sizeof(ServiceCommand));
+        command.type = ServiceCommand::SEND;
+        command.peerID = (enet_uint16) args[1]->Uint32Value();
+        command.connectID = args[2]->Uint32Value();
+        command.channelID = (enet_uint8) args[3]->Uint32Value();
+        command.data = 0;
+        command.packet = Packet::CreatePacket(node::Buffer::Data(buffer), node::Buffer::Length(buffer), flags);
+        if (command.packet == NULL)
+            return v8::ThrowException(v8::Exception::Error(v8::String::New("could not allocate packet")));
+        if (!thread->Post(command))
+        {
+            enet_packet_destroy(command.packet);
+            return v8::ThrowException(v8::Exception::Error(v8::String::New("shard command queue is full")));
+        }
+        thread->Wake();
+        return v8::Undefined();
+    }
+    
+    // disconnect(shard, peerID, connectID[, data[, mode]]) -- mode is one of
+    // DISCONNECT (the default), DISCONNECT_NOW, DISCONNECT_LATER or RESET.
+    static v8::Handle<v8::Value> Disconnect(const v8::Arguments& args)
+    {
+        v8::HandleScope scope;
+        ShardedHost *sharded = node::ObjectWrap::Unwrap<ShardedHost>(args.This());
+        ServiceThread *thread = ShardArg(sharded, args);
+        if (thread == NULL || args.Length() < 3)
+            return v8::ThrowException(v8::Exception::Error(v8::String::New("disconnect requires shard, peerID and connectID")));
+        ServiceCommand command;
+        ::memset(&command, 0, sizeof(ServiceCommand));
+        command.type = ServiceCommand::DISCONNECT;
+        command.peerID = (enet_uint16) args[1]->Uint32Value();
+        command.connectID = args[2]->Uint32Value();
+        command.channelID = 0;
+        command.data = args.Length() > 3 ? args[3]->Uint32Value() : 0;
+        command.packet = NULL;
+        if (args.Length() > 4)
+        {
+            switch (args[4]->Int32Value())
+            {
+            case ServiceCommand::DISCONNECT_NOW:
+                command.type = ServiceCommand::DISCONNECT_NOW;
+                break;
+            case ServiceCommand::DISCONNECT_LATER:
+                command.type = ServiceCommand::DISCONNECT_LATER;
+                break;
+            case ServiceCommand::RESET:
+                command.type = ServiceCommand::RESET;
+                break;
+            }
+        }
+        if (!thread->Post(command))
+            return v8::ThrowException(v8::Exception::Error(v8::String::New("shard command queue is full")));
+        thread->Wake();
+        return v8::Undefined();
+    }
+    
+    static v8::Handle<v8::Value> FlushMethod(const v8::Arguments& args)
+    {
+        v8::HandleScope scope;
+        ShardedHost *sharded = node::ObjectWrap::Unwrap<ShardedHost>(args.This());
+        ServiceCommand command;
+        ::memset(&command, 0, sizeof(ServiceCommand));
+        command.type = ServiceCommand::FLUSH;
+        for (size_t i = 0; i < sharded->threads.size(); i++)
+        {
+            if (sharded->threads[i]->Post(command))
+                sharded->threads[i]->Wake();
+        }
+        return v8::Undefined();
+    }
+    
+    static v8::Handle<v8::Value> ShardCount(const v8::Arguments& args)
+    {
+        v8::HandleScope scope;
+        ShardedHost *sharded = node::ObjectWrap::Unwrap<ShardedHost>(args.This());
+        return scope.Close(v8::Integer::New(sharded->threads.size()));
+    }
+    
+    static v8::Handle<v8::Value> GetAddress(const v8::Arguments& args)
+    {
+        v8::HandleScope scope;
+        ShardedHost *sharded = node::ObjectWrap::Unwrap<ShardedHost>(args.This());
+        return scope.Close(Address::WrapAddress(sharded->address));
+    }
+};
+
 }
 
 v8::Persistent<v8::FunctionTemplate> enet::Packet::s_ct;
+std::map<ENetPacket *, v8::Persistent<v8::Object> > enet::Packet::pinnedBuffers;
 v8::Persistent<v8::FunctionTemplate> enet::Address::s_ct;
+std::map<std::string, enet::Address::ResolveRequest *> enet::Address::pendingResolves;
+v8::Persistent<v8::FunctionTemplate> enet::StreamWindow::s_ct;
 v8::Persistent<v8::FunctionTemplate> enet::Peer::s_ct;
+enet_uint32 enet::Peer::statsData[enet::Peer::kStatCount];
+v8::Persistent<v8::Object> enet::Peer::statsObject;
 v8::Persistent<v8::FunctionTemplate> enet::Event::s_ct;
 v8::Persistent<v8::FunctionTemplate> enet::Host::s_ct;
+v8::Persistent<v8::FunctionTemplate> enet::ShardedHost::s_ct;
+
+namespace enet
+{
+
+// poolStats() -- counters for the allocator enet's packets come from.
+static v8::Handle<v8::Value> GetPoolStats(const v8::Arguments& args)
+{
+    v8::HandleScope scope;
+    struct PoolStats stats;
+    PoolGetStats(&stats);
+    v8::Local<v8::Object> result = v8::Object::New();
+    result->Set(v8::String::NewSymbol("hits"), v8::Number::New(stats.hits));
+    result->Set(v8::String::NewSymbol("misses"), v8::Number::New(stats.misses));
+    result->Set(v8::String::NewSymbol("bytesCached"), v8::Number::New(stats.bytesCached));
+    result->Set(v8::String::NewSymbol("bytesInUse"), v8::Number::New(stats.bytesInUse));
+    result->Set(v8::String::NewSymbol("limit"), v8::Number::New(stats.limit));
+    return scope.Close(result);
+}
+
+// setPoolLimit(bytes) -- caps how much freed memory the pool holds on to.
+static v8::Handle<v8::Value> SetPoolLimitJS(const v8::Arguments& args)
+{
+    v8::HandleScope scope;
+    if (args.Length() < 1 || !args[0]->IsNumber())
+        return v8::ThrowException(v8::Exception::Error(v8::String::New("setPoolLimit requires a byte count")));
+    PoolSetLimit((size_t) args[0]->NumberValue());
+    return v8::Undefined();
+}
+
+// packetStats() -- live, bytes, oldest (ms), tracked and destroyed counts
+// from the packet leak tracker.
+static v8::Handle<v8::Value> GetPacketStatsJS(const v8::Arguments& args)
+{
+    v8::HandleScope scope;
+    PacketStats stats;
+    GetPacketStats(&stats);
+    v8::Local<v8::Object> result = v8::Object::New();
+    result->Set(v8::String::NewSymbol("live"), v8::Number::New(stats.live));
+    result->Set(v8::String::NewSymbol("bytes"), v8::Number::New(stats.bytes));
+    result->Set(v8::String::NewSymbol("oldest"), v8::Number::New(stats.oldest));
+    result->Set(v8::String::NewSymbol("tracked"), v8::Number::New(stats.tracked));
+    result->Set(v8::String::NewSymbol("destroyed"), v8::Number::New(stats.destroyed));
+    return scope.Close(result);
+}
+
+// trackPackets(enabled) -- turns the packet leak tracker on or off.
+static v8::Handle<v8::Value> TrackPacketsJS(const v8::Arguments& args)
+{
+    v8::HandleScope scope;
+    TrackPackets(args.Length() > 0 && args[0]->BooleanValue());
+    return v8::Undefined();
+}
+
+}
 
 extern "C"
 {
@@ -890,8 +4041,20 @@ extern "C"
         enet::Event::Init(target);
         enet::Host::Init(target);
         enet::Peer::Init(target);
+        enet::StreamWindow::Init(target);
+        enet::ShardedHost::Init(target);
+        
+        NODE_SET_METHOD(target, "poolStats", enet::GetPoolStats);
+        NODE_SET_METHOD(target, "setPoolLimit", enet::SetPoolLimitJS);
+        NODE_SET_METHOD(target, "packetStats", enet::GetPacketStatsJS);
+        NODE_SET_METHOD(target, "trackPackets", enet::TrackPacketsJS);
         
-        enet_initialize();
+        ENetCallbacks callbacks;
+        ::memset(&callbacks, 0, sizeof(ENetCallbacks));
+        callbacks.malloc = enet::PoolAlloc;
+        callbacks.free = enet::PoolFree;
+        enet_initialize_with_callbacks(ENET_VERSION, &callbacks);
+        enet::Crc32cInit();
     }
     
     NODE_MODULE(enetnat, init);
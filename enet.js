@@ -3,15 +3,21 @@
 
 
 var util = require('util');
-var timers = require('timers');
 var events = require('events');
-var IOWatcher = process.binding('io_watcher').IOWatcher;
+var Stream = require('stream').Stream;
 var enetnat = require('./enetnat');
 
 module.exports.Address = enetnat.Address;
 module.exports.Peer = enetnat.Peer;
 module.exports.Packet = enetnat.Packet;
 module.exports.NatHost = enetnat.Host;
+module.exports.poolStats = enetnat.poolStats;
+module.exports.setPoolLimit = enetnat.setPoolLimit;
+module.exports.packetStats = enetnat.packetStats;
+module.exports.trackPackets = enetnat.trackPackets;
+
+// Maximum number of events pulled out of enet per native call.
+var BATCH_SIZE = 64;
 
 function Host()
 {
@@ -40,53 +46,78 @@ function Host()
     {
         throw Error('expected between 2 and 5 arguments')
     }
-    self.watcher = new IOWatcher();
     self.runloop = function() {
         try
         {
-            var event = self.host.service(0);
-            while (event != null)
+            // Events come back in batches; info holds type, channelID and
+            // data for each one. Messages with a route() have already gone
+            // to their handlers and aren't in the batch.
+            if (self.direct)
+            {
+                // setHandlers(): the native side calls the handlers itself.
+                while (self.host.dispatch(BATCH_SIZE, 0) == BATCH_SIZE)
+                    ;
+                return;
+            }
+            var batch;
+            do
             {
-                switch (event.type())
+                batch = self.host.serviceBatch(BATCH_SIZE, 0);
+                var info = batch.info;
+                for (var i = 0; i < batch.count; i++)
                 {
-                case enetnat.Event.TYPE_NONE:
-                    break;
-                    
-                case enetnat.Event.TYPE_CONNECT:
-                    self.emit('connect', event.peer(), event.data());
-                    break;
-                    
-                case enetnat.Event.TYPE_DISCONNECT:
-                    self.emit('disconnect', event.peer(), event.data());
-                    break;
-                    
-                case enetnat.Event.TYPE_RECEIVE:
-                    self.emit('message', event.peer(), event.packet(), event.channelID(), event.data());
-                    break;
-                }
+                    var type = info[i * 3];
+                    var channelID = info[i * 3 + 1];
+                    var data = info[i * 3 + 2];
+                    switch (type)
+                    {
+                    case enetnat.Event.TYPE_NONE:
+                        break;
+
+                    case enetnat.Event.TYPE_CONNECT:
+                        self.emit('connect', batch.peers[i], data);
+                        break;
+
+                    case enetnat.Event.TYPE_DISCONNECT:
+                        self.emit('disconnect', batch.peers[i], data);
+                        break;
 
-                event = self.host.service(0);
+                    case enetnat.Event.TYPE_RECEIVE:
+                        self.emit('message', batch.peers[i], batch.packets[i], channelID, data);
+                        break;
+                    }
+                }
             }
+            while (batch.more);
         }
         catch (e)
         {
             self.emit('error', e);
         }
+        finally
+        {
+            // Acknowledgements free stream chunks; writers waiting on
+            // their window may go on.
+            if (waitingStreams.length > 0)
+                checkStreams();
+        }
     };
-    self.watcher.callback = self.runloop;
-    self.watcher.host = self;
+    self.direct = false;
     self.watcher_running = false;
 }
 
 util.inherits(Host, events.EventEmitter);
 
-Host.prototype.start_watcher = function()
+// With threaded set, enet itself runs on a native thread, so protocol
+// timing doesn't depend on how busy the JS event loop is.
+Host.prototype.start_watcher = function(threaded)
 {
     if (!this.watcher_running)
     {
-        this.watcher.set(this.host.fd(), true, false);
-        this.watcher.start();
-        this.intervalId = timers.setInterval(this.runloop, 100);
+        // The native watcher runs the loop when the socket is readable and
+        // when enet's next retransmit/ping/timeout is due (or, when threaded,
+        // when the thread has events for us).
+        this.host.startWatcher(this.runloop, !!threaded);
         this.watcher_running = true;
     }
 }
@@ -95,8 +126,7 @@ Host.prototype.stop_watcher = function()
 {
     if (this.watcher_running)
     {
-        this.watcher.stop();
-        timers.clearInterval(this.intervalId);
+        this.host.stopWatcher();
         this.watcher_running = false;
     }
 }
@@ -114,6 +144,11 @@ Host.prototype.broadcast = function()
     return this.host.broadcast.apply(this.host, arguments);
 }
 
+Host.prototype.broadcastMany = function()
+{
+    return this.host.broadcastMany.apply(this.host, arguments);
+}
+
 Host.prototype.address = function()
 {
     return this.host.address();
@@ -124,6 +159,16 @@ Host.prototype.peerCount = function()
     return this.host.peerCount();
 }
 
+Host.prototype.peerLimit = function()
+{
+    return this.host.peerLimit();
+}
+
+Host.prototype.setPeerLimit = function(limit)
+{
+    return this.host.setPeerLimit(limit);
+}
+
 Host.prototype.channelLimit = function()
 {
     return this.host.channelLimit();
@@ -159,14 +204,731 @@ Host.prototype.flush = function()
     return this.host.flush();
 }
 
-Host.prototype.checkEvents = function()
+Host.prototype.checkEvents = function(reuseEvent)
+{
+    return this.host.checkEvents(!!reuseEvent);
+}
+
+// With reuseEvent set, service() and checkEvents() return the same Event
+// object each time; it is overwritten by the next such call.
+Host.prototype.service = function(timeout, reuseEvent)
+{
+    return this.host.service(timeout, !!reuseEvent);
+}
+
+Host.prototype.stats = function()
+{
+    return this.host.stats();
+}
+
+Host.prototype.peerStats = function()
+{
+    return this.host.peerStats();
+}
+
+Host.prototype.setCompression = function(kind)
+{
+    return this.host.setCompression(kind);
+}
+
+Host.prototype.compressionStats = function()
+{
+    return this.host.compressionStats();
+}
+
+Host.prototype.setChecksum = function(kind)
+{
+    return this.host.setChecksum(kind);
+}
+
+// Messages on `channel' starting with `type' go to handler(peers, payloads)
+// in batches, without a 'message' event; payloads have the type stripped.
+Host.prototype.route = function(channel, type, handler)
+{
+    return this.host.route(channel, type, handler);
+}
+
+Host.prototype.setRouteHeader = function(kind)
+{
+    return this.host.setRouteHeader(kind);
+}
+
+Host.prototype.setConnectRateLimit = function(perSecond, burst)
+{
+    return this.host.setConnectRateLimit.apply(this.host, arguments);
+}
+
+Host.prototype.setConnectCookies = function(enabled)
+{
+    return this.host.setConnectCookies(enabled);
+}
+
+Host.prototype.allowConnections = function(cidr)
+{
+    return this.host.allowConnections(cidr);
+}
+
+Host.prototype.denyConnections = function(cidr)
+{
+    return this.host.denyConnections(cidr);
+}
+
+Host.prototype.clearConnectionRules = function()
+{
+    return this.host.clearConnectionRules();
+}
+
+Host.prototype.admissionStats = function()
+{
+    return this.host.admissionStats();
+}
+
+// addRawFilter(offset, value[, mask]): datagrams whose bytes from offset
+// match the value Buffer go to the raw handler instead of enet.
+Host.prototype.addRawFilter = function(offset, value, mask)
+{
+    return this.host.addRawFilter(offset, value, mask);
+}
+
+Host.prototype.clearRawFilters = function()
+{
+    return this.host.clearRawFilters();
+}
+
+// handler(addresses, payloads) is called with each batch of matched datagrams.
+Host.prototype.setRawHandler = function(handler)
+{
+    return this.host.setRawHandler(handler || null);
+}
+
+Host.prototype.sendRaw = function(address, buffer)
+{
+    return this.host.sendRaw(address, buffer);
+}
+
+Host.prototype.rawStats = function()
+{
+    return this.host.rawStats();
+}
+
+// simulateLink({loss, lossBurst, latency, jitter, jitterDistribution,
+// duplicate, reorder, seed}) impairs incoming traffic; null turns it off.
+Host.prototype.simulateLink = function(conditions)
+{
+    return this.host.simulateLink(conditions || null);
+}
+
+Host.prototype.linkStats = function()
+{
+    return this.host.linkStats();
+}
+
+// startCapture(path[, bytes]) records incoming datagrams and outgoing
+// packets into a ring of about bytes (default 64MB).
+Host.prototype.startCapture = function(path, bytes)
+{
+    return this.host.startCapture(path, bytes);
+}
+
+Host.prototype.stopCapture = function()
+{
+    return this.host.stopCapture();
+}
+
+Host.prototype.captureStats = function()
+{
+    return this.host.captureStats();
+}
+
+// Plays back the incoming traffic in a trace made by startCapture().
+// options.speed (default 1) scales the original timing, with 0 meaning as
+// fast as possible; options.keepAddresses sends from the recorded source
+// addresses rather than 127.1.x.x stand-ins. callback(err, stats) runs
+// when every datagram has been sent.
+Host.prototype.replay = function(path, options, callback)
+{
+    if (typeof options == 'function')
+    {
+        callback = options;
+        options = {};
+    }
+    options = options || {};
+    var speed = options.speed === undefined ? 1 : options.speed;
+    this.host.startReplay(path, speed, !!options.keepAddresses);
+    if (!callback)
+        return;
+    var self = this;
+    var poll = setInterval(function() {
+        var stats = self.host.replayStats();
+        if (stats.done)
+        {
+            clearInterval(poll);
+            callback(null, stats);
+        }
+    }, 50);
+}
+
+Host.prototype.stopReplay = function()
+{
+    return this.host.stopReplay();
+}
+
+Host.prototype.replayStats = function()
+{
+    return this.host.replayStats();
+}
+
+// setScheduling({priorities: [class per channel], quantum, budget, tick})
+// queues sends natively and releases them by priority class, fairly
+// across peers, within a byte budget per tick; null turns it off.
+Host.prototype.setScheduling = function(options)
+{
+    return this.host.setScheduling(options || null);
+}
+
+Host.prototype.schedulerStats = function()
+{
+    return this.host.schedulerStats();
+}
+
+// acceptStreams(channel[, type]) -- write streams arriving on channel
+// (see Peer.createWriteStream) are announced with a 'stream' event,
+// stream(peer, readStream). type must match the writer's, and be below
+// 128 so that it reads the same with either route header.
+Host.prototype.acceptStreams = function(channel, type)
+{
+    var self = this;
+    if (type === undefined)
+        type = STREAM_TYPE;
+    this.host.route(channel, type, function(peers, payloads) {
+        for (var i = 0; i < peers.length; i++)
+            receiveChunk(self, peers[i], payloads[i]);
+    });
+    if (!this.acceptingStreams)
+    {
+        this.acceptingStreams = true;
+        this.on('disconnect', abortReadStreams);
+    }
+}
+
+Host.prototype.serviceBatch = function(maxEvents, timeout)
+{
+    return this.host.serviceBatch(maxEvents, timeout);
+}
+
+// Delivers events by calling handlers.onConnect(peer, data),
+// onDisconnect(peer, data) and onMessage(peer, buffer, channel) directly
+// instead of emitting them, with each message as a Buffer over the
+// received data. Pass null to go back to events.
+Host.prototype.setHandlers = function(handlers)
+{
+    handlers = handlers || {};
+    this.host.setHandlers(handlers.onConnect || null,
+        handlers.onDisconnect || null, handlers.onMessage || null);
+    this.direct = !!(handlers.onConnect || handlers.onDisconnect || handlers.onMessage);
+}
+
+Host.prototype.dispatch = function(maxEvents, timeout)
+{
+    return this.host.dispatch(maxEvents, timeout);
+}
+
+module.exports.Host = Host;
+
+// Streams -- objects of any size over a reliable channel. A write stream
+// sends its data in chunks that each fit in one datagram, and keeps at
+// most about highWaterMark bytes with enet at a time: write() returns
+// false past that, and 'drain' follows once acknowledgements bring it
+// down to lowWaterMark. Each chunk carries a header: the route type, the
+// stream id (little-endian, 32 bits) and a flag byte.
+var STREAM_TYPE = 0x7f;
+var STREAM_DATA = 0;
+var STREAM_END = 1;
+var STREAM_ABORT = 2;
+var STREAM_HEADER_LENGTH = 5;
+var STREAM_HIGH_WATER_MARK = 256 * 1024;
+var EMPTY_BUFFER = new Buffer(0);
+
+// Write streams waiting for their window to open, checked after each pass
+// of any host's runloop.
+var waitingStreams = [];
+
+function checkStreams()
+{
+    var streams = waitingStreams;
+    waitingStreams = [];
+    for (var i = 0; i < streams.length; i++)
+    {
+        streams[i].waiting = false;
+        streams[i].proceed();
+    }
+}
+
+// The route type followed by the header receiveChunk() reads.
+function streamHeader(type, id, flags)
+{
+    var header = new Buffer(STREAM_HEADER_LENGTH + 1);
+    header[0] = type;
+    header[1] = id & 0xff;
+    header[2] = (id >>> 8) & 0xff;
+    header[3] = (id >>> 16) & 0xff;
+    header[4] = (id >>> 24) & 0xff;
+    header[5] = flags;
+    return header;
+}
+
+// stats() throws once the peer has disconnected.
+function peerConnected(peer)
+{
+    try
+    {
+        peer.stats();
+        return true;
+    }
+    catch (e)
+    {
+        return false;
+    }
+}
+
+// WriteStream(peer, channel[, options]) -- see Peer.createWriteStream.
+function WriteStream(peer, channel, options)
+{
+    Stream.call(this);
+    options = options || {};
+    var type = options.type === undefined ? STREAM_TYPE : options.type;
+    this.peer = peer;
+    this.channel = channel;
+    this.highWaterMark = options.highWaterMark || STREAM_HIGH_WATER_MARK;
+    this.lowWaterMark = options.lowWaterMark === undefined
+        ? this.highWaterMark >> 1 : options.lowWaterMark;
+    peer._nextStreamId = ((peer._nextStreamId || 0) + 1) >>> 0;
+    this.id = peer._nextStreamId;
+    this.dataHeader = streamHeader(type, this.id, STREAM_DATA);
+    this.endHeader = streamHeader(type, this.id, STREAM_END);
+    this.abortHeader = streamHeader(type, this.id, STREAM_ABORT);
+    this.window = new enetnat.StreamWindow();
+    // [buffer, offset] pairs not yet handed to enet.
+    this.pending = [];
+    this.writable = true;
+    this.ending = false;
+    this.ended = false;
+    this.closed = false;
+    this.needDrain = false;
+    this.waiting = false;
+}
+
+util.inherits(WriteStream, Stream);
+
+WriteStream.prototype.write = function(data, encoding)
+{
+    if (!this.writable)
+        throw new Error('stream is not writable');
+    if (!Buffer.isBuffer(data))
+        data = new Buffer(data, encoding);
+    if (data.length > 0)
+        this.pending.push([data, 0]);
+    this.send();
+    if (this.pending.length == 0 && this.window.outstanding() < this.highWaterMark)
+        return true;
+    this.needDrain = true;
+    this.wait();
+    return false;
+}
+
+WriteStream.prototype.end = function(data, encoding)
+{
+    if (data)
+        this.write(data, encoding);
+    if (!this.writable)
+        return;
+    this.writable = false;
+    this.ending = true;
+    this.send();
+    this.wait();
+}
+
+WriteStream.prototype.destroySoon = WriteStream.prototype.end;
+
+// Abandons the stream; the reader gets an 'error'.
+WriteStream.prototype.destroy = function()
+{
+    if (this.closed)
+        return;
+    if (!this.ended)
+    {
+        try
+        {
+            this.peer.sendStream(this.channel, this.window, this.abortHeader, EMPTY_BUFFER, 0, 0);
+        }
+        catch (e)
+        {
+            // The peer is gone; there is nobody to tell.
+        }
+    }
+    this.ended = true;
+    this.close();
+}
+
+// Hands pending data to enet while the window has room, then the end
+// marker once everything else has gone.
+WriteStream.prototype.send = function()
+{
+    try
+    {
+        while (this.pending.length > 0)
+        {
+            var room = this.highWaterMark - this.window.outstanding();
+            if (room <= 0)
+                break;
+            var next = this.pending[0];
+            next[1] += this.peer.sendStream(this.channel, this.window, this.dataHeader,
+                next[0], next[1], room);
+            if (next[1] < next[0].length)
+                break;
+            this.pending.shift();
+        }
+        if (this.ending && !this.ended && this.pending.length == 0)
+        {
+            this.peer.sendStream(this.channel, this.window, this.endHeader, EMPTY_BUFFER, 0, 0);
+            this.ended = true;
+        }
+    }
+    catch (e)
+    {
+        this.fail(e);
+    }
+}
+
+WriteStream.prototype.wait = function()
+{
+    if (this.closed || this.waiting)
+        return;
+    this.waiting = true;
+    waitingStreams.push(this);
+    // Once ended, wait for the last acknowledgement. If the window is
+    // already there, nothing will wake the host for it.
+    if (!this.window.wakeAt(this.ended ? 0 : this.lowWaterMark))
+        process.nextTick(checkStreams);
+}
+
+WriteStream.prototype.proceed = function()
+{
+    if (this.closed)
+        return;
+    var outstanding = this.window.outstanding();
+    if (this.ended)
+    {
+        // A reset peer frees its packets too.
+        if (outstanding > 0)
+            this.wait();
+        else if (peerConnected(this.peer))
+            this.close();
+        else
+            this.fail(new Error('peer disconnected before the stream was acknowledged'));
+        return;
+    }
+    if (outstanding > this.lowWaterMark)
+    {
+        this.wait();
+        return;
+    }
+    this.send();
+    if (this.closed)
+        return;
+    if (this.ended || this.pending.length > 0 || this.window.outstanding() >= this.highWaterMark)
+    {
+        this.wait();
+        return;
+    }
+    if (this.needDrain)
+    {
+        this.needDrain = false;
+        this.emit('drain');
+    }
+}
+
+WriteStream.prototype.fail = function(e)
+{
+    this.ended = true;
+    this.emit('error', e);
+    this.close();
+}
+
+WriteStream.prototype.close = function()
+{
+    if (this.closed)
+        return;
+    this.closed = true;
+    this.writable = false;
+    this.pending = [];
+    this.emit('close');
+}
+
+// ReadStream -- the receiving end, handed out by Host 'stream' events.
+// 'data' events are Buffers over the received packets, so they share
+// enet's pooled memory rather than being copied; a paused stream holds on
+// to them until it is resumed.
+function ReadStream(peer, id)
+{
+    Stream.call(this);
+    this.peer = peer;
+    this.id = id;
+    this.readable = true;
+    this.paused = false;
+    // Chunks held while paused; null marks the end.
+    this.buffered = [];
+}
+
+util.inherits(ReadStream, Stream);
+
+ReadStream.prototype.pause = function()
+{
+    this.paused = true;
+}
+
+ReadStream.prototype.resume = function()
+{
+    this.paused = false;
+    while (!this.paused && this.buffered.length > 0)
+        this.deliver(this.buffered.shift());
+}
+
+ReadStream.prototype.destroy = function()
+{
+    if (!this.readable)
+        return;
+    this.readable = false;
+    this.buffered = [];
+    this.emit('close');
+}
+
+ReadStream.prototype.push = function(chunk)
+{
+    if (!this.readable)
+        return;
+    if (this.paused || this.buffered.length > 0)
+        this.buffered.push(chunk);
+    else
+        this.deliver(chunk);
+}
+
+ReadStream.prototype.deliver = function(chunk)
+{
+    if (chunk !== null)
+    {
+        this.emit('data', chunk);
+        return;
+    }
+    this.readable = false;
+    this.emit('end');
+    this.emit('close');
+}
+
+ReadStream.prototype.abort = function(reason)
+{
+    if (!this.readable)
+        return;
+    this.readable = false;
+    this.buffered = [];
+    this.emit('error', new Error(reason));
+    this.emit('close');
+}
+
+function receiveChunk(host, peer, payload)
+{
+    if (payload.length < STREAM_HEADER_LENGTH)
+        return;
+    var id = (payload[0] | (payload[1] << 8) | (payload[2] << 16) | (payload[3] << 24)) >>> 0;
+    var flags = payload[4];
+    var streams = peer._readStreams || (peer._readStreams = {});
+    var stream = streams[id];
+    if (!stream)
+    {
+        if (flags == STREAM_ABORT)
+            return;
+        stream = streams[id] = new ReadStream(peer, id);
+        host.emit('stream', peer, stream);
+    }
+    if (payload.length > STREAM_HEADER_LENGTH)
+        stream.push(payload.slice(STREAM_HEADER_LENGTH, payload.length));
+    if (flags == STREAM_END)
+    {
+        delete streams[id];
+        stream.push(null);
+    }
+    else if (flags == STREAM_ABORT)
+    {
+        delete streams[id];
+        stream.abort('stream aborted by the sender');
+    }
+}
+
+function abortReadStreams(peer)
+{
+    var streams = peer._readStreams;
+    if (!streams)
+        return;
+    delete peer._readStreams;
+    for (var id in streams)
+        streams[id].abort('peer disconnected');
+}
+
+// createWriteStream(channel[, options]) -- a writable Stream to this peer.
+// options: type (route type, default 0x7f), highWaterMark (default 256K)
+// and lowWaterMark (default half of it). The channel should only carry
+// streams, since their chunks are sent reliably and in order.
+enetnat.Peer.prototype.createWriteStream = function(channel, options)
+{
+    return new WriteStream(this, channel, options);
+}
+
+module.exports.WriteStream = WriteStream;
+module.exports.ReadStream = ReadStream;
+
+// ShardedHost -- like Host, but runs `shards' enet hosts on the same port,
+// each on its own native thread. Peers are ShardPeer objects.
+function ShardedHost(address, shards, peerCount, channelLimit, incomingBandwidth, outgoingBandwidth)
+{
+    events.EventEmitter.call(this);
+    var self = this;
+
+    self.host = new enetnat.ShardedHost(address, shards, peerCount,
+        channelLimit || 0, incomingBandwidth || 0, outgoingBandwidth || 0);
+    self.peers = {};
+    self.running = false;
+    self.dispatch = function(batch) {
+        var info = batch.info;
+        for (var i = 0; i < batch.count; i++)
+        {
+            var base = i * 8;
+            var type = info[base];
+            var key = info[base + 1] + ':' + info[base + 2];
+            var peer;
+            try
+            {
+                switch (type)
+                {
+                case enetnat.Event.TYPE_CONNECT:
+                    peer = new ShardPeer(self, info[base + 1], info[base + 2],
+                        info[base + 3], info[base + 6], info[base + 7]);
+                    self.peers[key] = peer;
+                    self.emit('connect', peer, info[base + 5]);
+                    break;
+
+                case enetnat.Event.TYPE_DISCONNECT:
+                    peer = self.peers[key];
+                    if (peer)
+                    {
+                        delete self.peers[key];
+                        peer.connected = false;
+                        self.emit('disconnect', peer, info[base + 5]);
+                    }
+                    break;
+
+                case enetnat.Event.TYPE_RECEIVE:
+                    peer = self.peers[key];
+                    if (peer)
+                        self.emit('message', peer, batch.packets[i], info[base + 4], info[base + 5]);
+                    break;
+                }
+            }
+            catch (e)
+            {
+                self.emit('error', e);
+            }
+        }
+    };
+}
+
+util.inherits(ShardedHost, events.EventEmitter);
+
+ShardedHost.prototype.start_watcher = function()
+{
+    if (!this.running)
+    {
+        this.host.start(this.dispatch);
+        this.running = true;
+    }
+}
+
+ShardedHost.prototype.stop_watcher = function()
+{
+    if (this.running)
+    {
+        this.host.stop();
+        this.running = false;
+    }
+}
+
+ShardedHost.prototype.address = function()
+{
+    return this.host.address();
+}
+
+ShardedHost.prototype.shardCount = function()
+{
+    return this.host.shardCount();
+}
+
+ShardedHost.prototype.flush = function()
+{
+    return this.host.flush();
+}
+
+// A connection on a ShardedHost. Messages arrive as Buffers rather than
+// Packets, and send() takes a Buffer or a string.
+function ShardPeer(host, shard, peerID, connectID, addressHost, addressPort)
+{
+    this.host = host;
+    this.shard = shard;
+    this.peerID = peerID;
+    this.connectID = connectID;
+    this.addressHost = addressHost;
+    this.addressPort = addressPort;
+    this.connected = true;
+}
+
+ShardPeer.prototype.send = function(channel, data, flags)
+{
+    if (typeof data == 'string')
+        data = new Buffer(data);
+    this.host.host.send(this.shard, this.peerID, this.connectID, channel, data, flags || 0);
+}
+
+ShardPeer.prototype._disconnect = function(data, mode)
+{
+    this.host.host.disconnect(this.shard, this.peerID, this.connectID, data || 0, mode);
+}
+
+ShardPeer.prototype.disconnect = function(data)
+{
+    this._disconnect(data, enetnat.ShardedHost.DISCONNECT);
+}
+
+ShardPeer.prototype.disconnectLater = function(data)
+{
+    this._disconnect(data, enetnat.ShardedHost.DISCONNECT_LATER);
+}
+
+// These two don't produce a disconnect event, so forget the peer here.
+ShardPeer.prototype.disconnectNow = function(data)
+{
+    this._disconnect(data, enetnat.ShardedHost.DISCONNECT_NOW);
+    delete this.host.peers[this.shard + ':' + this.peerID];
+    this.connected = false;
+}
+
+ShardPeer.prototype.reset = function()
 {
-    return this.host.checkEvents();
+    this._disconnect(0, enetnat.ShardedHost.RESET);
+    delete this.host.peers[this.shard + ':' + this.peerID];
+    this.connected = false;
 }
 
-Host.prototype.service = function(timeout)
+ShardPeer.prototype.address = function()
 {
-    return this.host.service(timeout);
+    return new enetnat.Address(this.addressHost, this.addressPort);
 }
 
-module.exports.Host = Host;
\ No newline at end of file
+module.exports.ShardedHost = ShardedHost;
@@ -0,0 +1,104 @@
+/* inject.cc -- feeding datagrams back into an enet host.
+   Copyright (C) 2011 Memeo, Inc. */
+
+#include <cstring>
+#include <cstdio>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "inject.h"
+
+namespace enet
+{
+
+// The address a socket is bound to, as an ENetAddress; an unspecified
+// address is taken to mean loopback.
+static bool SocketAddress(ENetSocket socket, ENetAddress *address)
+{
+    struct sockaddr_in sin;
+    socklen_t length = sizeof(sin);
+    if (::getsockname(socket, (struct sockaddr *) &sin, &length) != 0 || sin.sin_family != AF_INET)
+        return false;
+    address->host = sin.sin_addr.s_addr;
+    if (address->host == htonl(INADDR_ANY))
+        address->host = htonl(INADDR_LOOPBACK);
+    address->port = ntohs(sin.sin_port);
+    return true;
+}
+
+Reinjector::Reinjector()
+    : socket(ENET_SOCKET_NULL), tag(0)
+{
+    ::memset(&self, 0, sizeof(ENetAddress));
+    ::memset(&target, 0, sizeof(ENetAddress));
+}
+
+Reinjector::~Reinjector()
+{
+    Close();
+}
+
+bool Reinjector::Open(ENetHost *host)
+{
+    if (socket != ENET_SOCKET_NULL)
+        return true;
+    if (!SocketAddress(host->socket, &target))
+        return false;
+    socket = enet_socket_create(ENET_SOCKET_TYPE_DATAGRAM);
+    if (socket == ENET_SOCKET_NULL)
+        return false;
+    ENetAddress loopback;
+    loopback.host = htonl(INADDR_LOOPBACK);
+    loopback.port = 0;
+    if (enet_socket_bind(socket, &loopback) < 0 || !SocketAddress(socket, &self))
+    {
+        Close();
+        return false;
+    }
+    // Only needs to stop stray loopback traffic being taken for ours.
+    FILE *random = fopen("/dev/urandom", "rb");
+    if (random == NULL || fread(&tag, sizeof(tag), 1, random) != 1)
+        tag = (enet_uint32) time(NULL) ^ (enet_uint32) (size_t) this;
+    if (random != NULL)
+        fclose(random);
+    return true;
+}
+
+void Reinjector::Close()
+{
+    if (socket == ENET_SOCKET_NULL)
+        return;
+    enet_socket_destroy(socket);
+    socket = ENET_SOCKET_NULL;
+}
+
+bool Reinjector::Send(const ENetAddress& from, const void *data, size_t length)
+{
+    enet_uint8 header[kHeaderLength];
+    ::memcpy(header, &tag, 4);
+    ::memcpy(header + 4, &from.host, 4);
+    ::memcpy(header + 8, &from.port, 2);
+    ENetBuffer buffers[2];
+    buffers[0].data = header;
+    buffers[0].dataLength = kHeaderLength;
+    buffers[1].data = (void *) data;
+    buffers[1].dataLength = length;
+    return enet_socket_send(socket, &target, buffers, 2) > 0;
+}
+
+int Reinjector::Unwrap(ENetHost *host)
+{
+    if (socket == ENET_SOCKET_NULL
+        || host->receivedAddress.host != self.host || host->receivedAddress.port != self.port)
+        return 0;
+    if (host->receivedDataLength < kHeaderLength || ::memcmp(host->receivedData, &tag, 4) != 0)
+        return -1;
+    ::memcpy(&host->receivedAddress.host, host->receivedData + 4, 4);
+    ::memcpy(&host->receivedAddress.port, host->receivedData + 8, 2);
+    host->receivedData += kHeaderLength;
+    host->receivedDataLength -= kHeaderLength;
+    return 1;
+}
+
+}
@@ -0,0 +1,50 @@
+/* inject.h -- feeding datagrams back into an enet host.
+   Copyright (C) 2011 Memeo, Inc. */
+
+#ifndef ENET_JS_INJECT_H
+#define ENET_JS_INJECT_H
+
+#include <enet/enet.h>
+
+namespace enet
+{
+
+// Delivers datagrams to a host as if they had come from some other
+// address. Each one is sent to the host socket from a private loopback
+// socket, prefixed with a random tag and the address it should appear to
+// come from; an interceptor calls Unwrap() to strip that off again before
+// enet parses it. Going through the real socket means threaded and
+// unthreaded hosts behave the same.
+class Reinjector
+{
+public:
+    enum { kHeaderLength = 10 };
+
+    Reinjector();
+    ~Reinjector();
+
+    // host must already be bound. Returns false on failure.
+    bool Open(ENetHost *host);
+    void Close();
+
+    // May be called from any thread. Returns false if the send failed.
+    bool Send(const ENetAddress& from, const void *data, size_t length);
+
+    // For the datagram in host->receivedData: 0 if it isn't from this
+    // injector, 1 if it was and receivedAddress and receivedData now
+    // describe the original, or -1 if it claims to be but is malformed.
+    int Unwrap(ENetHost *host);
+
+private:
+    ENetSocket socket;
+    ENetAddress self;       // the loopback socket, as the host sees it
+    ENetAddress target;     // the host socket
+    enet_uint32 tag;
+
+    Reinjector(const Reinjector&);
+    Reinjector& operator=(const Reinjector&);
+};
+
+}
+
+#endif
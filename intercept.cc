@@ -0,0 +1,75 @@
+/* intercept.cc -- sharing enet's per-datagram intercept hook.
+   Copyright (C) 2011 Memeo, Inc. */
+
+#include <map>
+#include <vector>
+#include <pthread.h>
+#include "intercept.h"
+
+namespace enet
+{
+
+struct OrderedInterceptor
+{
+    int order;
+    Interceptor *interceptor;
+};
+
+typedef std::vector<OrderedInterceptor> InterceptorList;
+
+// Read-locked for every intercepted datagram, write-locked to change.
+static pthread_rwlock_t lock = PTHREAD_RWLOCK_INITIALIZER;
+static std::map<ENetHost *, InterceptorList> interceptors;
+
+static int Dispatch(ENetHost *host, ENetEvent *event)
+{
+    int result = 0;
+    pthread_rwlock_rdlock(&lock);
+    std::map<ENetHost *, InterceptorList>::iterator it = interceptors.find(host);
+    if (it != interceptors.end())
+    {
+        for (size_t i = 0; i < it->second.size() && result == 0; i++)
+            result = it->second[i].interceptor->Intercept(host, event);
+    }
+    pthread_rwlock_unlock(&lock);
+    return result;
+}
+
+void AddInterceptor(ENetHost *host, Interceptor *interceptor, int order)
+{
+    pthread_rwlock_wrlock(&lock);
+    InterceptorList& list = interceptors[host];
+    InterceptorList::iterator position = list.begin();
+    while (position != list.end() && position->order <= order)
+        ++position;
+    OrderedInterceptor entry = { order, interceptor };
+    list.insert(position, entry);
+    host->intercept = Dispatch;
+    pthread_rwlock_unlock(&lock);
+}
+
+void RemoveInterceptor(ENetHost *host, Interceptor *interceptor)
+{
+    pthread_rwlock_wrlock(&lock);
+    std::map<ENetHost *, InterceptorList>::iterator it = interceptors.find(host);
+    if (it != interceptors.end())
+    {
+        InterceptorList& list = it->second;
+        for (InterceptorList::iterator i = list.begin(); i != list.end(); ++i)
+        {
+            if (i->interceptor == interceptor)
+            {
+                list.erase(i);
+                break;
+            }
+        }
+        if (list.empty())
+        {
+            interceptors.erase(it);
+            host->intercept = NULL;
+        }
+    }
+    pthread_rwlock_unlock(&lock);
+}
+
+}
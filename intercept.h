@@ -0,0 +1,44 @@
+/* intercept.h -- sharing enet's per-datagram intercept hook.
+   Copyright (C) 2011 Memeo, Inc. */
+
+#ifndef ENET_JS_INTERCEPT_H
+#define ENET_JS_INTERCEPT_H
+
+#include <enet/enet.h>
+
+namespace enet
+{
+
+// Something that wants a look at each datagram a host receives before enet
+// parses it. The datagram is in host->receivedData/receivedDataLength, from
+// host->receivedAddress. Return 0 to pass it on, 1 if it has been dealt
+// with (enet skips it, and reports *event if its type was set), or -1 on
+// error. Runs on whichever thread services the host.
+class Interceptor
+{
+public:
+    virtual ~Interceptor() { }
+    virtual int Intercept(ENetHost *host, ENetEvent *event) = 0;
+};
+
+// enet has room for a single intercept callback per host; these let
+// several Interceptors share it, called in the order they were added until
+// one returns non-zero. Interceptors run in ascending order of `order',
+// then in the order they were added. Hosts with none have no callback
+// installed. Safe to call while another thread services the host: once
+// RemoveInterceptor returns, the interceptor is no longer running and may
+// be deleted.
+enum InterceptOrder
+{
+    kInterceptReplay = -3,      // unwraps replayed traffic
+    kInterceptLink = -2,        // simulated network conditions
+    kInterceptCapture = -1,     // records what made it across the link
+    kInterceptDefault = 0
+};
+
+void AddInterceptor(ENetHost *host, Interceptor *interceptor, int order = kInterceptDefault);
+void RemoveInterceptor(ENetHost *host, Interceptor *interceptor);
+
+}
+
+#endif
@@ -0,0 +1,247 @@
+/* link.cc -- simulated network conditions for a host's incoming traffic.
+   Copyright (C) 2011 Memeo, Inc. */
+
+#include <cstring>
+#include <cmath>
+#include <stdint.h>
+#include <time.h>
+#include "link.h"
+
+namespace enet
+{
+
+static enet_uint32 Now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (enet_uint32) ts.tv_sec * 1000 + (enet_uint32) (ts.tv_nsec / 1000000);
+}
+
+LinkSimulator::LinkSimulator()
+    : lossBurstActive(false), randomState(0), cursor(0), running(false), started(false)
+{
+    pthread_mutex_init(&lock, NULL);
+    ::memset(&conditions, 0, sizeof(LinkConditions));
+    ::memset(&stats, 0, sizeof(LinkStats));
+    conditions.lossBurst = 1;
+    SetConditions(conditions);
+}
+
+LinkSimulator::~LinkSimulator()
+{
+    Stop();
+    pthread_mutex_destroy(&lock);
+}
+
+bool LinkSimulator::Start(ENetHost *host)
+{
+    if (started)
+        return true;
+    if (!injector.Open(host))
+        return false;
+    cursor = Now();
+    running = true;
+    if (pthread_create(&thread, NULL, Run, this) != 0)
+    {
+        running = false;
+        injector.Close();
+        return false;
+    }
+    started = true;
+    return true;
+}
+
+void LinkSimulator::Stop()
+{
+    if (!started)
+        return;
+    running = false;
+    pthread_join(thread, NULL);
+    started = false;
+    injector.Close();
+    for (size_t i = 0; i < kSlots; i++)
+    {
+        for (size_t j = 0; j < wheel[i].size(); j++)
+            delete wheel[i][j];
+        wheel[i].clear();
+    }
+}
+
+void LinkSimulator::SetConditions(const LinkConditions& c)
+{
+    pthread_mutex_lock(&lock);
+    conditions = c;
+    if (conditions.lossBurst < 1)
+        conditions.lossBurst = 1;
+    lossBurstActive = false;
+    if (c.seed != 0 || randomState == 0)
+    {
+        randomState = c.seed != 0 ? c.seed : ((uint64_t) time(NULL) << 32) ^ (uint64_t) (size_t) this;
+        randomState |= 1;
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+void LinkSimulator::GetStats(LinkStats *out)
+{
+    pthread_mutex_lock(&lock);
+    *out = stats;
+    pthread_mutex_unlock(&lock);
+}
+
+// xorshift64*, uniform on [0, 1).
+double LinkSimulator::Random()
+{
+    randomState ^= randomState >> 12;
+    randomState ^= randomState << 25;
+    randomState ^= randomState >> 27;
+    uint64_t x = randomState * 2685821657736338717ULL;
+    return (double) (x >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// Independent losses, or with lossBurst > 1 a two-state (Gilbert) model
+// that drops everything while in the bad state: it enters that state with
+// the probability that keeps the average loss rate at `loss', and leaves
+// it after lossBurst datagrams on average.
+bool LinkSimulator::Lose()
+{
+    double loss = conditions.loss;
+    if (loss <= 0)
+        return false;
+    if (loss >= 1)
+        return true;
+    double burst = conditions.lossBurst;
+    if (burst <= 1)
+        return Random() < loss;
+    if (lossBurstActive)
+        lossBurstActive = Random() >= 1 / burst;
+    else
+        lossBurstActive = Random() < loss / (burst * (1 - loss));
+    return lossBurstActive;
+}
+
+enet_uint32 LinkSimulator::SampleDelay()
+{
+    double delay = conditions.latency;
+    if (conditions.jitter > 0)
+    {
+        if (conditions.normalJitter)
+        {
+            // Box-Muller; 1 - Random() keeps the log argument above 0.
+            double u = 1 - Random(), v = Random();
+            delay += conditions.jitter * ::sqrt(-2 * ::log(u)) * ::cos(2 * M_PI * v);
+        }
+        else
+        {
+            delay += (Random() * 2 - 1) * conditions.jitter;
+        }
+    }
+    if (delay < 0)
+        delay = 0;
+    if (delay > kMaxDelay)
+        delay = kMaxDelay;
+    return (enet_uint32) (delay + 0.5);
+}
+
+// Called with the lock held.
+void LinkSimulator::Schedule(const ENetAddress& from, const enet_uint8 *data, size_t length,
+    enet_uint32 delay, enet_uint32 now)
+{
+    Delayed *d = new Delayed;
+    d->due = now + delay;
+    // The delivery thread may already be past `now'.
+    if ((int32_t) (d->due - cursor) < 0)
+        d->due = cursor;
+    d->from = from;
+    d->data.assign(data, data + length);
+    wheel[d->due % kSlots].push_back(d);
+}
+
+int LinkSimulator::Intercept(ENetHost *host, ENetEvent *event)
+{
+    // Back from the wheel: enet can have it as it is now.
+    int unwrapped = injector.Unwrap(host);
+    if (unwrapped != 0)
+        return unwrapped > 0 ? 0 : 1;
+
+    enet_uint32 now = Now();
+    int result = 1;
+    pthread_mutex_lock(&lock);
+    if (Lose())
+    {
+        stats.dropped++;
+        pthread_mutex_unlock(&lock);
+        return 1;
+    }
+    int copies = 1;
+    if (conditions.duplicate > 0 && Random() < conditions.duplicate)
+    {
+        copies = 2;
+        stats.duplicated++;
+    }
+    for (int i = 0; i < copies; i++)
+    {
+        enet_uint32 delay;
+        if (conditions.reorder > 0 && Random() < conditions.reorder)
+        {
+            delay = 0;
+            stats.reordered++;
+        }
+        else
+        {
+            delay = SampleDelay();
+        }
+        // Due now: the first copy can go straight through.
+        if (delay == 0 && i == 0)
+            result = 0;
+        else
+            Schedule(host->receivedAddress, host->receivedData, host->receivedDataLength, delay, now);
+        stats.passed++;
+    }
+    pthread_mutex_unlock(&lock);
+    return result;
+}
+
+void *LinkSimulator::Run(void *arg)
+{
+    ((LinkSimulator *) arg)->Loop();
+    return NULL;
+}
+
+// Ticks once a millisecond, sending whatever has come due since the last
+// tick.
+void LinkSimulator::Loop()
+{
+    std::vector<Delayed *> due;
+    while (running)
+    {
+        struct timespec ts = { 0, 1000000 };
+        nanosleep(&ts, NULL);
+        enet_uint32 now = Now();
+        pthread_mutex_lock(&lock);
+        while ((int32_t) (now - cursor) >= 0)
+        {
+            std::vector<Delayed *>& slot = wheel[cursor % kSlots];
+            size_t kept = 0;
+            for (size_t i = 0; i < slot.size(); i++)
+            {
+                if (slot[i]->due == cursor)
+                    due.push_back(slot[i]);
+                else
+                    slot[kept++] = slot[i];
+            }
+            slot.resize(kept);
+            cursor++;
+        }
+        pthread_mutex_unlock(&lock);
+        for (size_t i = 0; i < due.size(); i++)
+        {
+            Delayed *d = due[i];
+            injector.Send(d->from, d->data.empty() ? NULL : &d->data[0], d->data.size());
+            delete d;
+        }
+        due.clear();
+    }
+}
+
+}
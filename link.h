@@ -0,0 +1,101 @@
+/* link.h -- simulated network conditions for a host's incoming traffic.
+   Copyright (C) 2011 Memeo, Inc. */
+
+#ifndef ENET_JS_LINK_H
+#define ENET_JS_LINK_H
+
+#include <enet/enet.h>
+#include <vector>
+#include <stdint.h>
+#include <pthread.h>
+#include "intercept.h"
+#include "inject.h"
+
+namespace enet
+{
+
+struct LinkConditions
+{
+    double loss;        // fraction of datagrams dropped, 0..1
+    double lossBurst;   // mean length of a run of losses; 1 for independent
+    double latency;     // one-way delay, in milliseconds
+    double jitter;      // spread of the delay, in milliseconds
+    bool normalJitter;  // jitter is a standard deviation, not +/- uniform
+    double duplicate;   // fraction of datagrams delivered twice
+    double reorder;     // fraction delivered at once, overtaking delayed ones
+    enet_uint32 seed;   // 0 picks one
+};
+
+struct LinkStats
+{
+    double passed;      // datagrams delivered (duplicates included)
+    double dropped;
+    double duplicated;
+    double reordered;
+};
+
+// Impairs the datagrams a host receives, as if they had crossed a lossy,
+// slow link. Everything arriving on the host socket is intercepted before
+// enet sees it; what survives is held in a timer wheel and, when due, fed
+// back in through a Reinjector, so enet processes it as if it had come
+// straight from the sender. Simulating both directions of a link means
+// enabling it on both hosts.
+//
+// Delays are capped at kMaxDelay milliseconds. Conditions may be changed
+// from any thread.
+class LinkSimulator : public Interceptor
+{
+public:
+    enum { kSlots = 4096, kMaxDelay = kSlots - 1 };
+
+    LinkSimulator();
+    // Stops the thread if it is running.
+    ~LinkSimulator();
+
+    // Opens the loopback socket and starts the delivery thread. host must
+    // already be bound. Returns false on failure.
+    bool Start(ENetHost *host);
+    void Stop();
+
+    int Intercept(ENetHost *host, ENetEvent *event);
+
+    void SetConditions(const LinkConditions& conditions);
+    void GetStats(LinkStats *stats);
+
+private:
+    struct Delayed
+    {
+        enet_uint32 due;
+        ENetAddress from;
+        std::vector<enet_uint8> data;
+    };
+
+    static void *Run(void *arg);
+    void Loop();
+    double Random();
+    bool Lose();
+    enet_uint32 SampleDelay();
+    void Schedule(const ENetAddress& from, const enet_uint8 *data, size_t length,
+        enet_uint32 delay, enet_uint32 now);
+
+    pthread_mutex_t lock;
+    LinkConditions conditions;
+    LinkStats stats;
+    bool lossBurstActive;
+    uint64_t randomState;
+
+    std::vector<Delayed *> wheel[kSlots];
+    enet_uint32 cursor;
+
+    Reinjector injector;
+    volatile bool running;
+    bool started;
+    pthread_t thread;
+
+    LinkSimulator(const LinkSimulator&);
+    LinkSimulator& operator=(const LinkSimulator&);
+};
+
+}
+
+#endif
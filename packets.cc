@@ -0,0 +1,102 @@
+/* packets.cc -- accounting for the packets that pass through the binding.
+   Copyright (C) 2011 Memeo, Inc. */
+
+#include "packets.h"
+#include <map>
+#include <pthread.h>
+#include <time.h>
+
+namespace enet
+{
+
+namespace
+{
+
+struct Tracked
+{
+    ENetPacketFreeCallback previous;
+    double created;     // milliseconds, monotonic
+};
+
+pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+#ifdef DEBUG
+volatile bool enabled = true;
+#else
+volatile bool enabled = false;
+#endif
+std::map<ENetPacket *, Tracked> packets;
+double tracked = 0;
+double destroyed = 0;
+
+double Now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+void Destroyed(ENetPacket *packet)
+{
+    ENetPacketFreeCallback previous = NULL;
+    pthread_mutex_lock(&lock);
+    std::map<ENetPacket *, Tracked>::iterator it = packets.find(packet);
+    if (it != packets.end())
+    {
+        previous = it->second.previous;
+        packets.erase(it);
+        destroyed++;
+    }
+    pthread_mutex_unlock(&lock);
+    if (previous != NULL)
+        previous(packet);
+}
+
+}
+
+void TrackPackets(bool on)
+{
+    // Packets already tracked stay tracked until they are destroyed.
+    enabled = on;
+    if (on)
+    {
+        pthread_mutex_lock(&lock);
+        tracked = packets.size();
+        destroyed = 0;
+        pthread_mutex_unlock(&lock);
+    }
+}
+
+void TrackPacket(ENetPacket *packet)
+{
+    if (!enabled || packet == NULL)
+        return;
+    pthread_mutex_lock(&lock);
+    if (packets.find(packet) == packets.end())
+    {
+        Tracked t = { packet->freeCallback, Now() };
+        packets[packet] = t;
+        packet->freeCallback = Destroyed;
+        tracked++;
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+void GetPacketStats(PacketStats *stats)
+{
+    double now = Now();
+    pthread_mutex_lock(&lock);
+    stats->live = packets.size();
+    stats->bytes = 0;
+    stats->oldest = 0;
+    for (std::map<ENetPacket *, Tracked>::iterator it = packets.begin(); it != packets.end(); ++it)
+    {
+        stats->bytes += it->first->dataLength;
+        if (now - it->second.created > stats->oldest)
+            stats->oldest = now - it->second.created;
+    }
+    stats->tracked = tracked;
+    stats->destroyed = destroyed;
+    pthread_mutex_unlock(&lock);
+}
+
+}
@@ -0,0 +1,37 @@
+/* packets.h -- accounting for the packets that pass through the binding.
+   Copyright (C) 2011 Memeo, Inc. */
+
+#ifndef ENET_JS_PACKETS_H
+#define ENET_JS_PACKETS_H
+
+#include <enet/enet.h>
+
+namespace enet
+{
+
+struct PacketStats
+{
+    double live;        // tracked packets not yet destroyed
+    double bytes;       // their payload bytes
+    double oldest;      // age of the oldest live one, in milliseconds
+    double tracked;     // packets tracked since tracking was turned on
+    double destroyed;   // ...and destroyed since
+};
+
+// A leak tracker for ENetPackets. While it is on, every packet the binding
+// creates, and every received packet handed to JS, is recorded until enet
+// destroys it, so packets that never go away show up in the counts. It
+// finds out about destruction by taking over the packet's freeCallback
+// (and calling the previous one), so a packet must be tracked after its
+// callback has been set. Off by default, or on from the start in DEBUG
+// builds. Safe to call from several threads.
+void TrackPackets(bool enabled);
+
+// Does nothing unless tracking is on, or if the packet is already tracked.
+void TrackPacket(ENetPacket *packet);
+
+void GetPacketStats(PacketStats *stats);
+
+}
+
+#endif
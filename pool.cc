@@ -0,0 +1,331 @@
+/* pool.cc -- size-class pool allocator for enet's allocations.
+   Copyright (C) 2011 Memeo, Inc. */
+
+#include "pool.h"
+#include <cstdlib>
+#include <pthread.h>
+
+namespace enet
+{
+
+namespace
+{
+
+enum
+{
+    kMinShift = 4,     // 16 bytes
+    kMaxShift = 16,    // 64K
+    kClassCount = kMaxShift - kMinShift + 1,
+    kLargeClass = 0xff,
+    kBatch = 16,                        // blocks moved to or from the depot at once
+    kThreadClassBytes = 256 * 1024      // most a thread keeps of one size class
+};
+
+// Every block starts with this header so PoolFree knows where it belongs.
+// It is padded to 16 bytes to keep the returned memory suitably aligned.
+union BlockHeader
+{
+    struct
+    {
+        unsigned char sizeClass;
+        size_t size;
+    } info;
+    BlockHeader *next;
+    double align[2];
+};
+
+// Each thread allocates from and frees to its own lists without locking,
+// and trades blocks with the shared depot a batch at a time. Packets
+// created on one thread are often freed on another, so a thread's
+// bytesInUse may go negative; only the sum means anything.
+struct ThreadCache
+{
+    BlockHeader *lists[kClassCount];
+    int counts[kClassCount];
+    // Written only by the owning thread; PoolGetStats reads them without
+    // waiting for it, which is good enough for counters.
+    volatile double hits;
+    volatile double misses;
+    volatile double bytesCached;
+    volatile double bytesInUse;
+    ThreadCache *next;
+    ThreadCache *previous;
+};
+
+// Blocks no thread is holding, one list and lock per size class.
+struct Depot
+{
+    pthread_mutex_t lock;
+    BlockHeader *list;
+};
+
+pthread_once_t once = PTHREAD_ONCE_INIT;
+pthread_key_t cacheKey;
+__thread ThreadCache *threadCache;
+Depot depots[kClassCount];
+// Bytes in all the depot's lists. Changed atomically under any class's
+// lock, so checks against the limit may be off by a block or two.
+volatile size_t depotBytes = 0;
+volatile size_t limit = 16 * 1024 * 1024;
+
+// Every live thread cache, and the counters of threads that have exited
+// (or couldn't get a cache).
+pthread_mutex_t registryLock = PTHREAD_MUTEX_INITIALIZER;
+ThreadCache *caches = NULL;
+double retiredHits = 0;
+double retiredMisses = 0;
+double retiredBytesInUse = 0;
+
+int SizeClass(size_t size)
+{
+    int shift = kMinShift;
+    while (shift <= kMaxShift && ((size_t) 1 << shift) < size)
+        shift++;
+    return shift <= kMaxShift ? shift - kMinShift : kLargeClass;
+}
+
+size_t ClassBytes(int sizeClass)
+{
+    return sizeof(BlockHeader) + ((size_t) 1 << (sizeClass + kMinShift));
+}
+
+// How many blocks of a class a thread may hold, and how many it moves at
+// once: fewer of the big ones.
+int ClassLimit(int sizeClass)
+{
+    size_t blocks = kThreadClassBytes / ClassBytes(sizeClass);
+    if (blocks > 2 * kBatch)
+        blocks = 2 * kBatch;
+    return blocks > 1 ? (int) blocks : 1;
+}
+
+int ClassBatch(int sizeClass)
+{
+    int batch = ClassLimit(sizeClass) / 2;
+    return batch > 1 ? batch : 1;
+}
+
+// Hands n blocks from the front of cache's list for sizeClass back to the
+// depot, or to the system beyond the limit.
+void Drain(ThreadCache *cache, int sizeClass, int n)
+{
+    size_t bytes = ClassBytes(sizeClass);
+    BlockHeader *overflow = NULL;
+    Depot *depot = &depots[sizeClass];
+    pthread_mutex_lock(&depot->lock);
+    for (int i = 0; i < n && cache->lists[sizeClass] != NULL; i++)
+    {
+        BlockHeader *block = cache->lists[sizeClass];
+        cache->lists[sizeClass] = block->next;
+        cache->counts[sizeClass]--;
+        cache->bytesCached -= bytes;
+        if (depotBytes + bytes <= limit)
+        {
+            block->next = depot->list;
+            depot->list = block;
+            __sync_fetch_and_add(&depotBytes, bytes);
+        }
+        else
+        {
+            block->next = overflow;
+            overflow = block;
+        }
+    }
+    pthread_mutex_unlock(&depot->lock);
+    while (overflow != NULL)
+    {
+        BlockHeader *block = overflow;
+        overflow = block->next;
+        ::free(block);
+    }
+}
+
+void Refill(ThreadCache *cache, int sizeClass)
+{
+    size_t bytes = ClassBytes(sizeClass);
+    int batch = ClassBatch(sizeClass);
+    Depot *depot = &depots[sizeClass];
+    pthread_mutex_lock(&depot->lock);
+    for (int i = 0; i < batch && depot->list != NULL; i++)
+    {
+        BlockHeader *block = depot->list;
+        depot->list = block->next;
+        __sync_fetch_and_sub(&depotBytes, bytes);
+        block->next = cache->lists[sizeClass];
+        cache->lists[sizeClass] = block;
+        cache->counts[sizeClass]++;
+        cache->bytesCached += bytes;
+    }
+    pthread_mutex_unlock(&depot->lock);
+}
+
+// Runs when a thread with a cache exits.
+void Retire(void *arg)
+{
+    ThreadCache *cache = (ThreadCache *) arg;
+    for (int c = 0; c < kClassCount; c++)
+        Drain(cache, c, cache->counts[c]);
+    pthread_mutex_lock(&registryLock);
+    if (cache->previous != NULL)
+        cache->previous->next = cache->next;
+    else
+        caches = cache->next;
+    if (cache->next != NULL)
+        cache->next->previous = cache->previous;
+    retiredHits += cache->hits;
+    retiredMisses += cache->misses;
+    retiredBytesInUse += cache->bytesInUse;
+    pthread_mutex_unlock(&registryLock);
+    threadCache = NULL;
+    ::free(cache);
+}
+
+void Init()
+{
+    for (int c = 0; c < kClassCount; c++)
+    {
+        pthread_mutex_init(&depots[c].lock, NULL);
+        depots[c].list = NULL;
+    }
+    pthread_key_create(&cacheKey, Retire);
+}
+
+// The calling thread's cache, made on first use. NULL if there's no
+// memory for one.
+ThreadCache *Cache()
+{
+    if (threadCache != NULL)
+        return threadCache;
+    pthread_once(&once, Init);
+    ThreadCache *cache = (ThreadCache *) ::calloc(1, sizeof(ThreadCache));
+    if (cache == NULL)
+        return NULL;
+    pthread_mutex_lock(&registryLock);
+    cache->next = caches;
+    if (caches != NULL)
+        caches->previous = cache;
+    caches = cache;
+    pthread_mutex_unlock(&registryLock);
+    threadCache = cache;
+    pthread_setspecific(cacheKey, cache);
+    return cache;
+}
+
+// Counts for a thread without a cache.
+void CountRetired(double hits, double misses, double bytesInUse)
+{
+    pthread_mutex_lock(&registryLock);
+    retiredHits += hits;
+    retiredMisses += misses;
+    retiredBytesInUse += bytesInUse;
+    pthread_mutex_unlock(&registryLock);
+}
+
+}
+
+void *PoolAlloc(size_t size)
+{
+    int sizeClass = SizeClass(size);
+    size_t bytes = sizeClass == kLargeClass ? sizeof(BlockHeader) + size : ClassBytes(sizeClass);
+    ThreadCache *cache = Cache();
+    BlockHeader *block = NULL;
+    if (cache != NULL && sizeClass != kLargeClass)
+    {
+        if (cache->lists[sizeClass] == NULL)
+            Refill(cache, sizeClass);
+        block = cache->lists[sizeClass];
+        if (block != NULL)
+        {
+            cache->lists[sizeClass] = block->next;
+            cache->counts[sizeClass]--;
+            cache->bytesCached -= bytes;
+        }
+    }
+    if (cache != NULL)
+    {
+        if (block != NULL)
+            cache->hits++;
+        else
+            cache->misses++;
+    }
+    if (block == NULL)
+    {
+        block = (BlockHeader *) ::malloc(bytes);
+        if (block == NULL)
+            return NULL;
+    }
+    if (cache != NULL)
+        cache->bytesInUse += bytes;
+    else
+        CountRetired(0, 1, bytes);
+    block->info.sizeClass = (unsigned char) sizeClass;
+    block->info.size = bytes;
+    return block + 1;
+}
+
+void PoolFree(void *memory)
+{
+    if (memory == NULL)
+        return;
+    BlockHeader *block = (BlockHeader *) memory - 1;
+    int sizeClass = block->info.sizeClass;
+    size_t bytes = block->info.size;
+    ThreadCache *cache = Cache();
+    if (cache == NULL)
+    {
+        CountRetired(0, 0, -(double) bytes);
+        ::free(block);
+        return;
+    }
+    cache->bytesInUse -= bytes;
+    if (sizeClass == kLargeClass)
+    {
+        ::free(block);
+        return;
+    }
+    block->next = cache->lists[sizeClass];
+    cache->lists[sizeClass] = block;
+    cache->counts[sizeClass]++;
+    cache->bytesCached += bytes;
+    if (cache->counts[sizeClass] > ClassLimit(sizeClass))
+        Drain(cache, sizeClass, ClassBatch(sizeClass));
+}
+
+void PoolGetStats(PoolStats *stats)
+{
+    pthread_once(&once, Init);
+    pthread_mutex_lock(&registryLock);
+    stats->hits = retiredHits;
+    stats->misses = retiredMisses;
+    stats->bytesInUse = retiredBytesInUse;
+    stats->bytesCached = depotBytes;
+    for (ThreadCache *cache = caches; cache != NULL; cache = cache->next)
+    {
+        stats->hits += cache->hits;
+        stats->misses += cache->misses;
+        stats->bytesInUse += cache->bytesInUse;
+        stats->bytesCached += cache->bytesCached;
+    }
+    pthread_mutex_unlock(&registryLock);
+    stats->limit = limit;
+}
+
+void PoolSetLimit(size_t bytes)
+{
+    pthread_once(&once, Init);
+    limit = bytes;
+    for (int c = kClassCount - 1; c >= 0 && depotBytes > limit; c--)
+    {
+        pthread_mutex_lock(&depots[c].lock);
+        while (depots[c].list != NULL && depotBytes > limit)
+        {
+            BlockHeader *block = depots[c].list;
+            depots[c].list = block->next;
+            __sync_fetch_and_sub(&depotBytes, ClassBytes(c));
+            ::free(block);
+        }
+        pthread_mutex_unlock(&depots[c].lock);
+    }
+}
+
+}
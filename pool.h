@@ -0,0 +1,39 @@
+/* pool.h -- size-class pool allocator for enet's allocations.
+   Copyright (C) 2011 Memeo, Inc. */
+
+#ifndef ENET_JS_POOL_H
+#define ENET_JS_POOL_H
+
+#include <stddef.h>
+
+namespace enet
+{
+
+struct PoolStats
+{
+    double hits;        // allocations served from a free list
+    double misses;      // allocations that went to the system allocator
+    double bytesCached; // bytes sitting in free lists, ready for reuse
+    double bytesInUse;  // bytes currently handed out (including headers)
+    double limit;       // cap on bytesCached
+};
+
+// Installed as enet's malloc/free through enet_initialize_with_callbacks.
+// Requests up to 64K are rounded up to a power of two and recycled through
+// per-size free lists; anything larger goes straight to malloc. Safe to
+// call from several threads: each keeps a small cache of every size and
+// trades blocks a batch at a time with a shared depot, locked per size,
+// so service threads don't serialize on the allocator.
+void *PoolAlloc(size_t size);
+void PoolFree(void *memory);
+
+void PoolGetStats(PoolStats *stats);
+
+// Sets the most memory the depot may hold; blocks freed beyond that are
+// returned to the system. Lowering the limit trims the depot immediately.
+// Each thread's cache holds up to 256K of each size on top of that.
+void PoolSetLimit(size_t bytes);
+
+}
+
+#endif
@@ -0,0 +1,134 @@
+/* queue.h -- lock-free queues for handing work between threads.
+   Copyright (C) 2011 Memeo, Inc. */
+
+#ifndef ENET_JS_QUEUE_H
+#define ENET_JS_QUEUE_H
+
+#include <stddef.h>
+
+namespace enet
+{
+
+struct QueueNode
+{
+    QueueNode * volatile next;
+};
+
+// Multi-producer, single-consumer queue of intrusive nodes (Vyukov's
+// design). Push() may be called from any thread, Pop() from one thread only.
+class MpscQueue
+{
+private:
+    QueueNode * volatile head;
+    QueueNode *tail;
+    QueueNode stub;
+
+public:
+    MpscQueue() : head(&stub), tail(&stub)
+    {
+        stub.next = NULL;
+    }
+    
+    void Push(QueueNode *node)
+    {
+        node->next = NULL;
+        // Publish the node's contents before it becomes reachable.
+        __sync_synchronize();
+        QueueNode *prev = __sync_lock_test_and_set(&head, node);
+        prev->next = node;
+    }
+    
+    // Returns NULL when the queue is empty, or when a producer is halfway
+    // through a push (the node will show up on a later call).
+    QueueNode *Pop()
+    {
+        __sync_synchronize();
+        QueueNode *node = tail;
+        QueueNode *next = node->next;
+        if (node == &stub)
+        {
+            if (next == NULL)
+                return NULL;
+            tail = next;
+            node = next;
+            next = next->next;
+        }
+        if (next != NULL)
+        {
+            tail = next;
+            return node;
+        }
+        if (node != head)
+            return NULL;
+        Push(&stub);
+        next = node->next;
+        if (next != NULL)
+        {
+            tail = next;
+            return node;
+        }
+        return NULL;
+    }
+};
+
+// Bounded single-producer, single-consumer ring of values. The capacity is
+// rounded up to a power of two.
+template <class T>
+class SpscRing
+{
+private:
+    T *items;
+    size_t mask;
+    volatile size_t head;   // next slot to write; only the producer stores it
+    volatile size_t tail;   // next slot to read; only the consumer stores it
+    
+    SpscRing(const SpscRing&);
+    SpscRing& operator=(const SpscRing&);
+
+public:
+    explicit SpscRing(size_t capacity) : head(0), tail(0)
+    {
+        size_t size = 1;
+        while (size < capacity)
+            size <<= 1;
+        items = new T[size];
+        mask = size - 1;
+    }
+    
+    ~SpscRing()
+    {
+        delete [] items;
+    }
+    
+    bool Push(const T& item)
+    {
+        size_t h = head;
+        if (h - tail > mask)
+            return false;
+        items[h & mask] = item;
+        __sync_synchronize();
+        head = h + 1;
+        return true;
+    }
+    
+    bool Pop(T *item)
+    {
+        size_t t = tail;
+        if (t == head)
+            return false;
+        __sync_synchronize();
+        *item = items[t & mask];
+        __sync_synchronize();
+        tail = t + 1;
+        return true;
+    }
+    
+    bool Empty() const
+    {
+        return tail == head;
+    }
+};
+
+}
+
+#endif
@@ -0,0 +1,139 @@
+/* raw.cc -- non-enet datagrams on an enet host's socket.
+   Copyright (C) 2011 Memeo, Inc. */
+
+#include <cstring>
+#include <cstdlib>
+#include "raw.h"
+
+namespace enet
+{
+
+RawChannel::RawChannel(EventSink *wake)
+    : wake(wake)
+{
+    pthread_mutex_init(&lock, NULL);
+    ::memset(&stats, 0, sizeof(RawStats));
+}
+
+RawChannel::~RawChannel()
+{
+    for (size_t i = 0; i < queue.size(); i++)
+        ::free(queue[i].data);
+    pthread_mutex_destroy(&lock);
+}
+
+bool RawChannel::Matches(const enet_uint8 *data, size_t length)
+{
+    for (size_t i = 0; i < filters.size(); i++)
+    {
+        const Filter& f = filters[i];
+        if (f.offset + f.value.size() > length)
+            continue;
+        size_t j = 0;
+        for (; j < f.value.size(); j++)
+        {
+            enet_uint8 mask = f.mask.empty() ? 0xFF : f.mask[j];
+            if ((data[f.offset + j] & mask) != f.value[j])
+                break;
+        }
+        if (j == f.value.size())
+            return true;
+    }
+    return false;
+}
+
+int RawChannel::Intercept(ENetHost *host, ENetEvent *event)
+{
+    pthread_mutex_lock(&lock);
+    if (filters.empty() || !Matches(host->receivedData, host->receivedDataLength))
+    {
+        pthread_mutex_unlock(&lock);
+        return 0;
+    }
+    // enet reuses its receive buffer for the next datagram, so this is the
+    // one copy; JS gets a Buffer over it.
+    bool wasEmpty = queue.empty();
+    if (queue.size() >= kMaxQueued)
+    {
+        stats.dropped++;
+    }
+    else
+    {
+        RawDatagram d;
+        d.address = host->receivedAddress;
+        d.length = host->receivedDataLength;
+        d.data = (char *) ::malloc(d.length > 0 ? d.length : 1);
+        if (d.data != NULL)
+        {
+            ::memcpy(d.data, host->receivedData, d.length);
+            queue.push_back(d);
+            stats.received++;
+        }
+        else
+        {
+            stats.dropped++;
+        }
+    }
+    bool notify = wasEmpty && !queue.empty() && wake != NULL;
+    pthread_mutex_unlock(&lock);
+    if (notify)
+        wake->Flush();
+    return 1;
+}
+
+bool RawChannel::AddFilter(size_t offset, const enet_uint8 *value, size_t valueLength,
+    const enet_uint8 *mask, size_t maskLength)
+{
+    if (maskLength != 0 && maskLength != valueLength)
+        return false;
+    Filter f;
+    f.offset = offset;
+    f.value.assign(value, value + valueLength);
+    f.mask.assign(mask, mask + maskLength);
+    // Keep value within the mask so the match is a plain compare.
+    for (size_t i = 0; i < maskLength; i++)
+        f.value[i] &= f.mask[i];
+    pthread_mutex_lock(&lock);
+    filters.push_back(f);
+    pthread_mutex_unlock(&lock);
+    return true;
+}
+
+void RawChannel::ClearFilters()
+{
+    pthread_mutex_lock(&lock);
+    filters.clear();
+    pthread_mutex_unlock(&lock);
+}
+
+void RawChannel::Take(std::vector<RawDatagram>& out)
+{
+    pthread_mutex_lock(&lock);
+    out.insert(out.end(), queue.begin(), queue.end());
+    queue.clear();
+    pthread_mutex_unlock(&lock);
+}
+
+int RawChannel::Send(ENetHost *host, const ENetAddress& address, const void *data, size_t length)
+{
+    ENetBuffer buffer;
+    buffer.data = (void *) data;
+    buffer.dataLength = length;
+    int sent = enet_socket_send(host->socket, &address, &buffer, 1);
+    if (sent > 0)
+    {
+        pthread_mutex_lock(&lock);
+        stats.sent++;
+        pthread_mutex_unlock(&lock);
+    }
+    return sent;
+}
+
+void RawChannel::GetStats(RawStats *out)
+{
+    pthread_mutex_lock(&lock);
+    *out = stats;
+    pthread_mutex_unlock(&lock);
+}
+
+}
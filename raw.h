@@ -0,0 +1,84 @@
+/* raw.h -- non-enet datagrams on an enet host's socket.
+   Copyright (C) 2011 Memeo, Inc. */
+
+#ifndef ENET_JS_RAW_H
+#define ENET_JS_RAW_H
+
+#include <enet/enet.h>
+#include <vector>
+#include <pthread.h>
+#include "intercept.h"
+#include "service.h"
+
+namespace enet
+{
+
+// A datagram taken off the socket by a RawChannel. data is malloc'd and
+// belongs to whoever took the datagram from the channel.
+struct RawDatagram
+{
+    ENetAddress address;
+    char *data;
+    size_t length;
+};
+
+struct RawStats
+{
+    double received;    // datagrams matched and queued
+    double dropped;     // matched, but the queue was full
+    double sent;        // datagrams sent with Send()
+};
+
+// Pulls datagrams that match one of its filters out of the host's receive
+// path before enet parses them (STUN, keepalives, probes and so on), and
+// queues them for JS. A filter matches when, for each byte of value,
+// (data[offset + i] & mask[i]) == value[i]. Filters may be changed from
+// any thread.
+class RawChannel : public Interceptor
+{
+public:
+    // wake, if set, has Flush() called when the queue stops being empty,
+    // for hosts serviced on another thread.
+    explicit RawChannel(EventSink *wake);
+    ~RawChannel();
+
+    int Intercept(ENetHost *host, ENetEvent *event);
+
+    // An empty mask means all bits. Returns false if the mask length
+    // doesn't match the value's.
+    bool AddFilter(size_t offset, const enet_uint8 *value, size_t valueLength,
+        const enet_uint8 *mask, size_t maskLength);
+    void ClearFilters();
+
+    // Moves every queued datagram to the end of out.
+    void Take(std::vector<RawDatagram>& out);
+
+    // Sends data to address through the host's socket. Returns bytes sent,
+    // or -1 on error. Safe alongside a service thread: each send is a
+    // single sendto() on the datagram socket.
+    int Send(ENetHost *host, const ENetAddress& address, const void *data, size_t length);
+
+    void GetStats(RawStats *stats);
+
+    enum { kMaxQueued = 4096 };
+
+private:
+    struct Filter
+    {
+        size_t offset;
+        std::vector<enet_uint8> value;
+        std::vector<enet_uint8> mask;
+    };
+
+    bool Matches(const enet_uint8 *data, size_t length);
+
+    EventSink *wake;
+    pthread_mutex_t lock;
+    std::vector<Filter> filters;
+    std::vector<RawDatagram> queue;
+    RawStats stats;
+};
+
+}
+
+#endif
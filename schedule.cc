@@ -0,0 +1,215 @@
+/* schedule.cc -- fair, prioritized sending for enet hosts.
+   Copyright (C) 2011 Memeo, Inc. */
+
+#include <cstring>
+#include "schedule.h"
+
+namespace enet
+{
+
+// About one full datagram per turn.
+static const size_t kDefaultQuantum = 1400;
+static const enet_uint32 kDefaultTick = 10;
+
+Scheduler::Scheduler(size_t peerCount)
+    : peerCount(peerCount), quantum(kDefaultQuantum), budget(0), tick(kDefaultTick),
+      tokens(0), lastRefill(0), refilled(false)
+{
+    ::memset(channelClass, 0, sizeof(channelClass));
+    for (int c = 0; c < kClasses; c++)
+        queues[c].resize(peerCount, NULL);
+    ::memset(&stats, 0, sizeof(SchedulerStats));
+}
+
+Scheduler::~Scheduler()
+{
+    for (int c = 0; c < kClasses; c++)
+    {
+        for (size_t i = 0; i < queues[c].size(); i++)
+        {
+            PeerQueue *q = queues[c][i];
+            if (q == NULL)
+                continue;
+            for (size_t j = 0; j < q->entries.size(); j++)
+                Release(q->entries[j].packet);
+            delete q;
+        }
+    }
+}
+
+void Scheduler::SetChannelClass(enet_uint8 channel, int priorityClass)
+{
+    if (priorityClass < 0)
+        priorityClass = 0;
+    if (priorityClass >= kClasses)
+        priorityClass = kClasses - 1;
+    channelClass[channel] = (enet_uint8) priorityClass;
+}
+
+void Scheduler::SetQuantum(size_t bytes)
+{
+    quantum = bytes > 0 ? bytes : kDefaultQuantum;
+}
+
+void Scheduler::SetBudget(size_t bytesPerTick, enet_uint32 tickMilliseconds)
+{
+    budget = bytesPerTick;
+    tick = tickMilliseconds > 0 ? tickMilliseconds : kDefaultTick;
+    tokens = (double) budget;
+    refilled = false;
+}
+
+Scheduler::PeerQueue *Scheduler::QueueFor(int priorityClass, enet_uint16 slot)
+{
+    PeerQueue *&q = queues[priorityClass][slot];
+    if (q == NULL)
+    {
+        q = new PeerQueue;
+        q->deficit = 0;
+        q->active = false;
+        q->midTurn = false;
+    }
+    return q;
+}
+
+// Drops the scheduler's reference; enet holds its own once it has the
+// packet.
+void Scheduler::Release(ENetPacket *packet)
+{
+    if (--packet->referenceCount == 0)
+        enet_packet_destroy(packet);
+}
+
+int Scheduler::Enqueue(ENetPeer *peer, enet_uint8 channel, ENetPacket *packet)
+{
+    if (peer->state != ENET_PEER_STATE_CONNECTED || channel >= peer->channelCount
+        || peer->incomingPeerID >= peerCount)
+        return -1;
+    int c = channelClass[channel];
+    PeerQueue *q = QueueFor(c, peer->incomingPeerID);
+    Entry entry = { packet, peer->connectID, channel };
+    packet->referenceCount++;
+    q->entries.push_back(entry);
+    if (!q->active)
+    {
+        q->active = true;
+        rounds[c].push_back(peer->incomingPeerID);
+    }
+    stats.queuedPackets++;
+    stats.queuedBytes += packet->dataLength;
+    return 0;
+}
+
+void Scheduler::Broadcast(ENetHost *host, enet_uint8 channel, ENetPacket *packet)
+{
+    // Keep the packet alive until every peer has its reference.
+    packet->referenceCount++;
+    for (size_t i = 0; i < host->peerCount; i++)
+    {
+        if (host->peers[i].state == ENET_PEER_STATE_CONNECTED)
+            Enqueue(&host->peers[i], channel, packet);
+    }
+    Release(packet);
+}
+
+void Scheduler::Dispatch(ENetHost *host, enet_uint16 slot, const Entry& entry)
+{
+    ENetPeer *peer = &host->peers[slot];
+    stats.queuedPackets--;
+    stats.queuedBytes -= entry.packet->dataLength;
+    // The slot may have been reused since the packet was queued.
+    if (peer->state != ENET_PEER_STATE_CONNECTED || peer->connectID != entry.connectID
+        || enet_peer_send(peer, entry.channel, entry.packet) < 0)
+    {
+        stats.dropped++;
+    }
+    else
+    {
+        stats.sentPackets++;
+        stats.sentBytes += entry.packet->dataLength;
+    }
+    Release(entry.packet);
+}
+
+// One class's round, until it is empty or the budget runs out; returns
+// false in the second case.
+bool Scheduler::DrainClass(ENetHost *host, int priorityClass, bool unlimited)
+{
+    std::deque<enet_uint16>& round = rounds[priorityClass];
+    while (!round.empty())
+    {
+        enet_uint16 slot = round.front();
+        PeerQueue *q = queues[priorityClass][slot];
+        if (!q->midTurn)
+            q->deficit += quantum;
+        q->midTurn = false;
+        while (!q->entries.empty())
+        {
+            const Entry& entry = q->entries.front();
+            size_t size = entry.packet->dataLength;
+            if (!unlimited && size > q->deficit)
+                break;
+            // Tokens may go negative, so a packet bigger than the budget
+            // still gets out; later ticks pay for it.
+            if (!unlimited && budget > 0 && tokens <= 0)
+            {
+                q->midTurn = true;
+                return false;
+            }
+            Entry taken = entry;
+            q->entries.pop_front();
+            q->deficit = size > q->deficit ? 0 : q->deficit - size;
+            if (budget > 0)
+                tokens -= size;
+            Dispatch(host, slot, taken);
+        }
+        round.pop_front();
+        if (q->entries.empty())
+        {
+            q->deficit = 0;
+            q->active = false;
+        }
+        else
+        {
+            round.push_back(slot);
+        }
+    }
+    return true;
+}
+
+bool Scheduler::Drain(ENetHost *host, enet_uint32 now, enet_uint32 *delay)
+{
+    if (budget > 0)
+    {
+        if (refilled)
+            tokens += (double) budget * (enet_uint32) (now - lastRefill) / tick;
+        if (tokens > budget)
+            tokens = (double) budget;
+        lastRefill = now;
+        refilled = true;
+    }
+    for (int c = 0; c < kClasses; c++)
+    {
+        if (!DrainClass(host, c, false))
+        {
+            // Until the bucket is back above zero.
+            double wait = (1 - tokens) * tick / budget;
+            *delay = wait < 1 ? 1 : (enet_uint32) wait + 1;
+            return true;
+        }
+    }
+    return false;
+}
+
+void Scheduler::Flush(ENetHost *host)
+{
+    for (int c = 0; c < kClasses; c++)
+        DrainClass(host, c, true);
+}
+
+void Scheduler::GetStats(SchedulerStats *out)
+{
+    *out = stats;
+}
+
+}
@@ -0,0 +1,103 @@
+/* schedule.h -- fair, prioritized sending for enet hosts.
+   Copyright (C) 2011 Memeo, Inc. */
+
+#ifndef ENET_JS_SCHEDULE_H
+#define ENET_JS_SCHEDULE_H
+
+#include <enet/enet.h>
+#include <deque>
+#include <vector>
+
+namespace enet
+{
+
+struct SchedulerStats
+{
+    double queuedPackets;       // waiting in the scheduler now
+    double queuedBytes;
+    double sentPackets;         // handed to enet
+    double sentBytes;
+    double dropped;             // peer gone, or refused by enet
+};
+
+// Sits in front of enet_peer_send. Packets are queued per peer and per
+// priority class (chosen by channel), then handed to enet by Drain():
+// classes in strict order, 0 first, and within a class peers take turns
+// by deficit round robin, each turn allowing `quantum' more bytes. With a
+// budget set, Drain() stops once it has released `budget' bytes per
+// `tick' milliseconds, so a bulk backlog waits here instead of in enet's
+// queues, and what is sent next can still be decided by priority.
+//
+// Not thread-safe: it belongs to whichever thread services the host.
+class Scheduler
+{
+public:
+    enum { kClasses = 4 };
+
+    // peerCount is the host's capacity.
+    explicit Scheduler(size_t peerCount);
+    // Releases the packets still queued.
+    ~Scheduler();
+
+    // Channels default to class 0.
+    void SetChannelClass(enet_uint8 channel, int priorityClass);
+    void SetQuantum(size_t bytes);
+    // bytesPerTick of 0 means no budget.
+    void SetBudget(size_t bytesPerTick, enet_uint32 tickMilliseconds);
+
+    // The scheduler's versions of enet_peer_send and enet_host_broadcast.
+    // Enqueue takes a reference to the packet, and fails the way
+    // enet_peer_send would if the peer isn't connected or the channel is
+    // out of range.
+    int Enqueue(ENetPeer *peer, enet_uint8 channel, ENetPacket *packet);
+    void Broadcast(ENetHost *host, enet_uint8 channel, ENetPacket *packet);
+
+    // Hands what the budget allows to enet. Returns true if packets are
+    // left waiting, with *delay set to the milliseconds until more budget
+    // is available.
+    bool Drain(ENetHost *host, enet_uint32 now, enet_uint32 *delay);
+    // Hands everything to enet, ignoring the budget.
+    void Flush(ENetHost *host);
+
+    void GetStats(SchedulerStats *stats);
+
+private:
+    struct Entry
+    {
+        ENetPacket *packet;
+        enet_uint32 connectID;
+        enet_uint8 channel;
+    };
+
+    struct PeerQueue
+    {
+        std::deque<Entry> entries;
+        size_t deficit;
+        bool active;            // in its class's round
+        bool midTurn;           // the budget ran out during its turn
+    };
+
+    PeerQueue *QueueFor(int priorityClass, enet_uint16 slot);
+    void Release(ENetPacket *packet);
+    void Dispatch(ENetHost *host, enet_uint16 slot, const Entry& entry);
+    bool DrainClass(ENetHost *host, int priorityClass, bool unlimited);
+
+    size_t peerCount;
+    enet_uint8 channelClass[256];
+    std::vector<PeerQueue *> queues[kClasses];
+    std::deque<enet_uint16> rounds[kClasses];
+    size_t quantum;
+    size_t budget;
+    enet_uint32 tick;
+    double tokens;
+    enet_uint32 lastRefill;
+    bool refilled;
+    SchedulerStats stats;
+
+    Scheduler(const Scheduler&);
+    Scheduler& operator=(const Scheduler&);
+};
+
+}
+
+#endif
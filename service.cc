@@ -0,0 +1,389 @@
+/* service.cc -- servicing enet hosts off the main thread.
+   Copyright (C) 2011 Memeo, Inc. */
+
+#include "service.h"
+#include <poll.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <cstring>
+
+namespace enet
+{
+
+struct SyncCall
+{
+    pthread_mutex_t lock;
+    pthread_cond_t finished;
+    bool done;
+};
+
+// Whether enet would send any of p's queued reliable commands now. It
+// holds them back while the peer's window is full of unacknowledged data,
+// or while the channel's reliable sequence windows wrap into ones still in
+// use; the same checks as enet_protocol_send_reliable_outgoing_commands.
+static bool ReliableSendable(ENetPeer *p)
+{
+    bool windowExceeded = false, windowWrap = false;
+    for (ENetListNode *node = enet_list_begin(&p->outgoingReliableCommands);
+        node != enet_list_end(&p->outgoingReliableCommands); node = enet_list_next(node))
+    {
+        ENetOutgoingCommand *command = (ENetOutgoingCommand *) node;
+        enet_uint8 channelID = command->command.header.channelID;
+        ENetChannel *channel = channelID < p->channelCount ? &p->channels[channelID] : NULL;
+        if (channel != NULL)
+        {
+            enet_uint16 reliableWindow = command->reliableSequenceNumber / ENET_PEER_RELIABLE_WINDOW_SIZE;
+            if (!windowWrap && command->sendAttempts < 1
+                && !(command->reliableSequenceNumber % ENET_PEER_RELIABLE_WINDOW_SIZE)
+                && (channel->reliableWindows[(reliableWindow + ENET_PEER_RELIABLE_WINDOWS - 1) % ENET_PEER_RELIABLE_WINDOWS] >= ENET_PEER_RELIABLE_WINDOW_SIZE
+                    || channel->usedReliableWindows & ((((1 << ENET_PEER_FREE_RELIABLE_WINDOWS) - 1) << reliableWindow)
+                        | (((1 << ENET_PEER_FREE_RELIABLE_WINDOWS) - 1) >> (ENET_PEER_RELIABLE_WINDOWS - reliableWindow)))))
+                windowWrap = true;
+            if (windowWrap)
+                continue;
+        }
+        if (command->packet != NULL)
+        {
+            if (!windowExceeded)
+            {
+                enet_uint32 windowSize = (p->packetThrottle * p->windowSize) / ENET_PEER_PACKET_THROTTLE_SCALE;
+                if (p->reliableDataInTransit + command->fragmentLength > ENET_MAX(windowSize, p->mtu))
+                    windowExceeded = true;
+            }
+            if (windowExceeded)
+                continue;
+        }
+        return true;
+    }
+    return false;
+}
+
+bool HostDeadline(ENetHost *host, enet_uint32 now, enet_uint32 *delay)
+{
+    bool found = false;
+    bool connected = false;
+    enet_uint32 deadline = 0;
+    if (!enet_list_empty(&host->dispatchQueue))
+    {
+        *delay = 0;
+        return true;
+    }
+    for (ENetPeer *p = host->peers; p < &host->peers[host->peerCount]; ++p)
+    {
+        if (p->state == ENET_PEER_STATE_DISCONNECTED || p->state == ENET_PEER_STATE_ZOMBIE)
+            continue;
+        // Reliable commands waiting for acknowledgements to open the window
+        // aren't due; the acknowledgements wake us when they arrive, and
+        // nextTimeout covers retransmits.
+        if (!enet_list_empty(&p->acknowledgements) ||
+            !enet_list_empty(&p->outgoingUnreliableCommands) ||
+            ReliableSendable(p))
+        {
+            *delay = 0;
+            return true;
+        }
+        enet_uint32 next;
+        if (!enet_list_empty(&p->sentReliableCommands))
+            next = p->nextTimeout;
+        else if (p->state == ENET_PEER_STATE_CONNECTED)
+            next = p->lastReceiveTime + ENET_PEER_PING_INTERVAL;
+        else
+            continue;
+        if (p->state == ENET_PEER_STATE_CONNECTED)
+            connected = true;
+        if (!found || ENET_TIME_LESS(next, deadline))
+            deadline = next;
+        found = true;
+    }
+    if (connected && (host->incomingBandwidth != 0 || host->outgoingBandwidth != 0))
+    {
+        enet_uint32 next = host->bandwidthThrottleEpoch + ENET_HOST_BANDWIDTH_THROTTLE_INTERVAL;
+        if (ENET_TIME_LESS(next, deadline))
+            deadline = next;
+    }
+    if (!found)
+        return false;
+    *delay = ENET_TIME_LESS(deadline, now) ? 0 : ENET_TIME_DIFFERENCE(deadline, now);
+    return true;
+}
+
+ServiceThread::ServiceThread(ENetHost *host, int shard, EventSink *sink)
+    : host(host), shard(shard), sink(sink), commands(kCommandCapacity),
+      scheduler(NULL), wakePending(0), running(false), started(false)
+{
+    wakeFds[0] = wakeFds[1] = -1;
+    // Connections the host already has, if it was serviced elsewhere so far.
+    for (size_t i = 0; i < host->peerCount; i++)
+        connectIDs.push_back(host->peers[i].connectID);
+}
+
+ServiceThread::~ServiceThread()
+{
+    Stop();
+}
+
+bool ServiceThread::Start()
+{
+    if (started)
+        return true;
+    if (::pipe(wakeFds) < 0)
+        return false;
+    ::fcntl(wakeFds[0], F_SETFL, O_NONBLOCK);
+    ::fcntl(wakeFds[1], F_SETFL, O_NONBLOCK);
+    running = true;
+    if (pthread_create(&thread, NULL, Run, this) != 0)
+    {
+        running = false;
+        ::close(wakeFds[0]);
+        ::close(wakeFds[1]);
+        return false;
+    }
+    started = true;
+    return true;
+}
+
+void ServiceThread::Stop()
+{
+    if (!started)
+        return;
+    running = false;
+    char c = 0;
+    ssize_t ignored = ::write(wakeFds[1], &c, 1);
+    (void) ignored;
+    pthread_join(thread, NULL);
+    ::close(wakeFds[0]);
+    ::close(wakeFds[1]);
+    started = false;
+    // Whatever the thread never got to is dropped.
+    ServiceCommand command;
+    while (commands.Pop(&command))
+    {
+        if (command.packet != NULL && command.packet->referenceCount == 0)
+            enet_packet_destroy(command.packet);
+    }
+}
+
+bool ServiceThread::Post(const ServiceCommand& command)
+{
+    return commands.Push(command);
+}
+
+bool ServiceThread::Call(ServiceCall call, void *arg)
+{
+    SyncCall sync;
+    pthread_mutex_init(&sync.lock, NULL);
+    pthread_cond_init(&sync.finished, NULL);
+    sync.done = false;
+    ServiceCommand command;
+    ::memset(&command, 0, sizeof(ServiceCommand));
+    command.type = ServiceCommand::CALL;
+    command.call = call;
+    command.arg = arg;
+    command.sync = &sync;
+    bool posted = Post(command);
+    if (posted)
+    {
+        Wake();
+        pthread_mutex_lock(&sync.lock);
+        while (!sync.done)
+            pthread_cond_wait(&sync.finished, &sync.lock);
+        pthread_mutex_unlock(&sync.lock);
+    }
+    pthread_cond_destroy(&sync.finished);
+    pthread_mutex_destroy(&sync.lock);
+    return posted;
+}
+
+struct SchedulerSwap
+{
+    ServiceThread *thread;
+    Scheduler *next;
+};
+
+void ServiceThread::SwapScheduler(ENetHost *host, void *arg)
+{
+    SchedulerSwap *swap = (SchedulerSwap *) arg;
+    if (swap->thread->scheduler != NULL)
+        swap->thread->scheduler->Flush(host);
+    swap->thread->scheduler = swap->next;
+}
+
+bool ServiceThread::SetScheduler(Scheduler *next)
+{
+    SchedulerSwap swap = { this, next };
+    if (!started)
+    {
+        SwapScheduler(host, &swap);
+        return true;
+    }
+    return Call(SwapScheduler, &swap);
+}
+
+// setPeerLimit() may have raised peerCount since we were created.
+enet_uint32& ServiceThread::ConnectID(enet_uint16 peerID)
+{
+    if (peerID >= connectIDs.size())
+        connectIDs.resize(peerID + 1, 0);
+    return connectIDs[peerID];
+}
+
+void ServiceThread::Connecting(ENetPeer *peer)
+{
+    ConnectID(peer->incomingPeerID) = peer->connectID;
+}
+
+void ServiceThread::Wake()
+{
+    if (__sync_bool_compare_and_swap(&wakePending, 0, 1))
+    {
+        char c = 0;
+        ssize_t ignored = ::write(wakeFds[1], &c, 1);
+        (void) ignored;
+    }
+}
+
+void *ServiceThread::Run(void *arg)
+{
+    ((ServiceThread *) arg)->Loop();
+    return NULL;
+}
+
+void ServiceThread::Loop()
+{
+    // Whether the scheduler is holding packets back for lack of budget,
+    // and for how long.
+    bool backlog = false;
+    enet_uint32 backlogDelay = 0;
+    while (running)
+    {
+        enet_uint32 delay;
+        int timeout = -1;
+        if (HostDeadline(host, enet_time_get(), &delay))
+            timeout = (int) delay;
+        if (backlog && (timeout < 0 || (int) backlogDelay < timeout))
+            timeout = (int) backlogDelay;
+        if (!commands.Empty())
+            timeout = 0;
+        struct pollfd fds[2];
+        fds[0].fd = host->socket;
+        fds[0].events = POLLIN;
+        fds[1].fd = wakeFds[0];
+        fds[1].events = POLLIN;
+        ::poll(fds, 2, timeout);
+        if (fds[1].revents & POLLIN)
+        {
+            char buf[64];
+            while (::read(wakeFds[0], buf, sizeof(buf)) > 0)
+                ;
+            // Clear the flag before draining, so a later Post() wakes us again.
+            __sync_lock_release(&wakePending);
+        }
+        if (!running)
+            break;
+        
+        ServiceCommand command;
+        while (commands.Pop(&command))
+            Execute(command);
+        if (scheduler != NULL)
+            backlog = scheduler->Drain(host, enet_time_get(), &backlogDelay);
+        
+        ENetEvent event;
+        bool delivered = false;
+        while (enet_host_service(host, &event, 0) > 0)
+        {
+            ServiceEvent *e = new ServiceEvent;
+            e->type = event.type;
+            e->shard = shard;
+            e->peerID = event.peer->incomingPeerID;
+            if (event.type == ENET_EVENT_TYPE_DISCONNECT)
+                e->connectID = ConnectID(e->peerID);
+            else
+                e->connectID = ConnectID(e->peerID) = event.peer->connectID;
+            e->channelID = event.channelID;
+            e->data = event.data;
+            e->address = event.peer->address;
+            e->packet = event.packet;
+            sink->Deliver(e);
+            delivered = true;
+        }
+        if (delivered)
+            sink->Flush();
+    }
+}
+
+void ServiceThread::Execute(const ServiceCommand& command)
+{
+    ENetPeer *peer = NULL;
+    if (command.type <= ServiceCommand::PING && command.peerID < host->peerCount)
+    {
+        peer = &host->peers[command.peerID];
+        if (peer->connectID != command.connectID || peer->state == ENET_PEER_STATE_DISCONNECTED)
+            peer = NULL;
+    }
+    switch (command.type)
+    {
+    case ServiceCommand::SEND:
+        if (peer == NULL
+            || (scheduler != NULL ? scheduler->Enqueue(peer, command.channelID, command.packet)
+                : enet_peer_send(peer, command.channelID, command.packet)) < 0)
+        {
+            if (command.packet->referenceCount == 0)
+                enet_packet_destroy(command.packet);
+        }
+        break;
+        
+    case ServiceCommand::DISCONNECT:
+        if (peer != NULL)
+            enet_peer_disconnect(peer, command.data);
+        break;
+        
+    case ServiceCommand::DISCONNECT_NOW:
+        if (peer != NULL)
+            enet_peer_disconnect_now(peer, command.data);
+        break;
+        
+    case ServiceCommand::DISCONNECT_LATER:
+        if (peer != NULL)
+            enet_peer_disconnect_later(peer, command.data);
+        break;
+        
+    case ServiceCommand::RESET:
+        if (peer != NULL)
+            enet_peer_reset(peer);
+        break;
+        
+    case ServiceCommand::FLUSH:
+        enet_host_flush(host);
+        break;
+        
+    case ServiceCommand::PING:
+        if (peer != NULL)
+            enet_peer_ping(peer);
+        break;
+        
+    case ServiceCommand::BROADCAST:
+        if (scheduler != NULL)
+            scheduler->Broadcast(host, command.channelID, command.packet);
+        else
+            enet_host_broadcast(host, command.channelID, command.packet);
+        break;
+        
+    case ServiceCommand::CHANNEL_LIMIT:
+        enet_host_channel_limit(host, command.data);
+        break;
+        
+    case ServiceCommand::BANDWIDTH_LIMIT:
+        enet_host_bandwidth_limit(host, command.data, command.data2);
+        break;
+        
+    case ServiceCommand::CALL:
+        command.call(host, command.arg);
+        pthread_mutex_lock(&command.sync->lock);
+        command.sync->done = true;
+        pthread_cond_signal(&command.sync->finished);
+        pthread_mutex_unlock(&command.sync->lock);
+        break;
+    }
+}
+
+}
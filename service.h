@@ -0,0 +1,148 @@
+/* service.h -- servicing enet hosts off the main thread.
+   Copyright (C) 2011 Memeo, Inc. */
+
+#ifndef ENET_JS_SERVICE_H
+#define ENET_JS_SERVICE_H
+
+#include <enet/enet.h>
+#include <pthread.h>
+#include <vector>
+#include "queue.h"
+#include "schedule.h"
+
+namespace enet
+{
+
+// Returns true and sets *delay to the number of milliseconds until ENet
+// next has work to do: a retransmit or timeout, a keepalive ping, or a
+// bandwidth throttle update. Anything enet would send right away means no
+// delay; reliable commands held back by a full window don't count.
+// Returns false when no peer needs servicing at all.
+bool HostDeadline(ENetHost *host, enet_uint32 now, enet_uint32 *delay);
+
+// An event produced on a service thread. Peers are named by slot
+// (incomingPeerID) and connectID, since the ENetPeer itself belongs to the
+// service thread. The receiver owns the packet.
+struct ServiceEvent : QueueNode
+{
+    ENetEventType type;
+    int shard;
+    enet_uint16 peerID;
+    enet_uint32 connectID;
+    enet_uint8 channelID;
+    enet_uint32 data;
+    ENetAddress address;
+    ENetPacket *packet;
+};
+
+typedef void (*ServiceCall)(ENetHost *host, void *arg);
+
+struct SyncCall;
+
+// Work for a service thread. Commands aimed at a peer are dropped if the
+// slot no longer holds the same connection (connectID differs); a dropped
+// packet is destroyed unless something else still holds a reference.
+struct ServiceCommand
+{
+    enum Type
+    {
+        SEND,
+        DISCONNECT,
+        DISCONNECT_NOW,
+        DISCONNECT_LATER,
+        RESET,
+        FLUSH,
+        PING,
+        BROADCAST,          // channelID, packet
+        CHANNEL_LIMIT,      // data is the new limit
+        BANDWIDTH_LIMIT,    // data is incoming, data2 outgoing
+        CALL                // runs call(host, arg); see ServiceThread::Call
+    };
+    Type type;
+    enet_uint16 peerID;
+    enet_uint32 connectID;
+    enet_uint8 channelID;
+    enet_uint32 data;
+    enet_uint32 data2;
+    ENetPacket *packet;
+    ServiceCall call;
+    void *arg;
+    SyncCall *sync;
+};
+
+// Where a service thread hands its events. Deliver() is called for each
+// event and Flush() once after each batch, from the service thread.
+class EventSink
+{
+public:
+    virtual ~EventSink() { }
+    virtual void Deliver(ServiceEvent *event) = 0;
+    virtual void Flush() = 0;
+};
+
+// Runs enet_host_service for one host on its own thread. The thread sleeps
+// in poll() on the host socket and a wakeup pipe until ENet's next deadline,
+// executes posted commands, and passes events to the sink. Only the thread
+// touches the host between Start() and Stop().
+class ServiceThread
+{
+private:
+    ENetHost *host;
+    int shard;
+    EventSink *sink;
+    SpscRing<ServiceCommand> commands;
+    Scheduler *scheduler;
+    int wakeFds[2];
+    volatile int wakePending;
+    volatile bool running;
+    bool started;
+    pthread_t thread;
+    // Each slot's connectID, as it was when the connection started. enet
+    // clears the peer's own before handing out its disconnect event.
+    std::vector<enet_uint32> connectIDs;
+    
+    static void *Run(void *arg);
+    void Loop();
+    void Execute(const ServiceCommand& command);
+    enet_uint32& ConnectID(enet_uint16 peerID);
+    static void SwapScheduler(ENetHost *host, void *arg);
+    
+    ServiceThread(const ServiceThread&);
+    ServiceThread& operator=(const ServiceThread&);
+
+public:
+    enum { kCommandCapacity = 4096 };
+    
+    ServiceThread(ENetHost *host, int shard, EventSink *sink);
+    // Stops the thread if it is running; does not destroy the host.
+    ~ServiceThread();
+    
+    bool Start();
+    void Stop();
+    
+    // Queues a command; called from a single thread only. Returns false if
+    // the queue is full. The thread is not woken until Wake().
+    bool Post(const ServiceCommand& command);
+    void Wake();
+    
+    // Runs call(host, arg) on the service thread and waits for it to finish.
+    // For the rare operations that need an answer, like connecting.
+    bool Call(ServiceCall call, void *arg);
+    
+    // Sends and broadcasts go through scheduler from now on, or straight
+    // to enet if it is NULL; anything the previous scheduler still held is
+    // handed to enet first. Waits for the thread if it is running.
+    bool SetScheduler(Scheduler *scheduler);
+    
+    // Records the connection enet_host_connect just started on peer, so
+    // that its disconnect event names it even if it never connects. Only
+    // on the service thread, from a Call().
+    void Connecting(ENetPeer *peer);
+    
+    ENetHost *Host() const { return host; }
+    EventSink *Sink() const { return sink; }
+};
+
+}
+
+#endif
@@ -0,0 +1,114 @@
+/* stream.cc -- flow control for streams sent over reliable channels.
+   Copyright (C) 2011 Memeo, Inc. */
+
+#include <cstring>
+#include <map>
+#include <pthread.h>
+#include "stream.h"
+
+namespace enet
+{
+
+// Which window each outstanding packet counts against. One lock covers
+// this and every window's counters; it is held only briefly.
+static pthread_mutex_t windowLock = PTHREAD_MUTEX_INITIALIZER;
+static std::map<ENetPacket *, SendWindow *> windowPackets;
+
+SendWindow::SendWindow()
+    : references(1), outstanding(0), wakeAt(0), armed(false), wake(NULL)
+{
+}
+
+SendWindow::~SendWindow()
+{
+}
+
+void SendWindow::Ref()
+{
+    pthread_mutex_lock(&windowLock);
+    references++;
+    pthread_mutex_unlock(&windowLock);
+}
+
+void SendWindow::Unref()
+{
+    pthread_mutex_lock(&windowLock);
+    bool last = --references == 0;
+    pthread_mutex_unlock(&windowLock);
+    if (last)
+        delete this;
+}
+
+ENetPacket *SendWindow::CreatePacket(const void *header, size_t headerLength,
+    const void *data, size_t length)
+{
+    ENetPacket *packet = enet_packet_create(NULL, headerLength + length, ENET_PACKET_FLAG_RELIABLE);
+    if (packet == NULL)
+        return NULL;
+    ::memcpy(packet->data, header, headerLength);
+    if (length > 0)
+        ::memcpy(packet->data + headerLength, data, length);
+    packet->freeCallback = Released;
+    pthread_mutex_lock(&windowLock);
+    windowPackets[packet] = this;
+    outstanding += packet->dataLength;
+    references++;
+    pthread_mutex_unlock(&windowLock);
+    return packet;
+}
+
+size_t SendWindow::Outstanding()
+{
+    pthread_mutex_lock(&windowLock);
+    size_t bytes = outstanding;
+    pthread_mutex_unlock(&windowLock);
+    return bytes;
+}
+
+bool SendWindow::WakeAt(size_t bytes, EventSink *sink)
+{
+    pthread_mutex_lock(&windowLock);
+    bool there = outstanding <= bytes;
+    armed = !there;
+    wakeAt = bytes;
+    wake = sink;
+    pthread_mutex_unlock(&windowLock);
+    return !there;
+}
+
+size_t SendWindow::ChunkSize(const ENetPeer *peer, size_t headerLength)
+{
+    // enet fragments anything longer than this.
+    size_t room = peer->mtu - sizeof(ENetProtocolHeader) - sizeof(ENetProtocolSendFragment);
+    if (peer->host->checksum != NULL)
+        room -= sizeof(enet_uint32);
+    return room > headerLength ? room - headerLength : 1;
+}
+
+void SendWindow::Released(ENetPacket *packet)
+{
+    pthread_mutex_lock(&windowLock);
+    std::map<ENetPacket *, SendWindow *>::iterator it = windowPackets.find(packet);
+    if (it == windowPackets.end())
+    {
+        pthread_mutex_unlock(&windowLock);
+        return;
+    }
+    SendWindow *window = it->second;
+    windowPackets.erase(it);
+    window->outstanding -= packet->dataLength;
+    EventSink *sink = NULL;
+    if (window->armed && window->outstanding <= window->wakeAt)
+    {
+        window->armed = false;
+        sink = window->wake;
+    }
+    bool last = --window->references == 0;
+    pthread_mutex_unlock(&windowLock);
+    if (sink != NULL)
+        sink->Flush();
+    if (last)
+        delete window;
+}
+
+}
@@ -0,0 +1,66 @@
+/* stream.h -- flow control for streams sent over reliable channels.
+   Copyright (C) 2011 Memeo, Inc. */
+
+#ifndef ENET_JS_STREAM_H
+#define ENET_JS_STREAM_H
+
+#include <enet/enet.h>
+#include "service.h"
+
+namespace enet
+{
+
+// Counts the bytes of a stream's packets that enet hasn't let go of yet:
+// waiting in a scheduler or in the peer's queues, or sent and not yet
+// acknowledged. enet frees a reliable packet once it has been
+// acknowledged (or the peer is reset), and the window hears of it through
+// the packet's freeCallback, which may run on a service thread; the
+// window is locked accordingly.
+//
+// Reference counted: whoever creates it holds one reference, and each
+// packet it creates holds another until it is freed.
+class SendWindow
+{
+public:
+    SendWindow();
+
+    void Ref();
+    // Deletes the window when the last reference goes.
+    void Unref();
+
+    // Creates a reliable packet holding header followed by data, counted
+    // against the window until enet frees it. Returns NULL if it can't be
+    // allocated.
+    ENetPacket *CreatePacket(const void *header, size_t headerLength,
+        const void *data, size_t length);
+
+    size_t Outstanding();
+
+    // The first time Outstanding() falls to `bytes' or below, wake has
+    // Flush() called, once. Returns false, without arming anything, if it
+    // is already there. wake may be NULL when the host isn't threaded:
+    // freed packets are only noticed then when the host is next serviced.
+    bool WakeAt(size_t bytes, EventSink *wake);
+
+    // The most stream data that fits in one of peer's datagrams after
+    // headerLength bytes of header, so that enet never fragments a chunk.
+    static size_t ChunkSize(const ENetPeer *peer, size_t headerLength);
+
+private:
+    ~SendWindow();
+
+    static void Released(ENetPacket *packet);
+
+    int references;
+    size_t outstanding;
+    size_t wakeAt;
+    bool armed;
+    EventSink *wake;
+
+    SendWindow(const SendWindow&);
+    SendWindow& operator=(const SendWindow&);
+};
+
+}
+
+#endif
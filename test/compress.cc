@@ -0,0 +1,191 @@
+/* compress.cc -- checks the LZ4 compressor enet.js installs on hosts.
+   Copyright (C) 2011 Memeo, Inc. */
+
+// Round-trips datagrams of awkward sizes through the compressor and feeds
+// the decompressor malformed and truncated input, which must be refused
+// without touching memory it wasn't given. Build and run with
+// `make test-compress'; add CFLAGS=-fsanitize=address to have overreads
+// caught as well as overwrites.
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <enet/enet.h>
+#include "../compress.h"
+
+static int failures = 0;
+
+#define CHECK(cond, what, size) \
+    do \
+    { \
+        if (!(cond)) \
+        { \
+            printf("FAIL %s (size %lu): %s\n", what, (unsigned long) (size), #cond); \
+            failures++; \
+        } \
+    } \
+    while (0)
+
+static const size_t kGuard = 64;
+static const enet_uint8 kCanary = 0xA5;
+
+// The compressor only keeps the ENetCompressor in the host, so a zeroed
+// one, without a socket, will do.
+static ENetHost host;
+static enet::CompressorStats stats;
+
+static size_t Compress(const enet_uint8 *data, size_t length, enet_uint8 *out, size_t outLimit)
+{
+    // In two pieces, as enet gathers a datagram from its commands.
+    ENetBuffer buffers[2];
+    buffers[0].data = (void *) data;
+    buffers[0].dataLength = length / 3;
+    buffers[1].data = (void *) (data + length / 3);
+    buffers[1].dataLength = length - length / 3;
+    return host.compressor.compress(host.compressor.context, buffers, 2, length, out, outLimit);
+}
+
+// Decompresses a copy of in, held in a block of exactly its length, into
+// outLimit bytes followed by canaries. Returns the result, and sets
+// *guarded to whether the canaries survived.
+static size_t Decompress(const enet_uint8 *in, size_t length, enet_uint8 *out, size_t outLimit,
+    bool *guarded)
+{
+    enet_uint8 *copy = (enet_uint8 *) malloc(length > 0 ? length : 1);
+    memcpy(copy, in, length);
+    memset(out + outLimit, kCanary, kGuard);
+    size_t result = host.compressor.decompress(host.compressor.context, copy, length, out, outLimit);
+    free(copy);
+    *guarded = true;
+    for (size_t i = 0; i < kGuard; i++)
+    {
+        if (out[outLimit + i] != kCanary)
+            *guarded = false;
+    }
+    return result;
+}
+
+static void Fill(enet_uint8 *data, size_t length, int pattern)
+{
+    for (size_t i = 0; i < length; i++)
+    {
+        switch (pattern)
+        {
+        case 0: data[i] = 0; break;
+        case 1: data[i] = (enet_uint8) rand(); break;
+        default: data[i] = "enet.js compresses datagrams "[(i * 7 / 5) % 29]; break;
+        }
+    }
+}
+
+static void RoundTrip(size_t size, int pattern)
+{
+    static enet_uint8 data[ENET_PROTOCOL_MAXIMUM_MTU];
+    static enet_uint8 packed[2 * ENET_PROTOCOL_MAXIMUM_MTU];
+    static enet_uint8 unpacked[ENET_PROTOCOL_MAXIMUM_MTU + kGuard];
+    Fill(data, size, pattern);
+
+    // With room to spare it always succeeds, even if the data grows.
+    size_t n = Compress(data, size, packed, sizeof(packed));
+    CHECK(n > 0, "compress", size);
+    bool guarded;
+    size_t m = Decompress(packed, n, unpacked, ENET_PROTOCOL_MAXIMUM_MTU, &guarded);
+    CHECK(m == size, "round trip length", size);
+    CHECK(memcmp(unpacked, data, size) == 0, "round trip data", size);
+    CHECK(guarded, "round trip stays in bounds", size);
+    if (size > 0)
+    {
+        m = Decompress(packed, n, unpacked, size - 1, &guarded);
+        CHECK(m == 0, "output one byte short", size);
+        CHECK(guarded, "output one byte short stays in bounds", size);
+    }
+
+    // As enet calls it: the output may be no longer than the input.
+    n = Compress(data, size, packed, size);
+    if (pattern == 0 && size >= 64)
+        CHECK(n > 0 && n < size / 4, "zeros shrink", size);
+    if (n > 0)
+    {
+        m = Decompress(packed, n, unpacked, ENET_PROTOCOL_MAXIMUM_MTU, &guarded);
+        CHECK(m == size && memcmp(unpacked, data, size) == 0, "round trip within input size", size);
+    }
+
+    // Cut short, a stream either fails or, cut between sequences, yields
+    // only a prefix of the data. Random data compresses to one run of
+    // literals, so every cut of it must fail.
+    n = Compress(data, size, packed, sizeof(packed));
+    for (size_t cut = 0; cut < n; cut++)
+    {
+        m = Decompress(packed, cut, unpacked, ENET_PROTOCOL_MAXIMUM_MTU, &guarded);
+        CHECK(guarded, "truncated stays in bounds", size);
+        CHECK(m < size || size == 0, "truncated is shorter", size);
+        CHECK(memcmp(unpacked, data, m) == 0, "truncated is a prefix", size);
+        if (pattern == 1)
+            CHECK(m == 0, "truncated literals fail", size);
+    }
+}
+
+struct Malformed
+{
+    const char *what;
+    enet_uint8 data[8];
+    size_t length;
+};
+
+static void CheckMalformed()
+{
+    static const Malformed cases[] =
+    {
+        { "offset 0", { 0x10, 'a', 0x00, 0x00 }, 4 },
+        { "offset before the start", { 0x10, 'a', 0x02, 0x00 }, 4 },
+        { "match with no literals yet", { 0x00, 0x01, 0x00 }, 3 },
+        { "literals past the end", { 0x50, 'a', 'b' }, 3 },
+        { "literal length past the end", { 0xF0, 0xFF, 0xFF }, 3 },
+        { "half an offset", { 0x10, 'a', 0x01 }, 3 },
+        { "match length past the end", { 0x1F, 'a', 0x01, 0x00, 0xFF }, 5 },
+    };
+    static enet_uint8 out[ENET_PROTOCOL_MAXIMUM_MTU + kGuard];
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++)
+    {
+        bool guarded;
+        size_t m = Decompress(cases[i].data, cases[i].length, out, ENET_PROTOCOL_MAXIMUM_MTU, &guarded);
+        CHECK(m == 0, cases[i].what, cases[i].length);
+        CHECK(guarded, cases[i].what, cases[i].length);
+    }
+
+    // A valid match that would write past the output.
+    static const enet_uint8 expands[] = { 0x1F, 'a', 0x01, 0x00, 0xFF, 0xFF, 0xFF, 0x00 };
+    bool guarded;
+    size_t m = Decompress(expands, sizeof(expands), out, 100, &guarded);
+    CHECK(m == 0, "match past the output", sizeof(expands));
+    CHECK(guarded, "match past the output stays in bounds", sizeof(expands));
+
+    // Garbage may decode to something, but only within bounds.
+    enet_uint8 garbage[64];
+    for (int i = 0; i < 100000; i++)
+    {
+        size_t length = rand() % sizeof(garbage);
+        Fill(garbage, length, 1);
+        m = Decompress(garbage, length, out, ENET_PROTOCOL_MAXIMUM_MTU, &guarded);
+        CHECK(m <= ENET_PROTOCOL_MAXIMUM_MTU && guarded, "garbage stays in bounds", length);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    if (!enet::SetCompressor(&host, enet::COMPRESSION_LZ4, &stats))
+    {
+        printf("FAIL could not create compressor\n");
+        return 1;
+    }
+    const size_t sizes[] = { 0, 1, 12, 13, 255, 270, ENET_PROTOCOL_MAXIMUM_MTU };
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+    {
+        for (int pattern = 0; pattern < 3; pattern++)
+            RoundTrip(sizes[s], pattern);
+    }
+    CheckMalformed();
+    enet::SetCompressor(&host, enet::COMPRESSION_NONE, NULL);
+    printf("%s\n", failures == 0 ? "ok" : "FAILED");
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,181 @@
+/* service.cc -- checks the events a service thread hands over.
+   Copyright (C) 2011 Memeo, Inc. */
+
+// Services a host on its own thread and connects to it over 127.0.0.1
+// from an ordinary host. Every event must name its connection by the
+// connectID it started with, disconnects included, or JS drops them as
+// stale. Build and run with `make test-service'.
+
+#include <cstdio>
+#include <cstring>
+#include <vector>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <enet/enet.h>
+#include "../service.h"
+
+static int failures = 0;
+
+#define CHECK(cond, what) \
+    do \
+    { \
+        if (!(cond)) \
+        { \
+            printf("FAIL %s: %s\n", what, #cond); \
+            failures++; \
+        } \
+    } \
+    while (0)
+
+// Collects the thread's events for the test to look through.
+class Collector : public enet::EventSink
+{
+private:
+    pthread_mutex_t lock;
+    std::vector<enet::ServiceEvent> events;
+
+public:
+    Collector()
+    {
+        pthread_mutex_init(&lock, NULL);
+    }
+
+    ~Collector()
+    {
+        pthread_mutex_destroy(&lock);
+    }
+
+    void Deliver(enet::ServiceEvent *event)
+    {
+        pthread_mutex_lock(&lock);
+        events.push_back(*event);
+        pthread_mutex_unlock(&lock);
+        if (event->packet != NULL)
+            enet_packet_destroy(event->packet);
+        delete event;
+    }
+
+    void Flush()
+    {
+    }
+
+    // Copies out the first event of the given type, if there is one yet.
+    bool Find(ENetEventType type, enet::ServiceEvent *found)
+    {
+        bool there = false;
+        pthread_mutex_lock(&lock);
+        for (size_t i = 0; i < events.size() && !there; i++)
+        {
+            if (events[i].type == type)
+            {
+                *found = events[i];
+                there = true;
+            }
+        }
+        pthread_mutex_unlock(&lock);
+        return there;
+    }
+};
+
+// Services client for up to five seconds, until collector has an event of
+// the given type. Returns whether it came.
+static bool Await(ENetHost *client, Collector *collector, ENetEventType type,
+    enet::ServiceEvent *found)
+{
+    enet_uint32 start = enet_time_get();
+    while (enet_time_get() - start < 5000)
+    {
+        ENetEvent event;
+        while (enet_host_service(client, &event, 10) > 0)
+        {
+            if (event.packet != NULL)
+                enet_packet_destroy(event.packet);
+        }
+        if (collector->Find(type, found))
+            return true;
+    }
+    return false;
+}
+
+static ENetHost *Listen(ENetAddress *address)
+{
+    address->host = ENET_HOST_ANY;
+    address->port = ENET_PORT_ANY;
+    ENetHost *host = enet_host_create(address, 4, 1, 0, 0);
+    if (host == NULL)
+        return NULL;
+    struct sockaddr_in sin;
+    socklen_t sinLength = sizeof(sin);
+    ::getsockname(host->socket, (struct sockaddr *) &sin, &sinLength);
+    enet_address_set_host(address, "127.0.0.1");
+    address->port = ENET_NET_TO_HOST_16(sin.sin_port);
+    return host;
+}
+
+// The client hangs up.
+static void TestPeerDisconnects()
+{
+    ENetAddress address;
+    ENetHost *server = Listen(&address);
+    ENetHost *client = enet_host_create(NULL, 1, 1, 0, 0);
+    Collector collector;
+    enet::ServiceThread thread(server, 0, &collector);
+    thread.Start();
+
+    ENetPeer *peer = enet_host_connect(client, &address, 1, 0);
+    enet::ServiceEvent connect, disconnect;
+    CHECK(Await(client, &collector, ENET_EVENT_TYPE_CONNECT, &connect), "peer connects");
+    CHECK(connect.connectID != 0, "connect names its connection");
+    enet_peer_disconnect(peer, 42);
+    CHECK(Await(client, &collector, ENET_EVENT_TYPE_DISCONNECT, &disconnect), "peer disconnects");
+    CHECK(disconnect.peerID == connect.peerID, "disconnect is for the same slot");
+    CHECK(disconnect.connectID == connect.connectID, "disconnect names the connection");
+    CHECK(disconnect.data == 42, "disconnect carries its data");
+
+    thread.Stop();
+    enet_host_destroy(client);
+    enet_host_destroy(server);
+}
+
+// The threaded side hangs up, through a command as JS would.
+static void TestThreadDisconnects()
+{
+    ENetAddress address;
+    ENetHost *server = Listen(&address);
+    ENetHost *client = enet_host_create(NULL, 1, 1, 0, 0);
+    Collector collector;
+    enet::ServiceThread thread(server, 0, &collector);
+    thread.Start();
+
+    enet_host_connect(client, &address, 1, 0);
+    enet::ServiceEvent connect, disconnect;
+    CHECK(Await(client, &collector, ENET_EVENT_TYPE_CONNECT, &connect), "peer connects");
+    enet::ServiceCommand command;
+    ::memset(&command, 0, sizeof(command));
+    command.type = enet::ServiceCommand::DISCONNECT;
+    command.peerID = connect.peerID;
+    command.connectID = connect.connectID;
+    thread.Post(command);
+    thread.Wake();
+    CHECK(Await(client, &collector, ENET_EVENT_TYPE_DISCONNECT, &disconnect), "thread disconnects");
+    CHECK(disconnect.connectID == connect.connectID, "own disconnect names the connection");
+
+    thread.Stop();
+    enet_host_destroy(client);
+    enet_host_destroy(server);
+}
+
+int main(int argc, char **argv)
+{
+    if (enet_initialize() != 0)
+    {
+        printf("FAIL could not initialize enet\n");
+        return 1;
+    }
+    TestPeerDisconnects();
+    TestThreadDisconnects();
+    enet_deinitialize();
+    printf("%s\n", failures == 0 ? "ok" : "FAILED");
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,325 @@
+/* trace.cc -- recording a host's traffic and playing it back.
+   Copyright (C) 2011 Memeo, Inc. */
+
+#include <cstring>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <arpa/inet.h>
+#include "trace.h"
+
+namespace enet
+{
+
+static const char kTraceMagic[8] = { 'E', 'N', 'E', 'T', 'T', 'R', 'C', '1' };
+
+static uint64_t MonotonicMicros()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static uint64_t RecordSize(size_t length)
+{
+    return (sizeof(TraceRecord) + length + 7) & ~(uint64_t) 7;
+}
+
+TraceWriter::TraceWriter()
+    : fd(-1), base(NULL), mapped(0), header(NULL), start(0)
+{
+    pthread_mutex_init(&lock, NULL);
+    ::memset(&stats, 0, sizeof(TraceStats));
+}
+
+TraceWriter::~TraceWriter()
+{
+    Close();
+    pthread_mutex_destroy(&lock);
+}
+
+bool TraceWriter::Open(const char *path, size_t capacity)
+{
+    Close();
+    capacity &= ~(size_t) 7;
+    if (capacity < sizeof(TraceRecord))
+        return false;
+    fd = ::open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return false;
+    mapped = sizeof(TraceFileHeader) + capacity;
+    void *p = MAP_FAILED;
+    if (::ftruncate(fd, mapped) == 0)
+        p = ::mmap(NULL, mapped, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED)
+    {
+        ::close(fd);
+        fd = -1;
+        return false;
+    }
+    base = (enet_uint8 *) p;
+    header = (TraceFileHeader *) base;
+    ::memset(header, 0, sizeof(TraceFileHeader));
+    ::memcpy(header->magic, kTraceMagic, sizeof(kTraceMagic));
+    header->headerSize = sizeof(TraceFileHeader);
+    header->recordSize = sizeof(TraceRecord);
+    header->capacity = capacity;
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    header->startMicros = (uint64_t) tv.tv_sec * 1000000 + tv.tv_usec;
+    start = MonotonicMicros();
+    ::memset(&stats, 0, sizeof(TraceStats));
+    return true;
+}
+
+void TraceWriter::Close()
+{
+    pthread_mutex_lock(&lock);
+    if (base != NULL)
+    {
+        ::munmap(base, mapped);
+        base = NULL;
+        header = NULL;
+    }
+    if (fd >= 0)
+    {
+        ::close(fd);
+        fd = -1;
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+// The record after the one at offset, following the wrap.
+uint64_t TraceWriter::Next(uint64_t offset)
+{
+    offset += ((TraceRecord *) (Ring() + offset))->size;
+    if (header->capacity - offset < sizeof(TraceRecord) || ((TraceRecord *) (Ring() + offset))->size == 0)
+        return 0;
+    return offset;
+}
+
+// Drops the oldest records while they lie between head and end, which is
+// about to be written.
+void TraceWriter::Evict(uint64_t end)
+{
+    while (header->count > 0 && header->tail >= header->head && header->tail < end)
+    {
+        header->tail = Next(header->tail);
+        header->count--;
+        header->overwritten++;
+        stats.overwritten++;
+    }
+}
+
+void TraceWriter::Append(TraceKind kind, enet_uint32 flags, enet_uint8 channel,
+    const ENetAddress *address, const void *data, size_t length)
+{
+    uint64_t micros = MonotonicMicros();
+    pthread_mutex_lock(&lock);
+    if (header == NULL)
+    {
+        pthread_mutex_unlock(&lock);
+        return;
+    }
+    uint64_t size = RecordSize(length);
+    if (size > header->capacity)
+    {
+        stats.skipped++;
+        pthread_mutex_unlock(&lock);
+        return;
+    }
+    if (header->head + size > header->capacity)
+    {
+        Evict(header->capacity);
+        if (header->capacity - header->head >= sizeof(TraceRecord))
+            ((TraceRecord *) (Ring() + header->head))->size = 0;
+        header->head = 0;
+        if (header->count == 0)
+            header->tail = 0;
+    }
+    Evict(header->head + size);
+    TraceRecord *record = (TraceRecord *) (Ring() + header->head);
+    record->length = (enet_uint32) length;
+    record->micros = micros - start;
+    record->host = address != NULL ? address->host : 0;
+    record->port = address != NULL ? address->port : 0;
+    record->kind = (enet_uint8) (kind | (flags & 0x0F) << 4);
+    record->channel = channel;
+    if (length > 0)
+        ::memcpy(record + 1, data, length);
+    record->size = (enet_uint32) size;
+    if (header->count == 0)
+        header->tail = header->head;
+    header->head += size;
+    header->count++;
+    stats.records++;
+    stats.bytes += length;
+    pthread_mutex_unlock(&lock);
+}
+
+int TraceWriter::Intercept(ENetHost *host, ENetEvent *event)
+{
+    Append(kTraceIncoming, 0, 0, &host->receivedAddress, host->receivedData, host->receivedDataLength);
+    return 0;
+}
+
+void TraceWriter::GetStats(TraceStats *out)
+{
+    pthread_mutex_lock(&lock);
+    *out = stats;
+    pthread_mutex_unlock(&lock);
+}
+
+TraceReplay::TraceReplay()
+    : base(NULL), mapped(0), speed(1), keepAddresses(false), running(false),
+      done(false), sent(0), started(false)
+{
+}
+
+TraceReplay::~TraceReplay()
+{
+    Stop();
+    if (base != NULL)
+        ::munmap(base, mapped);
+}
+
+bool TraceReplay::Open(const char *path, const char **error)
+{
+    *error = "could not read trace file";
+    int fd = ::open(path, O_RDONLY);
+    if (fd < 0)
+        return false;
+    struct stat st;
+    void *p = MAP_FAILED;
+    if (::fstat(fd, &st) == 0 && (size_t) st.st_size >= sizeof(TraceFileHeader))
+        p = ::mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (p == MAP_FAILED)
+        return false;
+    base = (enet_uint8 *) p;
+    mapped = st.st_size;
+
+    *error = "not a valid trace file";
+    const TraceFileHeader *header = (const TraceFileHeader *) base;
+    if (::memcmp(header->magic, kTraceMagic, sizeof(kTraceMagic)) != 0
+        || header->headerSize != sizeof(TraceFileHeader) || header->recordSize != sizeof(TraceRecord)
+        || header->capacity > mapped - sizeof(TraceFileHeader) || header->tail > header->capacity)
+        return false;
+    const enet_uint8 *ring = base + sizeof(TraceFileHeader);
+    uint64_t offset = header->tail;
+    for (uint64_t i = 0; i < header->count; i++)
+    {
+        if (header->capacity - offset < sizeof(TraceRecord))
+            offset = 0;
+        const TraceRecord *record = (const TraceRecord *) (ring + offset);
+        if (record->size == 0)
+        {
+            offset = 0;
+            record = (const TraceRecord *) ring;
+        }
+        if (record->size < RecordSize(record->length) || record->size > header->capacity - offset)
+            return false;
+        if ((record->kind & 0x0F) == kTraceIncoming)
+            records.push_back(record);
+        offset += record->size;
+    }
+    *error = NULL;
+    return true;
+}
+
+bool TraceReplay::Start(ENetHost *host, double speed_, bool keepAddresses_)
+{
+    if (started)
+        return true;
+    if (!injector.Open(host))
+        return false;
+    speed = speed_;
+    keepAddresses = keepAddresses_;
+    running = true;
+    if (pthread_create(&thread, NULL, Run, this) != 0)
+    {
+        running = false;
+        injector.Close();
+        return false;
+    }
+    started = true;
+    return true;
+}
+
+void TraceReplay::Stop()
+{
+    if (!started)
+        return;
+    running = false;
+    pthread_join(thread, NULL);
+    started = false;
+    injector.Close();
+}
+
+int TraceReplay::Intercept(ENetHost *host, ENetEvent *event)
+{
+    int unwrapped = injector.Unwrap(host);
+    return unwrapped < 0 ? 1 : 0;
+}
+
+void TraceReplay::GetStats(ReplayStats *stats)
+{
+    stats->records = records.size();
+    stats->sent = sent;
+    stats->done = done;
+}
+
+ENetAddress TraceReplay::MapAddress(const TraceRecord *record)
+{
+    ENetAddress address;
+    address.host = record->host;
+    address.port = record->port;
+    if (keepAddresses)
+        return address;
+    std::pair<enet_uint32, enet_uint16> key(record->host, record->port);
+    std::map<std::pair<enet_uint32, enet_uint16>, ENetAddress>::iterator it = addresses.find(key);
+    if (it != addresses.end())
+        return it->second;
+    // 127.1.0.1 onwards; past 65534 sources they start to share.
+    enet_uint32 n = (enet_uint32) (addresses.size() % 65534) + 1;
+    address.host = htonl(0x7F010000 | n);
+    addresses[key] = address;
+    return address;
+}
+
+void *TraceReplay::Run(void *arg)
+{
+    ((TraceReplay *) arg)->Loop();
+    return NULL;
+}
+
+void TraceReplay::Loop()
+{
+    uint64_t began = MonotonicMicros();
+    uint64_t first = records.empty() ? 0 : records[0]->micros;
+    for (size_t i = 0; i < records.size() && running; i++)
+    {
+        const TraceRecord *record = records[i];
+        if (speed > 0)
+        {
+            uint64_t due = began + (uint64_t) ((record->micros - first) / speed);
+            uint64_t now = MonotonicMicros();
+            // Sleep in short steps so Stop() doesn't wait out a long gap.
+            while (running && now < due)
+            {
+                uint64_t wait = due - now < 10000 ? due - now : 10000;
+                struct timespec ts = { 0, (long) wait * 1000 };
+                nanosleep(&ts, NULL);
+                now = MonotonicMicros();
+            }
+        }
+        injector.Send(MapAddress(record), record + 1, record->length);
+        sent = i + 1;
+    }
+    done = true;
+}
+
+}
@@ -0,0 +1,159 @@
+/* trace.h -- recording a host's traffic and playing it back.
+   Copyright (C) 2011 Memeo, Inc. */
+
+#ifndef ENET_JS_TRACE_H
+#define ENET_JS_TRACE_H
+
+#include <enet/enet.h>
+#include <map>
+#include <vector>
+#include <stdint.h>
+#include <pthread.h>
+#include "intercept.h"
+#include "inject.h"
+
+namespace enet
+{
+
+// A trace file is a TraceFileHeader followed by a ring of `capacity'
+// bytes of records. Each record is a TraceRecord and its payload, padded
+// to a multiple of 8 bytes. Records are written at `head'; when one
+// doesn't fit before the end of the ring, a record header with size 0
+// (or too little room left for one) marks the wrap, and writing resumes
+// at the start of the ring, overwriting the oldest records. The `count'
+// live records start at `tail'. All fields are in host byte order except
+// addresses, which are as enet stores them.
+enum TraceKind
+{
+    kTraceIncoming = 0,     // a datagram as received, before enet parses it
+    kTraceOutgoing = 1,     // a packet queued for a peer
+    kTraceBroadcast = 2,    // a packet queued for every peer
+    kTraceRaw = 3           // a datagram sent with sendRaw
+};
+
+struct TraceFileHeader
+{
+    char magic[8];              // "ENETTRC1"
+    enet_uint32 headerSize;     // sizeof(TraceFileHeader)
+    enet_uint32 recordSize;     // sizeof(TraceRecord)
+    uint64_t capacity;
+    uint64_t head;
+    uint64_t tail;
+    uint64_t count;
+    uint64_t overwritten;       // records lost to wrapping
+    uint64_t startMicros;       // wall clock when the trace began
+    enet_uint8 reserved[64];
+};
+
+struct TraceRecord
+{
+    enet_uint32 size;           // header, payload and padding; 0 at the wrap
+    enet_uint32 length;         // payload bytes
+    uint64_t micros;            // since the trace began
+    enet_uint32 host;           // where it came from, or went to
+    enet_uint16 port;
+    enet_uint8 kind;            // TraceKind, with packet flags in the top 4 bits
+    enet_uint8 channel;
+};
+
+struct TraceStats
+{
+    double records;
+    double bytes;               // payload bytes recorded
+    double overwritten;
+    double skipped;             // larger than the whole ring
+};
+
+// Records traffic into a memory-mapped trace file. As an interceptor it
+// records every incoming datagram and passes it on; outgoing packets are
+// recorded by whoever sends them, with Append(). Safe to use from several
+// threads.
+class TraceWriter : public Interceptor
+{
+public:
+    TraceWriter();
+    ~TraceWriter();
+
+    // Creates or truncates path with room for capacity bytes of records.
+    bool Open(const char *path, size_t capacity);
+    void Close();
+
+    int Intercept(ENetHost *host, ENetEvent *event);
+
+    // address may be NULL.
+    void Append(TraceKind kind, enet_uint32 flags, enet_uint8 channel,
+        const ENetAddress *address, const void *data, size_t length);
+
+    void GetStats(TraceStats *stats);
+
+private:
+    enet_uint8 *Ring() { return base + sizeof(TraceFileHeader); }
+    uint64_t Next(uint64_t offset);
+    void Evict(uint64_t end);
+
+    pthread_mutex_t lock;
+    int fd;
+    enet_uint8 *base;
+    size_t mapped;
+    TraceFileHeader *header;
+    uint64_t start;             // monotonic micros at Open
+    TraceStats stats;
+
+    TraceWriter(const TraceWriter&);
+    TraceWriter& operator=(const TraceWriter&);
+};
+
+struct ReplayStats
+{
+    double records;             // incoming datagrams in the trace
+    double sent;
+    bool done;
+};
+
+// Plays the incoming datagrams of a trace back into a host, through a
+// Reinjector, with their original spacing divided by `speed' (0 sends them
+// as fast as possible). Unless keepAddresses is set, each distinct source
+// is mapped to its own address in 127.1.0.0/16, so the host's replies stay
+// on this machine. Runs on its own thread; as an interceptor it unwraps the
+// replayed datagrams.
+class TraceReplay : public Interceptor
+{
+public:
+    TraceReplay();
+    // Stops the thread if it is running.
+    ~TraceReplay();
+
+    // Returns false, with *error set, if the trace can't be read.
+    bool Open(const char *path, const char **error);
+    bool Start(ENetHost *host, double speed, bool keepAddresses);
+    void Stop();
+
+    int Intercept(ENetHost *host, ENetEvent *event);
+
+    void GetStats(ReplayStats *stats);
+
+private:
+    static void *Run(void *arg);
+    void Loop();
+    ENetAddress MapAddress(const TraceRecord *record);
+
+    enet_uint8 *base;
+    size_t mapped;
+    std::vector<const TraceRecord *> records;
+    std::map<std::pair<enet_uint32, enet_uint16>, ENetAddress> addresses;
+    Reinjector injector;
+    double speed;
+    bool keepAddresses;
+    volatile bool running;
+    volatile bool done;
+    volatile size_t sent;
+    bool started;
+    pthread_t thread;
+
+    TraceReplay(const TraceReplay&);
+    TraceReplay& operator=(const TraceReplay&);
+};
+
+}
+
+#endif